@@ -0,0 +1,860 @@
+/*
+ * see-bench - Throughput benchmark for see.
+ * Generates corpora, runs every copy engine of a see binary against
+ * /dev/null, a pipe and a regular file, and prints one JSON object per
+ * run on stdout so results can be diffed between versions.
+ * POSIX only; syscall counts need ptrace (Linux).
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* For wait4() and ptrace options on Linux */
+#endif
+#if !defined(_POSIX_C_SOURCE) && !defined(_GNU_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/ptrace.h>
+#define BENCH_HAVE_PTRACE 1
+#endif
+
+/* The startup case through see --serve, speaking its protocol directly. */
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#if defined(SCM_RIGHTS) && defined(CMSG_SPACE)
+#define BENCH_HAVE_SERVE 1
+#define SERVE_MAGIC 0x53454531UL /* "SEE1" */
+#define SERVE_FDS   4 /* stdin, stdout, stderr, working directory */
+#endif
+
+#define PROG_NAME "see-bench"
+
+#define MIB ((long)1024 * 1024)
+#define FEED_CHUNK (256 * 1024) /* Bytes per write when feeding a pipe */
+
+#define TINY_FILES   2000 /* Files in the 'tiny' corpus */
+#define TINY_SIZE    4096 /* Bytes per tiny file */
+#define HUGE_FILES   2    /* Files in the 'huge' corpus */
+#define SPARSE_DATA  MIB  /* Data at each end of the sparse file */
+#define STARTUP_RUNS 500  /* Default -n: runs of the startup case */
+
+/* A set of inputs handed to see in one run. */
+struct corpus {
+    const char *name;
+    char      **paths;    /* FILE operands, NULL-terminated */
+    int         count;
+    long        feed;     /* Bytes piped to stdin instead, if non-zero */
+    double      bytes;    /* Bytes see reads */
+};
+
+/* Measurements of one run of see. */
+struct result {
+    double seconds; /* Wall time */
+    double user;    /* CPU seconds in user mode */
+    double sys;     /* CPU seconds in the kernel */
+    long   syscalls; /* -1 if not counted */
+    int    status;   /* Exit status of see, or -1 */
+};
+
+static const char *engines[] = {
+    "auto", "read", "zerocopy", "mmap", "threaded", "uring", NULL
+};
+static const char *sinks[] = { "devnull", "pipe", "file", NULL };
+
+static const char *opt_binary = "./see";
+static const char *opt_engines; /* -e; NULL runs all */
+static long        opt_size = 64; /* -s: MiB per huge file */
+static int         opt_repeat = 3; /* -r */
+static int         opt_runs = STARTUP_RUNS; /* -n */
+
+static char  work_dir[4096];
+static char  sink_path[4096 + 8];
+static char *feed_buf;
+#ifdef BENCH_HAVE_SERVE
+static char  serve_path[4096 + 16];
+static pid_t server_pid = -1;
+
+/* The header of a --serve request, as src/see.c reads it. */
+struct serve_header {
+    unsigned int magic;
+    unsigned int argc;
+    unsigned int bytes;
+};
+#endif
+
+static void usage(void);
+static void fatal(const char *what);
+static double now(void);
+static char *join_path(const char *dir, const char *name);
+static void write_file(const char *path, long size, long hole);
+static void make_corpus(struct corpus *c, const char *name, int files,
+                        long size, long hole);
+static void remove_work_dir(void);
+static int  engine_selected(const char *engine);
+static pid_t start_drain(int fd, int other_fd);
+static pid_t start_feed(int fd, int other_fd, long bytes);
+static char **build_argv(const struct corpus *c, const char *engine);
+static int  run_once(const struct corpus *c, const char *engine,
+                     const char *sink, int traced, struct result *r);
+static int  compare_doubles(const void *a, const void *b);
+static int  run_startup(const struct corpus *c, const char *engine,
+                        int served);
+#ifdef BENCH_HAVE_SERVE
+static int  start_server(void);
+static void stop_server(void);
+static int  serve_once(const struct corpus *c, const char *engine,
+                       int out_fd, int dir_fd, struct result *r);
+#endif
+#ifdef BENCH_HAVE_PTRACE
+static long trace_child(pid_t pid, int *status);
+#endif
+static void report(const struct corpus *c, const char *engine,
+                   const char *sink, const struct result *best);
+
+static void usage(void) {
+    printf("Usage: %s [-b BINARY] [-d DIR] [-e ENGINES] [-n N] [-r N] "
+           "[-s MIB]\n"
+           "Benchmark see; prints one JSON object per run.\n\n"
+           "  -b BINARY  see binary to run (default ./see)\n"
+           "  -d DIR     where to create corpora (default $TMPDIR)\n"
+           "  -e LIST    comma-separated engines (default all)\n"
+           "  -n N       runs of the startup case (default %d)\n"
+           "  -r N       runs per case; the fastest is kept (default 3)\n"
+           "  -s MIB     size of each huge file and stdin feed "
+           "(default 64)\n",
+           PROG_NAME, STARTUP_RUNS);
+    exit(EXIT_SUCCESS);
+}
+
+/* Reports the failed operation 'what' with errno and exits. */
+static void fatal(const char *what) {
+    int err = errno;
+    fprintf(stderr, "%s: %s: %s\n", PROG_NAME, what, strerror(err));
+#ifdef BENCH_HAVE_SERVE
+    stop_server();
+#endif
+    remove_work_dir();
+    exit(EXIT_FAILURE);
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+        fatal("clock_gettime");
+    }
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static char *join_path(const char *dir, const char *name) {
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char *path = (char *)malloc(len);
+
+    if (path == NULL) {
+        fatal("malloc");
+    }
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+/* Create 'path' holding 'size' bytes. With 'hole' set, only SPARSE_DATA
+ * bytes at each end are written and the middle is left unallocated. */
+static void write_file(const char *path, long size, long hole) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    long done = 0;
+
+    if (fd == -1) {
+        fatal(path);
+    }
+    while (done < size) {
+        long chunk = size - done;
+        ssize_t n;
+
+        if (hole && done == SPARSE_DATA && size - done > SPARSE_DATA) {
+            done = size - SPARSE_DATA;
+            if (lseek(fd, (off_t)done, SEEK_SET) == (off_t)-1) {
+                fatal(path);
+            }
+            continue;
+        }
+        if (chunk > FEED_CHUNK) {
+            chunk = FEED_CHUNK;
+        }
+        n = write(fd, feed_buf, (size_t)chunk);
+        if (n <= 0) {
+            fatal(path);
+        }
+        done += (long)n;
+    }
+    if (close(fd) != 0) {
+        fatal(path);
+    }
+}
+
+static void make_corpus(struct corpus *c, const char *name, int files,
+                        long size, long hole) {
+    int i;
+
+    c->name = name;
+    c->count = files;
+    c->feed = 0;
+    c->bytes = (double)files * (double)size;
+    c->paths = (char **)calloc((size_t)files + 1, sizeof(*c->paths));
+    if (c->paths == NULL) {
+        fatal("calloc");
+    }
+    for (i = 0; i < files; ++i) {
+        char file_name[64];
+
+        sprintf(file_name, "%s-%04d", name, i);
+        c->paths[i] = join_path(work_dir, file_name);
+        write_file(c->paths[i], size, hole);
+    }
+}
+
+/* Deletes the corpora; the work directory holds only files we made. */
+static void remove_work_dir(void) {
+    DIR *dir;
+    struct dirent *entry;
+
+    if (work_dir[0] == '\0') {
+        return;
+    }
+    dir = opendir(work_dir);
+    if (dir != NULL) {
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") != 0 &&
+                strcmp(entry->d_name, "..") != 0) {
+                char *path = join_path(work_dir, entry->d_name);
+                (void)unlink(path);
+                free(path);
+            }
+        }
+        (void)closedir(dir);
+    }
+    (void)rmdir(work_dir);
+    work_dir[0] = '\0';
+}
+
+static int engine_selected(const char *engine) {
+    const char *p = opt_engines;
+    size_t len = strlen(engine);
+
+    if (p == NULL) {
+        return 1;
+    }
+    while (*p != '\0') {
+        size_t n = strcspn(p, ",");
+        if (n == len && strncmp(p, engine, len) == 0) {
+            return 1;
+        }
+        p += n;
+        if (*p == ',') {
+            ++p;
+        }
+    }
+    return 0;
+}
+
+/* Fork a process that reads and discards everything from 'fd'. The child
+ * closes 'other_fd', the write end, or it would never see EOF. */
+static pid_t start_drain(int fd, int other_fd) {
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        fatal("fork");
+    }
+    if (pid == 0) {
+        (void)close(other_fd);
+        for (;;) {
+            ssize_t n = read(fd, feed_buf, FEED_CHUNK);
+            if (n == 0 || (n < 0 && errno != EINTR)) {
+                break;
+            }
+        }
+        _exit(0);
+    }
+    return pid;
+}
+
+/* Fork a process that writes 'bytes' bytes into 'fd', closing 'other_fd'
+ * (the sink, which must not stay open in the feeder). */
+static pid_t start_feed(int fd, int other_fd, long bytes) {
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        fatal("fork");
+    }
+    if (pid == 0) {
+        (void)close(other_fd);
+        while (bytes > 0) {
+            ssize_t n = write(fd, feed_buf,
+                              (size_t)(bytes < FEED_CHUNK ? bytes
+                                                          : FEED_CHUNK));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            bytes -= (long)n;
+        }
+        _exit(0);
+    }
+    return pid;
+}
+
+static char **build_argv(const struct corpus *c, const char *engine) {
+    char **argv = (char **)calloc((size_t)c->count + 4, sizeof(*argv));
+    char *engine_arg = (char *)malloc(strlen(engine) + sizeof("--engine="));
+    int i;
+
+    if (argv == NULL || engine_arg == NULL) {
+        fatal("malloc");
+    }
+    sprintf(engine_arg, "--engine=%s", engine);
+    argv[0] = (char *)opt_binary;
+    argv[1] = engine_arg;
+    argv[2] = (char *)"--";
+    for (i = 0; i < c->count; ++i) {
+        argv[3 + i] = c->paths[i];
+    }
+    return argv;
+}
+
+#ifdef BENCH_HAVE_PTRACE
+/* Resume the tracee 'pid' (stopped at exec) and count its system calls,
+ * threads included, until it exits. Sets '*status' to its wait status. */
+static long trace_child(pid_t pid, int *status) {
+    long stops = 0;
+
+    if (ptrace(PTRACE_SETOPTIONS, pid, NULL,
+               (void *)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE)) !=
+        0) {
+        fatal("ptrace");
+    }
+    (void)ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+    for (;;) {
+        int st;
+        int sig = 0;
+        pid_t tid = waitpid(-1, &st, __WALL);
+
+        if (tid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fatal("waitpid");
+        }
+        if (WIFEXITED(st) || WIFSIGNALED(st)) {
+            if (tid == pid) {
+                *status = st;
+                break;
+            }
+            continue; /* A thread, or a feed/drain helper. */
+        }
+        if (!WIFSTOPPED(st)) {
+            continue;
+        }
+        if (WSTOPSIG(st) == (SIGTRAP | 0x80)) {
+            ++stops; /* Entry and exit stops alternate per thread. */
+        } else if (WSTOPSIG(st) != SIGTRAP && WSTOPSIG(st) != SIGSTOP) {
+            sig = WSTOPSIG(st); /* Deliver real signals. */
+        }
+        (void)ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)sig);
+    }
+    return stops / 2;
+}
+#endif
+
+/* Run see once over 'c' with 'engine' into 'sink'. With 'traced' set,
+ * count system calls instead of timing. Returns 0 on success. */
+static int run_once(const struct corpus *c, const char *engine,
+                    const char *sink, int traced, struct result *r) {
+    char **argv = build_argv(c, engine);
+    int in_pipe[2] = { -1, -1 };
+    int out_pipe[2] = { -1, -1 };
+    pid_t helper_in = -1;
+    pid_t helper_out = -1;
+    int out_fd;
+    int st = 0;
+    pid_t pid;
+    double start;
+    struct rusage usage;
+
+    if (strcmp(sink, "devnull") == 0) {
+        out_fd = open("/dev/null", O_WRONLY);
+    } else if (strcmp(sink, "file") == 0) {
+        out_fd = open(sink_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    } else {
+        if (pipe(out_pipe) != 0) {
+            fatal("pipe");
+        }
+        helper_out = start_drain(out_pipe[0], out_pipe[1]);
+        (void)close(out_pipe[0]);
+        out_fd = out_pipe[1];
+    }
+    if (out_fd == -1) {
+        fatal(sink);
+    }
+    if (c->feed > 0) {
+        if (pipe(in_pipe) != 0) {
+            fatal("pipe");
+        }
+        helper_in = start_feed(in_pipe[1], out_fd, c->feed);
+        (void)close(in_pipe[1]);
+    }
+
+    start = now();
+    pid = fork();
+    if (pid == -1) {
+        fatal("fork");
+    }
+    if (pid == 0) {
+        if (in_pipe[0] != -1) {
+            (void)dup2(in_pipe[0], STDIN_FILENO);
+        }
+        (void)dup2(out_fd, STDOUT_FILENO);
+#ifdef BENCH_HAVE_PTRACE
+        if (traced && ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0) {
+            _exit(127);
+        }
+#else
+        (void)traced;
+#endif
+        execv(opt_binary, argv);
+        _exit(127);
+    }
+    (void)close(out_fd);
+    if (in_pipe[0] != -1) {
+        (void)close(in_pipe[0]);
+    }
+
+    r->syscalls = -1;
+    memset(&usage, 0, sizeof(usage));
+#ifdef BENCH_HAVE_PTRACE
+    if (traced) {
+        if (waitpid(pid, &st, 0) != pid || !WIFSTOPPED(st)) {
+            fatal("ptrace");
+        }
+        r->syscalls = trace_child(pid, &st);
+    } else
+#endif
+    if (wait4(pid, &st, 0, &usage) != pid) {
+        fatal("wait4");
+    }
+    r->seconds = now() - start;
+    r->user = (double)usage.ru_utime.tv_sec +
+              (double)usage.ru_utime.tv_usec / 1e6;
+    r->sys = (double)usage.ru_stime.tv_sec +
+             (double)usage.ru_stime.tv_usec / 1e6;
+    r->status = WIFEXITED(st) ? WEXITSTATUS(st) : -1;
+
+    /* Helpers may already have been reaped while tracing. */
+    if (helper_in != -1) {
+        (void)kill(helper_in, SIGTERM);
+        (void)waitpid(helper_in, NULL, 0);
+    }
+    if (helper_out != -1) {
+        (void)waitpid(helper_out, NULL, 0);
+    }
+    free(argv[1]);
+    free(argv);
+    return r->status == 0 ? 0 : 1;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Run see 'opt_runs' times over the one small FILE of 'c' into /dev/null
+ * and print the median and 99th percentile of fork-to-exit time, which
+ * is what a script running see once per file pays. With 'served' set,
+ * each run is instead a request to the see --serve started by
+ * start_server(), timed from connect to its status byte. Returns 0 on
+ * success. */
+static int run_startup(const struct corpus *c, const char *engine,
+                       int served) {
+    double *times = (double *)malloc((size_t)opt_runs * sizeof(*times));
+    struct result r;
+    int failed = 0;
+    int i;
+#ifdef BENCH_HAVE_SERVE
+    int out_fd = -1;
+    int dir_fd = -1;
+#endif
+
+    if (times == NULL) {
+        fatal("malloc");
+    }
+#ifdef BENCH_HAVE_SERVE
+    if (served) {
+        out_fd = open("/dev/null", O_WRONLY);
+        dir_fd = open(".", O_RDONLY);
+        if (out_fd == -1 || dir_fd == -1) {
+            fatal("open");
+        }
+    }
+#endif
+    for (i = 0; i < opt_runs; ++i) {
+#ifdef BENCH_HAVE_SERVE
+        if (served) {
+            failed |= serve_once(c, engine, out_fd, dir_fd, &r);
+        } else
+#endif
+        failed |= run_once(c, engine, "devnull", 0, &r);
+        times[i] = r.seconds;
+    }
+    qsort(times, (size_t)opt_runs, sizeof(*times), compare_doubles);
+#ifdef BENCH_HAVE_PTRACE
+    if (!served) {
+        failed |= run_once(c, engine, "devnull", 1, &r);
+    }
+#endif
+#ifdef BENCH_HAVE_SERVE
+    if (served) {
+        (void)close(out_fd);
+        (void)close(dir_fd);
+    }
+#else
+    (void)served;
+#endif
+
+    /* Nearest-rank percentiles. */
+    printf("{\"corpus\":\"%s\",\"engine\":\"%s\",\"sink\":\"devnull\","
+           "\"files\":%d,\"bytes\":%.0f,\"runs\":%d,\"min_us\":%.1f,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,",
+           c->name, engine, c->count, c->bytes, opt_runs, times[0] * 1e6,
+           times[(opt_runs + 1) / 2 - 1] * 1e6,
+           times[(opt_runs * 99 + 99) / 100 - 1] * 1e6);
+    if (r.syscalls >= 0) {
+        printf("\"syscalls\":%ld,", r.syscalls);
+    } else {
+        printf("\"syscalls\":null,");
+    }
+    printf("\"status\":%d}\n", r.status);
+    (void)fflush(stdout);
+    free(times);
+    return failed;
+}
+
+#ifdef BENCH_HAVE_SERVE
+/* Start 'opt_binary --serve' on a socket in the work directory and wait
+ * for it to answer. Returns 0, or 1 if it never did (the binary may be
+ * built without --serve). */
+static int start_server(void) {
+    struct sockaddr_un addr;
+    struct timespec pause;
+    char *arg;
+    int tries;
+
+    sprintf(serve_path, "%s/serve.sock", work_dir);
+    if (strlen(serve_path) >= sizeof(addr.sun_path)) {
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, serve_path);
+    arg = (char *)malloc(strlen(serve_path) + sizeof("--serve="));
+    if (arg == NULL) {
+        fatal("malloc");
+    }
+    sprintf(arg, "--serve=%s", serve_path);
+    pause.tv_sec = 0;
+    pause.tv_nsec = 10000000; /* 10 ms between tries, 2 s in all */
+
+    server_pid = fork();
+    if (server_pid == -1) {
+        fatal("fork");
+    }
+    if (server_pid == 0) {
+        char *argv[3];
+
+        argv[0] = (char *)opt_binary;
+        argv[1] = arg;
+        argv[2] = NULL;
+        execv(opt_binary, argv);
+        _exit(127);
+    }
+    free(arg);
+
+    for (tries = 0; tries < 200; ++tries) {
+        int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        int rc;
+
+        if (sock == -1) {
+            fatal("socket");
+        }
+        rc = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+        (void)close(sock);
+        if (rc == 0) {
+            return 0;
+        }
+        if (waitpid(server_pid, NULL, WNOHANG) == server_pid) {
+            server_pid = -1;
+            return 1;
+        }
+        (void)nanosleep(&pause, NULL);
+    }
+    stop_server();
+    return 1;
+}
+
+static void stop_server(void) {
+    if (server_pid != -1) {
+        (void)kill(server_pid, SIGTERM);
+        (void)waitpid(server_pid, NULL, 0);
+        server_pid = -1;
+    }
+}
+
+/* Ask the server to run see over 'c' with 'engine', its output on
+ * 'out_fd' and 'dir_fd' as its directory. Returns 0 on success. */
+static int serve_once(const struct corpus *c, const char *engine,
+                      int out_fd, int dir_fd, struct result *r) {
+    char **argv = build_argv(c, engine);
+    struct sockaddr_un addr;
+    struct serve_header header;
+    union {
+        struct cmsghdr header;
+        char           space[CMSG_SPACE(SERVE_FDS * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    int fds[SERVE_FDS];
+    char *text;
+    size_t bytes = 0;
+    unsigned char status = 255;
+    double start;
+    int sock;
+    int i;
+
+    for (i = 0; argv[i] != NULL; ++i) {
+        bytes += strlen(argv[i]) + 1;
+    }
+    text = (char *)malloc(bytes);
+    if (text == NULL) {
+        fatal("malloc");
+    }
+    for (i = 0, bytes = 0; argv[i] != NULL; ++i) {
+        strcpy(text + bytes, argv[i]);
+        bytes += strlen(argv[i]) + 1;
+    }
+    header.magic = SERVE_MAGIC;
+    header.argc = (unsigned int)i;
+    header.bytes = (unsigned int)bytes;
+    fds[0] = STDIN_FILENO;
+    fds[1] = out_fd;
+    fds[2] = STDERR_FILENO;
+    fds[3] = dir_fd;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, serve_path);
+
+    start = now();
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        fatal("socket");
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fatal(serve_path);
+    }
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(sock, &msg, 0) != (ssize_t)sizeof(header) ||
+        write(sock, text, bytes) != (ssize_t)bytes ||
+        read(sock, &status, 1) != 1) {
+        status = 255;
+    }
+    (void)close(sock);
+    r->seconds = now() - start;
+    r->user = 0.0;
+    r->sys = 0.0;
+    r->syscalls = -1;
+    r->status = (status == 255) ? -1 : (int)status;
+
+    free(text);
+    free(argv[1]);
+    free(argv);
+    return r->status == 0 ? 0 : 1;
+}
+#endif
+
+static void report(const struct corpus *c, const char *engine,
+                   const char *sink, const struct result *best) {
+    double mb = c->bytes / (double)MIB;
+
+    printf("{\"corpus\":\"%s\",\"engine\":\"%s\",\"sink\":\"%s\","
+           "\"files\":%d,\"bytes\":%.0f,\"seconds\":%.6f,\"gbps\":%.3f,"
+           "\"user_s\":%.6f,\"sys_s\":%.6f,",
+           c->name, engine, sink, c->count, c->bytes, best->seconds,
+           best->seconds > 0 ? c->bytes / best->seconds / 1e9 : 0.0,
+           best->user, best->sys);
+    if (best->syscalls >= 0) {
+        printf("\"syscalls\":%ld,\"syscalls_per_mb\":%.2f,",
+               best->syscalls, mb > 0 ? (double)best->syscalls / mb : 0.0);
+    } else {
+        printf("\"syscalls\":null,\"syscalls_per_mb\":null,");
+    }
+    printf("\"status\":%d}\n", best->status);
+    (void)fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    struct corpus corpora[4];
+    struct corpus startup;
+    const char *base = getenv("TMPDIR");
+    int corpus_count;
+    int i;
+    int failed = 0;
+
+    for (i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            usage();
+        } else if (value == NULL) {
+            fprintf(stderr, "%s: missing value for '%s'\n", PROG_NAME, arg);
+            return EXIT_FAILURE;
+        } else if (strcmp(arg, "-b") == 0) {
+            opt_binary = value;
+        } else if (strcmp(arg, "-d") == 0) {
+            base = value;
+        } else if (strcmp(arg, "-e") == 0) {
+            opt_engines = value;
+        } else if (strcmp(arg, "-n") == 0 && atoi(value) > 0) {
+            opt_runs = atoi(value);
+        } else if (strcmp(arg, "-r") == 0 && atoi(value) > 0) {
+            opt_repeat = atoi(value);
+        } else if (strcmp(arg, "-s") == 0 && atol(value) > 0) {
+            opt_size = atol(value);
+        } else {
+            fprintf(stderr, "%s: invalid option '%s %s'\n",
+                    PROG_NAME, arg, value);
+            return EXIT_FAILURE;
+        }
+        ++i;
+    }
+    if (access(opt_binary, X_OK) != 0) {
+        fatal(opt_binary);
+    }
+
+    feed_buf = (char *)malloc(FEED_CHUNK);
+    if (feed_buf == NULL) {
+        fatal("malloc");
+    }
+    for (i = 0; i < FEED_CHUNK; ++i) {
+        feed_buf[i] = (char)('a' + i % 26);
+        if (i % 64 == 63) {
+            feed_buf[i] = '\n';
+        }
+    }
+
+    if (base == NULL || strlen(base) > sizeof(work_dir) - 32) {
+        base = "/tmp";
+    }
+    sprintf(work_dir, "%s/see-bench-XXXXXX", base);
+    if (mkdtemp(work_dir) == NULL) {
+        work_dir[0] = '\0';
+        fatal("mkdtemp");
+    }
+    sprintf(sink_path, "%s/sink", work_dir);
+    (void)signal(SIGPIPE, SIG_IGN);
+
+    fprintf(stderr, "%s: generating corpora in %s\n", PROG_NAME, work_dir);
+    make_corpus(&corpora[0], "tiny", TINY_FILES, TINY_SIZE, 0);
+    make_corpus(&corpora[1], "huge", HUGE_FILES, opt_size * MIB, 0);
+    make_corpus(&corpora[2], "sparse", 1, 4 * opt_size * MIB, 1);
+    corpora[3].name = "stdin";
+    corpora[3].paths = NULL;
+    corpora[3].count = 0;
+    corpora[3].feed = opt_size * MIB;
+    corpora[3].bytes = (double)corpora[3].feed;
+    corpus_count = 4;
+    make_corpus(&startup, "startup", 1, TINY_SIZE, 0);
+
+    for (i = 0; i < corpus_count; ++i) {
+        int e;
+        for (e = 0; engines[e] != NULL; ++e) {
+            int k;
+            if (!engine_selected(engines[e])) {
+                continue;
+            }
+            for (k = 0; sinks[k] != NULL; ++k) {
+                struct result best;
+                struct result r;
+                int rep;
+
+                memset(&best, 0, sizeof(best));
+                best.seconds = -1;
+                for (rep = 0; rep < opt_repeat; ++rep) {
+                    failed |= run_once(&corpora[i], engines[e], sinks[k], 0,
+                                       &r);
+                    if (best.seconds < 0 || r.seconds < best.seconds) {
+                        best = r;
+                    }
+                }
+#ifdef BENCH_HAVE_PTRACE
+                failed |= run_once(&corpora[i], engines[e], sinks[k], 1, &r);
+                best.syscalls = r.syscalls;
+#endif
+                report(&corpora[i], engines[e], sinks[k], &best);
+            }
+        }
+    }
+
+    for (i = 0; engines[i] != NULL; ++i) {
+        if (engine_selected(engines[i])) {
+            failed |= run_startup(&startup, engines[i], 0);
+        }
+    }
+#ifdef BENCH_HAVE_SERVE
+    /* The same requests handed to a resident server. */
+    if (start_server() == 0) {
+        startup.name = "startup-serve";
+        for (i = 0; engines[i] != NULL; ++i) {
+            if (engine_selected(engines[i])) {
+                failed |= run_startup(&startup, engines[i], 1);
+            }
+        }
+        stop_server();
+    } else {
+        fprintf(stderr, "%s: %s has no --serve; skipping startup-serve\n",
+                PROG_NAME, opt_binary);
+    }
+#endif
+
+    remove_work_dir();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,83 @@
+/*
+ * libsee - the copy engines of see(1) as a library.
+ * C89; link with libsee.a or -lsee (plus -pthread where threads are on).
+ */
+
+#ifndef SEE_H
+#define SEE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Copy engines, as --engine names them. SEE_ENGINE_AUTO picks per input
+ * at run time: sparse-aware copy for files with holes, in-kernel copy
+ * where the fd pair allows it, mmap for big files, then read/write. */
+#define SEE_ENGINE_AUTO     0
+#define SEE_ENGINE_READ     1 /* read(2)/write(2) loop only */
+#define SEE_ENGINE_ZEROCOPY 2 /* copy_file_range, sendfile or splice */
+#define SEE_ENGINE_MMAP     3 /* Map regular files, whatever their size */
+#define SEE_ENGINE_THREADED 4 /* Reader thread filling a ring of buffers */
+
+/* Unsigned 64-bit type for sizes and offsets. 'long long' is an
+ * extension in C89, marked as one so -pedantic builds stay quiet. */
+#if defined(_MSC_VER)
+typedef unsigned __int64 see_u64;
+#elif defined(__GNUC__)
+__extension__ typedef unsigned long long see_u64;
+#else
+typedef unsigned long long see_u64;
+#endif
+
+/* see_options.length for a copy running to EOF. */
+#define SEE_LENGTH_ALL (~(see_u64)0)
+
+/* Options of one see_copy(). Zero them, set 'size' and 'length', then
+ * the fields wanted; a 'length' of 0 copies nothing, as --length=0 does.
+ * Fields added later go at the end, so older callers passing a smaller
+ * 'size' get their defaults; NULL options copy everything. */
+struct see_options {
+    size_t  size;        /* sizeof(struct see_options) */
+    int     engine;      /* SEE_ENGINE_* */
+    size_t  buffer_size; /* Read size; 0 picks one per input */
+    see_u64 offset;      /* Skipped first, as with --offset */
+    see_u64 length;      /* At most this many bytes, or SEE_LENGTH_ALL */
+};
+
+/* What one see_copy() did, as --stats reports it. */
+struct see_copy_stats {
+    see_u64  bytes;         /* Bytes written to 'fd_out' */
+    see_u64  reads;         /* Read calls */
+    see_u64  writes;        /* Write calls */
+    see_u64  copies;        /* In-kernel copy calls */
+    double   read_seconds;  /* Time blocked in reads */
+    double   write_seconds; /* Time in writes and copies */
+    unsigned engines;       /* Bit (1 << SEE_ENGINE_*) per engine */
+};
+
+/* Copy 'fd_in' from its current offset to 'fd_out'. 'options' may be
+ * NULL for the defaults and 'stats' NULL when not wanted. Returns 0 on
+ * success, 1 if 'fd_out' is a pipe or socket whose reader went away, or
+ * -1 on error with errno set; nothing is printed. 'fd_out' is used as it
+ * is: a pipe keeps its size, and stdio buffers are left alone, so flush
+ * stdout first if it shares the fd. SIGPIPE is left as the caller has it,
+ * so ignore it to get 1 instead of the signal. Calls are serialized, and
+ * options given to see_run() do not carry over to them. */
+int see_copy(int fd_in, int fd_out, const struct see_options *options,
+             struct see_copy_stats *stats);
+
+/* The --engine name of 'engine', or NULL if there is no such engine. */
+const char *see_engine_name(int engine);
+
+/* Run one see(1) command line, as the see program's main() does, and
+ * return its exit status. Options persist in the process, so call it at
+ * most once. */
+int see_run(int argc, char *argv[]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SEE_H */
@@ -5,35 +5,890 @@
  */
 
 #ifndef _WIN32
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* For splice() and copy_file_range() on Linux */
+#endif
 #ifndef _POSIX_C_SOURCE
 #define _POSIX_C_SOURCE 200809L /* For sigaction() on POSIX */
 #endif
+#if defined(__APPLE__) && !defined(_DARWIN_C_SOURCE)
+#define _DARWIN_C_SOURCE /* kqueue() is hidden by a strict POSIX level */
+#endif
 #endif
 
 #include <errno.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <mswsock.h>
 #include <windows.h>
 #include <io.h>
 #include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include "see.h"
+
+/* I/O backend: native handles on Windows, file descriptors elsewhere, or
+ * CRT streams when built with -DSEE_USE_STDIO (for unusual platforms). */
+#ifndef SEE_USE_STDIO
+#ifdef _WIN32
+#define SEE_WIN32_IO 1
+#else
+#define SEE_FD_IO 1
+#endif
+#endif
+
+#ifndef _WIN32
+#include <setjmp.h>
+#include <sys/mman.h>
+#endif
+#if !defined(SEE_NO_MMAP)
+#define SEE_HAVE_MMAP 1
+#endif
+
+/* Threads and atomics for the pipelined engine. */
+#if !defined(SEE_NO_THREADS)
+#if defined(_WIN32) && defined(_MSC_VER)
+#include <process.h>
+#define SEE_HAVE_THREADS 1
+#elif defined(_WIN32) && defined(__GNUC__)
+#include <process.h>
+#define SEE_HAVE_THREADS 1
+#elif defined(__GNUC__) && defined(__ATOMIC_SEQ_CST)
+#include <pthread.h>
+#define SEE_HAVE_THREADS 1
+#endif
+#endif
+/* Overlapped reads already keep several requests in flight natively. */
+#if defined(SEE_HAVE_THREADS) && !defined(SEE_WIN32_IO)
+#define SEE_HAVE_PIPELINE 1
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__has_include) && !defined(SEE_NO_URING)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_FEAT_RW_CUR_POS) && defined(__NR_io_uring_setup)
+#define SEE_HAVE_URING 1
+#endif
+#endif
+#endif
+#define SEE_HAVE_KERNEL_COPY 1
+#if defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define SEE_HAVE_COPY_FILE_RANGE 1
+#endif
+#endif
+
+/* Sparse inputs: holes are found with SEEK_DATA/SEEK_HOLE, or on Windows
+ * with FSCTL_QUERY_ALLOCATED_RANGES. */
+#if (defined(SEE_FD_IO) && defined(SEEK_DATA) && defined(SEEK_HOLE)) || \
+    defined(SEE_WIN32_IO)
+#define SEE_HAVE_SPARSE 1
+#ifdef _WIN32
+#include <winioctl.h>
+#endif
+#endif
+
+/* Decoders for -z, each optional so the core stays dependency-free:
+ * -DSEE_WITH_ZLIB (gzip), -DSEE_WITH_ZSTD and -DSEE_WITH_LZ4. */
+#ifdef SEE_WITH_ZLIB
+#include <zlib.h>
+#define SEE_HAVE_DECODE 1
+#endif
+#ifdef SEE_WITH_ZSTD
+#include <zstd.h>
+#define SEE_HAVE_DECODE 1
+/* Frames of a mapped file are decoded on several threads. */
+#if defined(SEE_FD_IO) && defined(SEE_HAVE_MMAP) && defined(SEE_HAVE_THREADS)
+#define SEE_HAVE_ZSTD_THREADS 1
+#endif
+#endif
+#ifdef SEE_WITH_LZ4
+#include <lz4frame.h>
+#define SEE_HAVE_DECODE 1
+#endif
+
+/* On x86-64 with GCC or Clang, the kernels below that the build target
+ * lacks are compiled for their instruction sets anyway and chosen at run
+ * time from cpu_features, so one portable binary still uses AVX2, SSE4.2
+ * CRC32C and the SHA extensions. -DSEE_NO_DISPATCH keeps to the target. */
+#if defined(__x86_64__) && !defined(SEE_NO_DISPATCH) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#include <cpuid.h>
+#define SEE_HAVE_DISPATCH 1
+#endif
+
+/* Vector kernels for the line transforms (-n, -s, -A); every other build
+ * scans with a lookup table. */
+#if (defined(__GNUC__) && defined(__SSE2__)) || \
+    (defined(_MSC_VER) && (defined(_M_X64) || \
+                           (defined(_M_IX86_FP) && _M_IX86_FP >= 2)))
+#include <emmintrin.h>
+#define SEE_HAVE_SSE2 1
+#if defined(__AVX2__) || defined(SEE_HAVE_DISPATCH)
+#include <immintrin.h>
+#define SEE_HAVE_AVX2 1
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SEE_HAVE_NEON 1
+#endif
+
+/* Instructions for --checksum, where the target enables them or they are
+ * dispatched: CRC32C (SSE4.2, ARMv8 CRC) and SHA-256 (the x86 SHA
+ * extensions). Only with SEE_HAVE_CRC32C_HW or SEE_HAVE_SHA_HW is the
+ * portable C version of the digest left out. */
+#if defined(__GNUC__) && defined(__SSE4_2__)
+#include <nmmintrin.h>
+#define SEE_HAVE_CRC32C_HW 1
+#define SEE_HAVE_CRC32C_SSE42 1
+#elif defined(__GNUC__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define SEE_HAVE_CRC32C_HW 1
+#elif defined(SEE_HAVE_DISPATCH)
+#include <nmmintrin.h>
+#define SEE_HAVE_CRC32C_SSE42 1
+#endif
+#if defined(__GNUC__) && defined(__SHA__) && defined(__SSE4_1__)
+#include <immintrin.h>
+#define SEE_HAVE_SHA_HW 1
+#define SEE_HAVE_SHA_NI 1
+#elif defined(SEE_HAVE_DISPATCH)
+#include <immintrin.h>
+#define SEE_HAVE_SHA_NI 1
+#endif
+
+/* CPU_* tells whether the running CPU has an instruction set, TARGET_*
+ * lets a function use it: constants where the build target has it. */
+#define CPU_FEATURE_AVX2  1U
+#define CPU_FEATURE_SSE42 2U
+#define CPU_FEATURE_SHA   4U /* With SSE4.1, which its kernel also needs */
+#ifdef __AVX2__
+#define CPU_AVX2    1
+#define TARGET_AVX2
+#else
+#define CPU_AVX2    (cpu_features & CPU_FEATURE_AVX2)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#ifdef __SSE4_2__
+#define CPU_SSE42    1
+#define TARGET_SSE42
+#else
+#define CPU_SSE42    (cpu_features & CPU_FEATURE_SSE42)
+#define TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#if defined(__SHA__) && defined(__SSE4_1__)
+#define CPU_SHA    1
+#define TARGET_SHA
+#else
+#define CPU_SHA    (cpu_features & CPU_FEATURE_SHA)
+#define TARGET_SHA __attribute__((target("sha,sse4.1")))
+#endif
+
+/* --follow waits on kernel change notifications: inotify on Linux, kqueue
+ * on the BSDs and macOS, ReadDirectoryChangesW() on Windows. */
+/* --open-order resolves names against directory fds with openat(), and
+ * on Linux finds where files start on disk with FIEMAP. */
+#if defined(SEE_FD_IO) && defined(AT_FDCWD) && defined(O_DIRECTORY)
+#define SEE_HAVE_OPENAT 1
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#ifdef FS_IOC_FIEMAP
+#define SEE_HAVE_FIEMAP 1
+#endif
+#endif
+#endif
+
+/* --serve listens on a Unix socket and is handed each client's fds. It
+ * runs requests with its own rights, so it is only built where the peer's
+ * user can be checked: SO_PEERCRED (Linux) or getpeereid() (the BSDs and
+ * macOS). */
+#if defined(SEE_FD_IO) && !defined(SEE_NO_SERVE)
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || \
+    defined(__NetBSD__) || defined(__DragonFly__)
+#define SEE_HAVE_GETPEEREID 1
+#endif
+#if defined(SCM_RIGHTS) && defined(CMSG_SPACE) && \
+    (defined(SO_PEERCRED) || defined(SEE_HAVE_GETPEEREID))
+#define SEE_HAVE_SERVE 1
+#endif
+#endif
+
+#if defined(SEE_FD_IO) && defined(__linux__)
+#include <poll.h>
+#include <sys/inotify.h>
+#define SEE_HAVE_INOTIFY 1
+#define SEE_HAVE_FOLLOW 1
+#elif defined(SEE_FD_IO) && \
+    (defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || \
+     defined(__DragonFly__))
+#include <sys/event.h>
+#include <sys/time.h>
+#define SEE_HAVE_KQUEUE 1
+#define SEE_HAVE_FOLLOW 1
+#elif defined(SEE_WIN32_IO)
+#define SEE_HAVE_FOLLOW 1
 #endif
 
 #define PROG_NAME   "see"
 #define VERSION     "1.0"
-#define BUFFER_SIZE (64 * 1024) /* 64KB: good disk I/O sweet spot */
+#define BUFFER_SIZE (64 * 1024) /* 64KB: default and minimum automatic size */
+#define BUFFER_MAX  (4 * 1024 * 1024) /* Cap for automatic buffer sizing */
+#define BUFFER_LIMIT ((see_u64)1 << 30) /* Largest --buffer-size accepted */
+#define STDIO_BUF_SIZE (64 * 1024) /* setvbuf() regions in stdio builds */
+#define PIPE_TARGET (1024 * 1024) /* Desired stdout pipe capacity */
+#define MMAP_THRESHOLD ((see_u64)8 * 1024 * 1024) /* Auto-map at this size */
+#define MMAP_WINDOW ((size_t)16 * 1024 * 1024) /* Bytes mapped at a time */
+#define KCOPY_CHUNK ((size_t)1 << 30) /* Per-call cap for in-kernel copies */
+#define ZERO_CHUNK ((size_t)1024 * 1024) /* Zeros per write for holes */
+#define ARENA_ALIGN ((size_t)2 * 1024 * 1024) /* x86-64/AArch64 huge page */
+#define POOL_SLAB ((size_t)8 * 1024 * 1024) /* Chunk buffer in 'slab_pool' */
+#define POOL_MAX  64 /* Slabs in 'slab_pool', at most */
+#define DIRECT_ALIGN ((size_t)4096) /* --direct offset/length/address unit */
+#define DROP_CHUNK ((off_t)8 * 1024 * 1024) /* --nocache drop granularity */
+#define BATCH_FILE  ((see_u64)64 * 1024) /* FILEs below this are batched */
+#define BATCH_BYTES ((size_t)1024 * 1024) /* Batched output per write */
+#define BATCH_FILES 1024 /* Batched FILEs per write, at most */
+#define SMALL_FILE ((size_t)16 * 1024) /* A lone FILE below this skips setup */
+#define HASH_CHUNK ((size_t)1024 * 1024) /* Hash-only reads, --checksum */
+#define HASH_LAG   ((size_t)8 * 1024 * 1024) /* In-kernel copy per call then */
+#define RATE_BURST 0.05 /* --rate-limit: seconds of output per call, at most */
+#define RATE_MIN   ((size_t)4096) /* ...but at least this many bytes */
+
+/* see_u64 comes from see.h. */
+typedef unsigned int see_u32; /* Every supported target has 32-bit int */
+
+/* Outcomes of a raw write to stdout. */
+#define WRITE_OK     0
+#define WRITE_ERROR  1 /* Error already reported */
+#define WRITE_CLOSED 2 /* Broken pipe on stdout */
+
+/* Outcomes of a fast-path copy attempt (zero-copy, mmap). */
+#define COPY_DONE     0 /* Input copied to EOF */
+#define COPY_FALLBACK 1 /* Continue with the read loop from the fd offset */
+#define COPY_ERROR    2 /* Error already reported */
+#define COPY_CLOSED   3 /* Broken pipe on stdout */
+
+/* Copy engines selectable with --engine. */
+#define ENGINE_AUTO     0 /* Zero-copy, then mmap for big files, then read */
+#define ENGINE_READ     1 /* read(2)/write(2) (or fread/fwrite) loop only */
+#define ENGINE_ZEROCOPY 2 /* In-kernel copy where the fd pair allows it */
+#define ENGINE_MMAP     3 /* Map regular files, whatever their size */
+#define ENGINE_THREADED 4 /* Reader thread filling a ring of buffers */
+#define ENGINE_URING    5 /* io_uring batches across all FILEs (Linux) */
+/* see.h numbers the engines see_copy() takes the same way. */
+typedef char see_engine_numbers[(SEE_ENGINE_AUTO == ENGINE_AUTO &&
+                                 SEE_ENGINE_READ == ENGINE_READ &&
+                                 SEE_ENGINE_ZEROCOPY == ENGINE_ZEROCOPY &&
+                                 SEE_ENGINE_MMAP == ENGINE_MMAP &&
+                                 SEE_ENGINE_THREADED == ENGINE_THREADED)
+                                    ? 1 : -1];
+
+#define RING_SLOTS 4 /* Buffers in flight between reader and writer */
+#define OVERLAPPED_READS 4 /* Win32 ReadFile requests in flight per file */
+#define CONSOLE_CHUNK (16 * 1024) /* Largest WriteFile to a console */
+#define URING_SLOTS 32 /* FILE operands in flight in the io_uring engine */
+#define FOLLOW_EVENTS 64 /* Notifications taken per wait by --follow */
+
+/* Line transforms, as bits of 'opt_transform'. */
+#define XFORM_NUMBER   0x01U /* -n: number output lines */
+#define XFORM_SQUEEZE  0x02U /* -s: drop repeated empty lines */
+#define XFORM_ENDS     0x04U /* -E: '$' before each newline */
+#define XFORM_TABS     0x08U /* -T: TAB as ^I */
+#define XFORM_NONPRINT 0x10U /* Control and high bytes as ^X and M-X */
+#define XFORM_BUF_SIZE (128 * 1024) /* Staging area for transformed output */
+#define XFORM_SLACK    64 /* Room kept for one line number and one escape */
+
+/* Line state of the transforms, from which the next byte is handled. */
+struct xform_state {
+    /* Number of the last line as -n prints it: digits right-aligned in at
+     * least six columns, then a TAB, counted up in place at the end. */
+    unsigned char number[24];
+    size_t        number_at; /* Index of its first column */
+    int           mid_line;  /* Last byte out was not a newline */
+    int           blank;     /* Last line started was empty */
+};
+
+/* --grep: lines are passed on when they contain any of the patterns. */
+#define GREP_MAX      32 /* Patterns, at most */
+#define GREP_BUF_SIZE (128 * 1024) /* Staging area for matching lines */
+#define GREP_LINE_MIN 4096 /* First allocation for a line split by reads */
+
+struct grep_pattern {
+    const unsigned char *text; /* Within argv; never contains a newline */
+    size_t               len;
+};
+
+/* Digests for --checksum, as 'opt_checksum'. */
+#define CHECKSUM_NONE   0
+#define CHECKSUM_CRC32C 1
+#define CHECKSUM_XXH64  2
+#define CHECKSUM_SHA256 3
+
+#define XXH_PRIME1 (((see_u64)0x9E3779B1UL << 32) | 0x85EBCA87UL)
+#define XXH_PRIME2 (((see_u64)0xC2B2AE3DUL << 32) | 0x27D4EB4FUL)
+#define XXH_PRIME3 (((see_u64)0x165667B1UL << 32) | 0x9E3779F9UL)
+#define XXH_PRIME4 (((see_u64)0x85EBCA77UL << 32) | 0xC2B2AE63UL)
+#define XXH_PRIME5 (((see_u64)0x27D4EB2FUL << 32) | 0x165667C5UL)
+
+/* Running digest of one FILE; only the fields of 'opt_checksum' move. */
+struct see_checksum {
+    see_u64       length;    /* Bytes hashed */
+    see_u32       crc;       /* CRC32C before the final inversion */
+    see_u64       lane[4];   /* XXH64 accumulators */
+    see_u32       state[8];  /* SHA-256 chaining value */
+    unsigned char block[64]; /* Bytes short of a whole block */
+    size_t        block_len;
+    int           failed;    /* Output went out unhashed (reported) */
+};
+
+/* --tee: each FILE may fall TEE_RING bytes behind the output. */
+#define TEE_MAX    16
+#define TEE_RING   (16 * 1024 * 1024)
+#define TEE_OPEN   0 /* Taking output */
+#define TEE_CLOSED 1 /* Its reader went away; dropped quietly */
+#define TEE_FAILED 2 /* A write failed (reported) */
+
+/* Page-cache modes, as 'opt_cache'. */
+#define CACHE_KEEP   0 /* Read through the page cache as usual */
+#define CACHE_DROP   1 /* --nocache: drop pages behind the read offset */
+#define CACHE_DIRECT 2 /* --direct: O_DIRECT or FILE_FLAG_NO_BUFFERING */
+#if defined(SEE_FD_IO) || defined(SEE_WIN32_IO)
+#define SEE_HAVE_CACHE_CONTROL 1
+#define SEE_HAVE_BATCH 1 /* stdio buffers small FILEs by itself */
+#endif
+
+/* Compressed formats -z recognises by their magic number. */
+#define DECODE_NONE 0
+#define DECODE_GZIP 1 /* 1f 8b */
+#define DECODE_ZSTD 2 /* 28 b5 2f fd */
+#define DECODE_LZ4  3 /* 04 22 4d 18, the frame format */
+#define DECODE_BUF_SIZE (256 * 1024) /* Compressed input per read */
+#define DECODE_JOB_MAX ((size_t)8 * 1024 * 1024) /* Largest frame handed
+                                                   * to a thread */
+
+/* Per-FILE selection with --head/--tail. */
+#define SLICE_NONE 0
+#define SLICE_HEAD 1 /* First 'opt_slice_count' lines or bytes */
+#define SLICE_TAIL 2 /* Last 'opt_slice_count' lines or bytes */
+#define TAIL_BLOCK BUFFER_SIZE /* Unit of the backwards scan for newlines */
+
+/* A byte range of an input, from --offset/--length or FILE@RANGES.
+ * Lists are sorted, merged and end with a range of length 0. */
+#define NO_LIMIT (~(see_u64)0) /* Length of a range running to EOF */
+struct see_range {
+    see_u64 offset; /* From where the input stood when it was handed over */
+    see_u64 length;
+};
+
+/* Counters gathered for --stats, per FILE and in total. */
+struct see_stats {
+    see_u64  bytes;          /* Bytes written to stdout */
+    see_u64  reads;          /* Read calls */
+    see_u64  writes;         /* Write calls */
+    see_u64  copies;         /* In-kernel copy calls (sendfile and kin) */
+    see_u64  short_reads;    /* Reads returning less than requested */
+    see_u64  partial_writes; /* Writes taking less than offered */
+    see_u64  retries;        /* Calls repeated after EINTR */
+    see_u64  hole_bytes;     /* Hole bytes skipped or zero-filled unread */
+    double   read_time;      /* Seconds spent blocked in reads */
+    double   write_time;     /* Seconds spent in writes and copies */
+    unsigned engines;        /* Bit (1 << ENGINE_*) per engine that copied */
+};
+
+#define PREFETCH_DEFAULT 8    /* Operands opened ahead on multi-core hosts */
+#define PREFETCH_LIMIT   1024 /* Largest --prefetch accepted */
+#define PREFETCH_THREADS 4    /* Cap on concurrent prefetch opens */
+#define PREFETCH_BYTES   ((off_t)BUFFER_MAX) /* Read-ahead hint per file */
+
+#define LIST_BATCH 4096 /* --files-from names handed on at a time */
+#define LIST_BUF   (256 * 1024) /* Bytes of the list read at a time */
+
+/* --serve: a request is a serve_header, then 'argc' NUL-terminated
+ * arguments in 'bytes' bytes, with the client's stdin, stdout, stderr and
+ * working directory passed along as fds. */
+#define SERVE_MAGIC    0x53454531UL /* "SEE1" */
+#define SERVE_FDS      4
+#define SERVE_ARGC_MAX 65536
+#define SERVE_ARGS_MAX ((see_u32)1 << 20)
+
+struct serve_header {
+    see_u32 magic;
+    see_u32 argc;
+    see_u32 bytes;
+};
+
+/* --open-order, as 'opt_open_order'. */
+#define OPEN_GIVEN  0 /* Open each FILE as its turn comes */
+#define OPEN_INODE  1 /* Open a window of FILEs in inode order */
+#define OPEN_EXTENT 2 /* ...and read ahead in order of their first extent */
+#define SORT_WINDOW 256 /* FILEs opened together, at most */
+
+#define ORDER_THREADS 8   /* Ordered-writer threads by default, at most */
+#define ORDER_LIMIT   256 /* Largest --threads accepted */
+#define ORDER_CHUNK   ((size_t)1024 * 1024) /* Input per transform chunk */
+#define ORDER_MIN     (4 * ORDER_CHUNK) /* Smallest file shared out */
+
+/* --ionice classes, numbered as Linux's ioprio_set() takes them. */
+#define IONICE_NONE        0
+#define IONICE_REALTIME    1
+#define IONICE_BEST_EFFORT 2
+#define IONICE_IDLE        3
+#define IONICE_LEVELS      8 /* Levels 0 (first served) to 7 in a class */
+#define IONICE_LEVEL       4 /* Level without ':LEVEL' */
+
+/* Tunables set from the command line. */
+static size_t opt_buffer_size; /* --buffer-size; 0 selects automatically */
+static int    opt_engine = ENGINE_AUTO; /* --engine */
+static int    opt_prefetch = -1; /* --prefetch; -1 picks by CPU count */
+static int    opt_threads = 0;   /* --threads; 0 picks by CPU count */
+static unsigned opt_transform; /* XFORM_* bits; 0 copies bytes verbatim */
+static int    opt_slice = SLICE_NONE; /* --head, --tail and their -bytes */
+static int    opt_slice_bytes; /* Count bytes rather than lines */
+static see_u64 opt_slice_count;
+static struct see_range opt_range[2] = { /* --offset and --length */
+    {0, NO_LIMIT}, {0, 0}
+};
+static int    opt_range_set; /* Either option was given */
+static int    opt_follow; /* -f, --follow */
+static const char *opt_files_from; /* --files-from list, or NULL */
+static int    opt_open_order = OPEN_GIVEN; /* --open-order */
+static int    opt_list_nul; /* -0: the list's names end in NULs */
+static see_u64 opt_rate_limit; /* --rate-limit, bytes a second; 0 is off */
+static int    opt_nice;   /* --nice increment */
+static int    opt_ionice = IONICE_NONE; /* --ionice class */
+static int    opt_ionice_level = IONICE_LEVEL;
+static int    opt_decompress; /* -z, --decompress */
+static int    opt_cache;      /* CACHE_*: --nocache, --direct */
+static int    input_cache;    /* CACHE_* in effect for the FILE being read */
+#ifdef SEE_HAVE_BATCH
+/* Output of small FILEs, read back to back from the start of 'io_buf' and
+ * written together by batch_flush(). */
+static size_t batch_len;
+static int    batch_files;
+#endif
+
+static const char *const engine_names[] = {
+    "auto", "read", "zerocopy", "mmap", "threaded", "uring"
+};
+static const char *const open_order_names[] = {"given", "inode", "extent"};
+
+/* Transform state. It carries over from one FILE to the next, so lines
+ * are numbered and squeezed across FILEs as if they were one input. */
+static unsigned char *xform_buf;   /* XFORM_BUF_SIZE bytes when enabled */
+static size_t         xform_len;   /* Bytes staged in 'xform_buf' */
+static struct xform_state xform;
+static unsigned char  xform_special[256]; /* Bytes the scan stops at */
+
+/* --grep state. The last line of a read may be finished by the next one,
+ * or by the next FILE, so until it matches it is kept in 'grep_line'. */
+static struct grep_pattern grep_list[GREP_MAX];
+static int            grep_count;   /* Patterns; 0 passes every line */
+static size_t         grep_longest; /* Length of the longest pattern */
+static unsigned char *grep_buf;     /* GREP_BUF_SIZE bytes when enabled */
+static size_t         grep_len;     /* Bytes staged in 'grep_buf' */
+static unsigned char *grep_line;    /* Unfinished line without a match */
+static size_t         grep_line_len;
+static size_t         grep_line_cap;
+static int            grep_line_hit; /* The unfinished line matched */
+
+/* Selection state for the FILE being copied. An input that cannot seek
+ * reaches --tail through 'tail_buf', which keeps no more than the last
+ * 'opt_slice_count' lines or bytes plus one read. */
+static see_u64        slice_left;  /* --head: lines or bytes still to pass */
+static int            slice_buffering; /* --tail through 'tail_buf' */
+static unsigned char *tail_buf;
+static size_t         tail_cap;
+static size_t         tail_start;  /* Kept bytes are [tail_start, tail_len) */
+static size_t         tail_len;
+static see_u64        tail_lines;  /* Newlines among the kept bytes */
+#ifdef SEE_WIN32_IO
+static __int64        slice_offset; /* Start of an overlapped input */
+#endif
+
+/* Ranges. Each copy engine stops after 'copy_limit' bytes and counts
+ * what it moves against it; without ranges the limit is NO_LIMIT and the
+ * counting is harmless. */
+static struct see_range      **operand_ranges; /* Per operand, or NULL */
+static const struct see_range *input_ranges; /* For the input being copied */
+static see_u64                 copy_limit = NO_LIMIT;
+static int                     stdout_closed; /* A write saw a broken pipe */
+
+/* Diagnostics go to stderr, except within see_copy(), which keeps only
+ * the errno of the first for its caller. */
+static int diag_quiet;
+static int diag_errno;
+
+/* --stats state. Every counter update is behind STATS_ON, so the option
+ * costs one well-predicted branch per call when it is off. see_copy()
+ * counts without a stream to print to. */
+static FILE            *stats_stream; /* Destination of the report */
+static int              stats_on;     /* Counters are being kept */
+static struct see_stats file_stats;   /* FILE being copied */
+static struct see_stats total_stats;
+static see_u64          stats_files;
+#define STATS_ON (stats_on)
+
+/* --rate-limit state: a token bucket refilled from stats_clock(). Only the
+ * thread writing stdout touches it. */
+static double rate_tokens; /* Bytes that may go out now; negative is owed */
+static double rate_stamp;  /* Clock at the last refill */
+static size_t rate_burst;  /* Bucket size, and the most one call may move */
+
+/* --checksum state. The digest is only ever updated by the thread that
+ * copies, or by the hash-only reader while that thread waits in the
+ * kernel. */
+static int                opt_checksum;    /* CHECKSUM_* */
+static FILE              *checksum_stream; /* stderr or --checksum-file */
+static struct see_checksum file_checksum;  /* FILE being copied */
+#ifdef SEE_HAVE_DISPATCH
+static unsigned           cpu_features;    /* CPU_FEATURE_*, cpu_setup() */
+#endif
+#ifndef SEE_HAVE_CRC32C_HW
+static see_u32            crc32c_table[8][256];
+#endif
+static const char *const  checksum_names[] = {
+    "none", "crc32c", "xxh64", "sha256"
+};
+
+/* The single I/O allocation made by buffer_setup(), in huge pages where
+ * possible. */
+static unsigned char *io_buf;      /* Copy buffer */
+static size_t         io_buf_size; /* Usable bytes at 'io_buf' */
+static unsigned char *decode_buf;  /* DECODE_BUF_SIZE bytes with -z */
+#ifdef SEE_USE_STDIO
+static char          *stdout_buf;  /* STDIO_BUF_SIZE bytes for stdout */
+static char          *file_buf;    /* STDIO_BUF_SIZE bytes for inputs */
+#endif
+
+#ifndef _WIN32
+/* Standard output as probed once by output_setup(); see_copy() points
+ * 'output_fd' at its caller's fd, which is not see's own stdout: stdio
+ * buffers are not flushed before writing to it, nor is a pipe resized. */
+static int         output_fd = STDOUT_FILENO;
+static int         output_is_stdout = 1;
+static struct stat stdout_stat;
+static int         stdout_stat_ok;
+static size_t      stdout_pipe_size; /* Capacity if stdout is a pipe */
+#endif
+#ifdef SEE_WIN32_IO
+static HANDLE      stdout_handle;
+static DWORD       stdout_type;      /* GetFileType() of stdout */
+static SOCKET      stdout_socket = INVALID_SOCKET; /* If stdout is one */
+#endif
 
 static void platform_setup(void);
+static void diag(const char *format, ...);
 static void usage(void);
 static void version(void);
 static int  flush_stream(FILE *stream, const char *stream_name,
                          int treat_broken_pipe_as_success);
+static int  parse_size(const char *text, see_u64 *value);
+static int  option_value(const char *name, int argc, char *argv[],
+                         int *index, const char **value);
+static void output_setup(void);
+static void *arena_map(size_t size, int pinned, size_t *len);
+static int  buffer_setup(void);
+static size_t choose_buffer_size(int is_regular, see_u64 input_size,
+                                 size_t preferred);
+static double stats_clock(void);
+static void rate_setup(void);
+static size_t rate_cap(size_t len);
+static void rate_pace(size_t len);
+static int  priority_setup(void);
+static void stats_read(struct see_stats *stats, double start, long result,
+                       size_t requested);
+static void stats_write(struct see_stats *stats, double start, long result,
+                        size_t requested);
+static void stats_merge(struct see_stats *into, const struct see_stats *from);
+static void stats_field(const char *key, see_u64 value);
+static void stats_print(const char *name, const struct see_stats *stats);
+static void stats_file_done(const char *name, struct see_stats *stats);
+static int  transform_option(const char *arg);
+static void transform_setup(void);
+static const unsigned char *transform_scan(const unsigned char *p,
+                                           const unsigned char *end);
+static void transform_number(struct xform_state *st, see_u64 lines);
+#ifdef SEE_HAVE_THREADS
+static see_u64 transform_lines(const struct xform_state *st);
+#endif
+static void transform_count(struct xform_state *st);
+static unsigned char *transform_line(struct xform_state *st, int empty,
+                                     unsigned char *out);
+static unsigned char *transform_special(struct xform_state *st, unsigned c,
+                                        unsigned char *out);
+static int  transform_flush(void);
+static int  transform_put(const unsigned char *data, size_t len);
+static int  transform_write(const unsigned char *data, size_t len);
+static size_t count_lines(const unsigned char *p, size_t len);
+static int  grep_option(const char *value);
+static const unsigned char *grep_search(const struct grep_pattern *pattern,
+                                        const unsigned char *p,
+                                        const unsigned char *end);
+static int  grep_flush(void);
+static int  grep_put(const unsigned char *data, size_t len);
+static int  grep_lines(const unsigned char *p, const unsigned char *end);
+static int  grep_carry(const unsigned char *p, const unsigned char *end);
+static int  grep_write(const unsigned char *data, size_t len);
+static int  write_filtered(const unsigned char *data, size_t len);
+static void checksum_setup(void);
+static void checksum_reset(struct see_checksum *c);
+static void checksum_update(struct see_checksum *c,
+                            const unsigned char *data, size_t len);
+static void checksum_file_done(const char *name);
+#if defined(SEE_HAVE_SPARSE) || (defined(SEE_HAVE_MMAP) && defined(_WIN32))
+static int  write_raw(const unsigned char *data, size_t len);
+#endif
+static int  write_output(const unsigned char *data, size_t len);
+static int  write_data(const unsigned char *data, size_t len);
+#ifdef SEE_HAVE_KERNEL_COPY
+struct hash_reader;
+static int  kernel_copy(int input_fd, const struct stat *input_stat,
+                        const char *input_name);
+#endif
+#ifdef SEE_HAVE_PIPELINE
+struct pipeline;
+static int  threaded_copy(struct pipeline *pipe_state, size_t chunk_size,
+                          const char *input_name);
+#endif
+static int  write_stdout(const unsigned char *data, size_t len);
+static int  write_all(const unsigned char *data, size_t len);
+#if defined(SEE_HAVE_MMAP) && defined(_WIN32)
+static int  mmap_copy_handle(HANDLE file, __int64 *offset, __int64 length);
+#endif
+#ifdef SEE_HAVE_SPARSE
+static const unsigned char *zero_block(void);
+static int  zero_fill(see_u64 len);
+static void checksum_zeros(see_u64 len);
+#endif
+#if defined(SEE_USE_STDIO)
 static int  copy_stream(FILE *input_stream, const char *input_name);
+#elif defined(SEE_WIN32_IO)
+static const char *win_strerror(DWORD code);
+static wchar_t *utf8_to_wide(const char *text);
+static int  transmit_copy(HANDLE file, __int64 *offset, __int64 length);
+#ifdef SEE_HAVE_SPARSE
+static int  write_hole(see_u64 len, int *skip_holes);
+static int  sparse_copy_handle(HANDLE file, __int64 *offset, __int64 length,
+                               const char *input_name);
+#endif
+static void drain_reads(HANDLE file, OVERLAPPED *requests, int first,
+                        int count, int depth);
+static int  copy_handle(HANDLE file, int overlapped, const char *input_name);
+#else
+static int  write_fd(int fd, const unsigned char *data, size_t len,
+                     size_t *written, int *error);
+#ifdef SEE_HAVE_MMAP
+static int  mmap_copy(int input_fd, const struct stat *input_stat,
+                      const char *input_name);
+#endif
+#ifdef SEE_HAVE_SPARSE
+static int  sparse_copy(int input_fd, const struct stat *input_stat,
+                        const char *input_name);
+#endif
+static int  copy_fd(int input_fd, const char *input_name);
+#endif
+#if defined(SEE_USE_STDIO)
+typedef FILE *see_input; /* An opened FILE operand */
+typedef FILE *see_sink;  /* An opened --tee FILE */
+#elif defined(SEE_WIN32_IO)
+typedef HANDLE see_input;
+typedef HANDLE see_sink;
+#else
+typedef int see_input;
+typedef int see_sink;
+#endif
+/* Text for an error code stored by open_input(). */
+#ifdef SEE_WIN32_IO
+#define input_strerror(err) win_strerror((DWORD)(err))
+#else
+#define input_strerror(err) strerror(err)
+#endif
+/* Copy one input, or one range of it, with the backend's engines. */
+#if defined(SEE_USE_STDIO)
+#define copy_one(input, name) copy_stream((input), (name))
+#elif defined(SEE_WIN32_IO)
+#define copy_one(input, name) \
+    copy_handle((input), (input) != GetStdHandle(STD_INPUT_HANDLE), (name))
+#else
+#define copy_one(input, name) copy_fd((input), (name))
+#endif
+static int  input_extent(see_input input, see_u64 *position, see_u64 *size);
+static long input_read_at(see_input input, see_u64 offset,
+                          unsigned char *buffer, size_t len, int *error);
+static int  input_seek(see_input input, see_u64 offset, int *error);
+static long input_read(see_input input, unsigned char *buffer, size_t len,
+                       int *error);
+static int  input_skip(see_input input, see_u64 count, see_u64 *skipped,
+                       int *error);
+static int  slice_begin(see_input input, const char *input_name);
+static int  tail_keep(const unsigned char *data, size_t len);
+static int  slice_end(void);
+static int  range_compare(const void *a, const void *b);
+static int  parse_ranges(const char *text, struct see_range **list);
+static int  path_exists(const char *path);
+static int  split_operands(char *operands[], int count);
+static void select_operand(int index);
+#ifdef SEE_HAVE_DECODE
+/* A decoder for one input of the format it was sniffed as. */
+struct decoder {
+    int    format;  /* DECODE_* */
+    size_t pending; /* Nonzero while a frame or member is incomplete */
+#ifdef SEE_WITH_ZLIB
+    z_stream gzip;
+#endif
+#ifdef SEE_WITH_ZSTD
+    ZSTD_DCtx *zstd;
+#endif
+#ifdef SEE_WITH_LZ4
+    LZ4F_dctx *lz4;
+#endif
+};
+static long decode_read(see_input input, size_t from,
+                        const char *input_name);
+static int  decode_format(const unsigned char *p, size_t len);
+static int  decode_feed(struct decoder *d, const unsigned char *src,
+                        size_t len, const char *input_name);
+#ifdef SEE_HAVE_ZSTD_THREADS
+static int  zstd_parallel(struct decoder *d, int input_fd, size_t have,
+                          const char *input_name);
+#endif
+static int  decode_input(see_input input, const char *input_name);
+#endif
+#ifdef SEE_HAVE_BATCH
+static int  batch_flush(void);
+static int  batch_input(see_input input, const char *input_name);
+#else
+#define batch_flush() WRITE_OK
+#endif
+static int  copy_input(see_input input, const char *input_name);
+#ifdef SEE_HAVE_CACHE_CONTROL
+static int  cache_aligned(void);
+#endif
+#ifdef SEE_FD_IO
+static void cache_begin(int fd);
+static void cache_advance(int fd);
+static int  cache_fallback(int fd, int err);
+static void cache_end(int fd);
+#endif
+static int  open_input(const char *file_path, see_input *input, int *error);
+static int  finish_input(see_input input, const char *file_path);
 static int  process_path(const char *file_path);
+#ifdef SEE_HAVE_FOLLOW
+struct follower;
+static int  follow_keep(see_input input, const char *file_path);
+static const char *follow_base(const char *path);
+static char *follow_dir(const char *path);
+static int  follow_watch(struct follower *f);
+static int  follow_check(struct follower *f, int renamed);
+static int  follow_pending(void);
+#ifdef SEE_WIN32_IO
+struct follow_directory;
+static int  follow_listen(struct follow_directory *dir);
+static int  follow_open(struct follow_directory *dir, char *path);
+#endif
+static int  follow_run(void);
+#else
+#define follow_keep(input, file_path) 0 /* -f is refused in this build */
+#endif
+#ifdef SEE_HAVE_THREADS
+static void pool_setup(long count);
+static unsigned char *slab_alloc(size_t size, size_t *cap);
+static void slab_free(unsigned char *buf);
+struct ordered;
+struct see_chunk;
+static struct see_chunk *ordered_acquire(struct ordered *o);
+static int  ordered_start(struct ordered *o, long count, int threads,
+                          void (*process)(struct see_chunk *chunk));
+static void ordered_submit(struct ordered *o, struct see_chunk *chunk);
+static struct see_chunk *ordered_take(struct ordered *o);
+static void ordered_release(struct ordered *o, struct see_chunk *chunk);
+static int  ordered_run(struct ordered *o,
+                        int (*fill)(void *context, struct see_chunk *chunk),
+                        int (*write)(void *context, struct see_chunk *chunk),
+                        void *context);
+static void ordered_finish(struct ordered *o);
+static int  order_threads(void);
+static unsigned char *transform_chunk(struct xform_state *st,
+                                      const unsigned char *p,
+                                      const unsigned char *end,
+                                      unsigned char *out);
+static int  transform_parallel(see_input input, const char *input_name);
+static int  online_cpus(void);
+static int  process_prefetched(char *paths[], int count);
+#endif
+#ifdef SEE_HAVE_URING
+static int  uring_process(char *paths[], int count);
+#endif
+#ifdef SEE_FD_IO
+static int  small_file(const char *file_path);
+#endif
+static int  process_operands(char *paths[], int count);
+static int  process_list(void);
+#ifdef SEE_HAVE_SERVE
+static int  serve_run(const char *path);
+#endif
+static int  see_main(int argc, char *argv[]);
+
+#ifdef SEE_HAVE_DISPATCH
+/* Fill cpu_features from CPUID. AVX2 also needs the OS to save the YMM
+ * registers on a context switch, which XGETBV reports. */
+static void cpu_setup(void) {
+    unsigned eax, ebx, ecx, edx;
+    unsigned features; /* ECX of leaf 1 */
+
+    if (!__get_cpuid(1, &eax, &ebx, &features, &edx)) {
+        return;
+    }
+    if (features & bit_SSE4_2) {
+        cpu_features |= CPU_FEATURE_SSE42;
+    }
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    if ((ebx & bit_SHA) && (features & bit_SSE4_1)) {
+        cpu_features |= CPU_FEATURE_SHA;
+    }
+    if ((ebx & bit_AVX2) && (features & bit_OSXSAVE)) {
+        unsigned low, high;
+
+        __asm__ __volatile__("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+        (void)high;
+        if ((low & 6) == 6) { /* XMM and YMM state */
+            cpu_features |= CPU_FEATURE_AVX2;
+        }
+    }
+}
+#endif
 
 /* Sets up platform-specific I/O and signal handling; exits on fatal errors. */
 static void platform_setup(void) {
@@ -42,30 +897,29 @@ static void platform_setup(void) {
      * and continue. */
     if (!SetConsoleOutputCP(CP_UTF8)) {
         DWORD werr = GetLastError();
-        fprintf(stderr,
-                "%s: warning: failed to set console output to UTF-8 "
-                "(error code: %lu)\n",
-                PROG_NAME, (unsigned long)werr);
+        diag("%s: warning: failed to set console output to UTF-8 "
+             "(error code: %lu)\n",
+             PROG_NAME, (unsigned long)werr);
     }
 
     /* Force binary mode for stdin, stdout, and stderr on Windows:
      * disables LF<->CRLF conversion and ^Z as EOF, preserves exact byte I/O. */
     if (_setmode(_fileno(stdin), _O_BINARY) == -1) {
         int err = errno;
-        fprintf(stderr, "%s: stdin: failed to set binary mode: %s\n",
-                PROG_NAME, strerror(err));
+        diag("%s: stdin: failed to set binary mode: %s\n",
+             PROG_NAME, strerror(err));
         exit(EXIT_FAILURE);
     }
     if (_setmode(_fileno(stdout), _O_BINARY) == -1) {
         int err = errno;
-        fprintf(stderr, "%s: stdout: failed to set binary mode: %s\n",
-                PROG_NAME, strerror(err));
+        diag("%s: stdout: failed to set binary mode: %s\n",
+             PROG_NAME, strerror(err));
         exit(EXIT_FAILURE);
     }
     if (_setmode(_fileno(stderr), _O_BINARY) == -1) {
         int err = errno;
-        fprintf(stderr, "%s: stderr: failed to set binary mode: %s\n",
-                PROG_NAME, strerror(err));
+        diag("%s: stderr: failed to set binary mode: %s\n",
+             PROG_NAME, strerror(err));
         exit(EXIT_FAILURE);
     }
 #else
@@ -78,21 +932,88 @@ static void platform_setup(void) {
     sigemptyset(&sa.sa_mask);
     if (sigaction(SIGPIPE, &sa, NULL) == -1) {
         int err = errno;
-        fprintf(stderr, "%s: failed to ignore SIGPIPE: %s\n",
-                PROG_NAME, strerror(err));
+        diag("%s: failed to ignore SIGPIPE: %s\n",
+             PROG_NAME, strerror(err));
         exit(EXIT_FAILURE);
     }
 #endif
+#ifdef SEE_HAVE_DISPATCH
+    cpu_setup();
+#endif
 }
 
 static void usage(void) {
     static const char usage_text[] =
         "Usage: " PROG_NAME " [OPTION]... [FILE]...\n\n"
         "Concatenate FILE(s) to standard output.\n"
-        "With no FILE, or when FILE is -, read standard input.\n\n"
+        "With no FILE, or when FILE is -, read standard input.\n"
+        "FILE@OFFSET[:LENGTH][,...] copies only those byte ranges of FILE.\n\n"
         "Options:\n"
-        "  -h, --help     display this help\n"
-        "  -v, --version  output version information\n";
+        "  -A, --show-all          same as --show-nonprinting -E -T\n"
+        "  -E, --show-ends         display $ at the end of each line\n"
+        "  -n, --number            number all output lines\n"
+        "  -s, --squeeze-blank     suppress repeated empty output lines\n"
+        "  -T, --show-tabs         display TAB characters as ^I\n"
+        "  -z, --decompress        decode gzip, zstd or lz4 FILEs, as found\n"
+        "                          by their magic number; copy others as\n"
+        "                          they are\n"
+        "      --show-nonprinting  use ^ and M- notation, except for LFD\n"
+        "                          and TAB\n"
+        "  -0, --null              names in --files-from end with NUL, not\n"
+        "                          newline\n"
+        "  -h, --help              display this help\n"
+        "  -v, --version           output version information\n"
+        "      --buffer-size=SIZE  copy through a SIZE-byte buffer instead of\n"
+        "                          sizing it per input; SIZE may end in K, M\n"
+        "                          or G\n"
+        "      --checksum=ALGO     print a digest of each FILE as copied to\n"
+        "                          stderr: crc32c, xxh64 or sha256\n"
+        "      --checksum-file=FILE\n"
+        "                          print the digests to FILE instead\n"
+        "      --direct            read FILEs around the page cache\n"
+        "                          (O_DIRECT), falling back to --nocache\n"
+        "      --engine=NAME       copy with NAME: auto (default), read,\n"
+        "                          zerocopy, mmap, threaded or uring\n"
+        "  -f, --follow            after copying, keep copying data appended\n"
+        "                          to each regular FILE, across truncation\n"
+        "                          and rotation\n"
+        "      --files-from=FILE   copy the FILEs named in FILE, one per\n"
+        "                          line (- reads the names from stdin)\n"
+        "      --grep=TEXT         copy only lines that contain TEXT; give\n"
+        "                          it again, or put newlines in TEXT, to\n"
+        "                          match any of several\n"
+        "      --head=N            copy only the first N lines of each FILE\n"
+        "      --head-bytes=SIZE   copy only the first SIZE bytes of each FILE\n"
+        "      --ionice=CLASS[:LEVEL]\n"
+        "                          do I/O in scheduling CLASS: idle,\n"
+        "                          best-effort or realtime, at LEVEL 0\n"
+        "                          (first served) to 7 (default 4)\n"
+        "      --length=SIZE       copy at most SIZE bytes of each FILE\n"
+        "      --nice=N            add N to the scheduling niceness\n"
+        "                          (-20 to 19; below zero needs privilege)\n"
+        "      --nocache           drop FILEs from the page cache behind\n"
+        "                          the read offset\n"
+        "      --offset=SIZE       start SIZE bytes into each FILE\n"
+        "      --open-order=ORDER  open FILEs as given (default), or a\n"
+        "                          window of them at once in inode or\n"
+        "                          extent (disk position) order\n"
+        "      --prefetch=N        open up to N upcoming FILEs in the\n"
+        "                          background (default 8 with more than\n"
+        "                          one CPU, else 0; 0 disables)\n"
+        "      --rate-limit=SIZE   write at most SIZE bytes a second, e.g.\n"
+        "                          20M\n"
+        "      --serve=SOCKET      run requests from programs speaking the\n"
+        "                          protocol of README.md on the Unix socket\n"
+        "                          SOCKET\n"
+        "      --stats[=FILE]      print per-FILE and total I/O counters to\n"
+        "                          stderr, or to FILE\n"
+        "      --tail=N            copy only the last N lines of each FILE\n"
+        "      --tail-bytes=SIZE   copy only the last SIZE bytes of each FILE\n"
+        "      --tee=FILE          also write the output to FILE; give it\n"
+        "                          again for more\n"
+        "      --threads=N         use N threads to transform large FILEs\n"
+        "                          and decode zstd (default one per CPU, up\n"
+        "                          to 8; 1 disables)\n";
     fputs(usage_text, stdout);
     (void)flush_stream(stdout, "stdout", 1);
     exit(EXIT_SUCCESS);
@@ -104,6 +1025,22 @@ static void version(void) {
     exit(EXIT_SUCCESS);
 }
 
+/* Print a diagnostic to stderr, as fprintf() would. Called straight after
+ * the failing call, so errno still holds its reason. */
+static void diag(const char *format, ...) {
+    va_list ap;
+
+    if (diag_quiet) {
+        if (diag_errno == 0) {
+            diag_errno = (errno != 0) ? errno : EIO;
+        }
+        return;
+    }
+    va_start(ap, format);
+    (void)vfprintf(stderr, format, ap);
+    va_end(ap);
+}
+
 /* Robust fflush with EINTR and optional EPIPE handling.
  * Returns 0 on success (including EPIPE handled as non-error), 1 on error.
  * If 'stream_name' is NULL, suppresses error messages (used for stderr). */
@@ -132,163 +1069,8937 @@ static int flush_stream(FILE *stream, const char *stream_name,
         }
 
         if (stream_name != NULL) {
-            fprintf(stderr, "%s: flush error on %s: %s\n",
-                    PROG_NAME, stream_name, strerror(err));
+            diag("%s: flush error on %s: %s\n",
+                 PROG_NAME, stream_name, strerror(err));
         }
         return 1;
     }
 }
 
-/* Copy all data from 'input_stream' to stdout.
- * Returns 0 on success, 1 on error.
- * 'input_name' is used for diagnostics. */
-static int copy_stream(FILE *input_stream, const char *input_name) {
-    /* Static buffer avoids stack pressure and malloc overhead. */
-    static unsigned char buffer[BUFFER_SIZE];
-    size_t bytes_read;
-    size_t total_bytes_written;
-    size_t bytes_written;
+/* Parse a byte count with an optional binary suffix (K, M, G, T).
+ * Returns 0 on success, 1 if 'text' is malformed or overflows. */
+static int parse_size(const char *text, see_u64 *value) {
+    see_u64 result = 0;
+    see_u64 max = ~(see_u64)0;
+    const char *p = text;
+    int shift = 0;
 
-    for (;;) {
-        bytes_read = fread(buffer, 1, sizeof(buffer), input_stream);
-        if (bytes_read == 0) {
-            if (feof(input_stream)) {
-                break;
-            }
-            if (ferror(input_stream)) {
-                int err = errno;
-                if (err == EINTR) {
-                    clearerr(input_stream);
-                    continue;
-                }
-                fprintf(stderr, "%s: read error on %s: %s\n",
-                        PROG_NAME, input_name, strerror(err));
-                return 1;
-            }
-            /* Zero read without error/EOF treated as EOF. */
-            break;
+    if (*p < '0' || *p > '9') {
+        return 1;
+    }
+    for (; *p >= '0' && *p <= '9'; ++p) {
+        unsigned digit = (unsigned)(*p - '0');
+        if (result > (max - digit) / 10) {
+            return 1;
         }
+        result = result * 10 + digit;
+    }
 
-        /* Handle partial writes - critical for pipes and slow devices. */
-        total_bytes_written = 0;
-        while (total_bytes_written < bytes_read) {
-            bytes_written = fwrite(buffer + total_bytes_written, 1,
-                                   bytes_read - total_bytes_written, stdout);
-            if (bytes_written == 0) {
-                if (ferror(stdout)) {
-                    int err = errno;
-#ifdef EPIPE
-                    if (err == EPIPE) {
-                        /* Broken pipe is normal termination for utilities. */
-                        clearerr(stdout);
-                        return 0;
-                    }
-#endif
-                    if (err == EINTR) {
-                        clearerr(stdout);
-                        continue;
-                    }
-                    fprintf(stderr, "%s: write error on stdout: %s\n",
-                            PROG_NAME, strerror(err));
-                    return 1;
-                } else {
-                    fprintf(stderr,
-                            "%s: write error on stdout: unexpected zero "
-                            "write\n",
-                            PROG_NAME);
-                    return 1;
-                }
-            } else {
-                total_bytes_written += bytes_written;
-            }
-        }
+    switch (*p) {
+    case '\0':
+        break;
+    case 'k': case 'K': shift = 10; ++p; break;
+    case 'm': case 'M': shift = 20; ++p; break;
+    case 'g': case 'G': shift = 30; ++p; break;
+    case 't': case 'T': shift = 40; ++p; break;
+    default:
+        return 1;
+    }
+    if (*p != '\0' || (shift > 0 && result > (max >> shift))) {
+        return 1;
     }
 
+    *value = result << shift;
     return 0;
 }
 
-/* Process a path or stdin ("-" or NULL). Returns 0 on success, 1 on error. */
-static int process_path(const char *file_path) {
-    FILE *input_file;
-    int status = 0;
-    static char file_buf[BUFFER_SIZE];
+/* Match argv[*index] against the long option 'name' taking a value, given
+ * either as "--name=VALUE" or as "--name VALUE" (which consumes the next
+ * argument). Returns 1 and sets 'value' on a match, 0 otherwise; exits if
+ * the value is missing. */
+static int option_value(const char *name, int argc, char *argv[],
+                        int *index, const char **value) {
+    const char *arg = argv[*index];
+    size_t name_len = strlen(name);
 
-    if (file_path == NULL || strcmp(file_path, "-") == 0) {
-        return copy_stream(stdin, "stdin");
+    if (strncmp(arg, name, name_len) != 0) {
+        return 0;
     }
-
-    input_file = fopen(file_path, "rb");
-    if (!input_file) {
-        int err = errno;
-        fprintf(stderr, "%s: %s: %s\n", PROG_NAME, file_path, strerror(err));
+    if (arg[name_len] == '=') {
+        *value = arg + name_len + 1;
         return 1;
     }
-
-    if (setvbuf(input_file, file_buf, _IOFBF, sizeof(file_buf)) != 0) {
-        int err = errno;
-        fprintf(stderr, "%s: %s: warning: failed to set full buffering: %s\n",
-                PROG_NAME, file_path, strerror(err));
-    }
-
-    if (copy_stream(input_file, file_path) != 0) {
-        status = 1;
+    if (arg[name_len] != '\0') {
+        return 0;
     }
-
-    if (fclose(input_file) != 0) {
-        int err = errno;
-        fprintf(stderr, "%s: close error on %s: %s\n",
-                PROG_NAME, file_path, strerror(err));
-        status = 1;
+    if (*index + 1 >= argc) {
+        diag("%s: option '%s' requires an argument\n",
+             PROG_NAME, name);
+        exit(EXIT_FAILURE);
     }
-
-    return status;
+    *value = argv[++*index];
+    return 1;
 }
 
-int main(int argc, char *argv[]) {
-    int files_processed = 0;
-    int i;
-    int overall_rc = 0;
-    int options_ended = 0;
-    static char stdout_buf[BUFFER_SIZE];
-
-    platform_setup();
+/* Probe stdout once and, when it is see's own pipe, try to enlarge it so
+ * each write moves more data per context switch. Failures are not errors:
+ * the kernel may cap pipe sizes for unprivileged users. */
+static void output_setup(void) {
+#ifdef SEE_WIN32_IO
+    stdout_handle = GetStdHandle(STD_OUTPUT_HANDLE);
+    stdout_type = (stdout_handle == NULL || stdout_handle ==
+                   INVALID_HANDLE_VALUE) ? FILE_TYPE_UNKNOWN
+                                         : GetFileType(stdout_handle);
+    if (stdout_type == FILE_TYPE_PIPE) {
+        /* Sockets report as pipes; SO_TYPE tells them apart. */
+        WSADATA wsa;
+        int type = 0;
+        int type_len = (int)sizeof(type);
 
-    /* Full buffering improves performance for large outputs. */
-    if (setvbuf(stdout, stdout_buf, _IOFBF, sizeof(stdout_buf)) != 0) {
-        int err = errno;
-        fprintf(stderr,
-                "%s: warning: failed to set full buffering on stdout: %s\n",
-                PROG_NAME, strerror(err));
+        if (WSAStartup(MAKEWORD(2, 2), &wsa) == 0 &&
+            getsockopt((SOCKET)stdout_handle, SOL_SOCKET, SO_TYPE,
+                       (char *)&type, &type_len) == 0 &&
+            type == SOCK_STREAM) {
+            stdout_socket = (SOCKET)stdout_handle;
+        }
+    }
+#endif
+#ifndef _WIN32
+    stdout_stat_ok = 0;
+    stdout_pipe_size = 0;
+    if (fstat(output_fd, &stdout_stat) != 0) {
+        return;
     }
+    stdout_stat_ok = 1;
 
-    for (i = 1; i < argc; ++i) {
-        const char *arg = argv[i];
-        int is_filepath = 1;
+#if defined(F_GETPIPE_SZ) && defined(F_SETPIPE_SZ)
+    if (S_ISFIFO(stdout_stat.st_mode)) {
+        int size = fcntl(output_fd, F_GETPIPE_SZ);
+        int want = PIPE_TARGET;
 
-        if (!options_ended && arg[0] == '-') {
-            if (strcmp(arg, "--") == 0) {
-                options_ended = 1;
-                is_filepath = 0;
-            } else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
-                usage();
-            } else if (strcmp(arg, "-v") == 0 || strcmp(arg, "--version") == 0) {
-                version();
+        if (opt_buffer_size != 0 && opt_buffer_size < PIPE_TARGET) {
+            want = (int)opt_buffer_size;
+        }
+        /* Halve the request until the kernel accepts it. */
+        while (output_is_stdout && size > 0 && want > size) {
+            int got = fcntl(output_fd, F_SETPIPE_SZ, want);
+            if (got >= 0) {
+                size = got;
+                break;
             }
+            want /= 2;
         }
-
-        if (is_filepath) {
-            overall_rc |= process_path(arg);
-            files_processed = 1;
+        if (size > 0) {
+            stdout_pipe_size = (size_t)size;
         }
     }
+#endif
+#endif
+}
 
-    if (!files_processed) {
-        overall_rc |= process_path(NULL);
-    }
-
-    /* Final flush: retry on EINTR; treat EPIPE on stdout as success. */
-    overall_rc |= flush_stream(stdout, "stdout", 1);
-    overall_rc |= flush_stream(stderr, NULL, 0); /* Cannot report to stderr. */
+/* Apply --nice and --ionice to the process before any thread is started,
+ * so the threads inherit them. Returns 0 on success, 1 on error
+ * (reported). */
+static int priority_setup(void) {
+#ifdef _WIN32
+    DWORD priority_class = NORMAL_PRIORITY_CLASS;
 
-    return (overall_rc == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
-}
+    if (opt_nice >= 10) {
+        priority_class = IDLE_PRIORITY_CLASS;
+    } else if (opt_nice > 0) {
+        priority_class = BELOW_NORMAL_PRIORITY_CLASS;
+    } else if (opt_nice <= -10) {
+        priority_class = HIGH_PRIORITY_CLASS;
+    } else if (opt_nice < 0) {
+        priority_class = ABOVE_NORMAL_PRIORITY_CLASS;
+    }
+    if (opt_nice != 0 &&
+        !SetPriorityClass(GetCurrentProcess(), priority_class)) {
+        diag("%s: cannot set --nice: %s\n",
+             PROG_NAME, win_strerror(GetLastError()));
+        return 1;
+    }
+    /* Background mode lowers the I/O and memory priority of every thread;
+     * the other classes are what Windows gives a process already. */
+    if (opt_ionice == IONICE_IDLE &&
+        !SetPriorityClass(GetCurrentProcess(),
+                          PROCESS_MODE_BACKGROUND_BEGIN)) {
+        diag("%s: cannot set --ionice: %s\n",
+             PROG_NAME, win_strerror(GetLastError()));
+        return 1;
+    }
+    if (opt_ionice == IONICE_REALTIME) {
+        diag("%s: --ionice=realtime is not supported on this "
+             "system\n", PROG_NAME);
+        return 1;
+    }
+#else
+    errno = 0;
+    if (opt_nice != 0 && nice(opt_nice) == -1 && errno != 0) {
+        int err = errno;
+        diag("%s: cannot set --nice: %s\n",
+             PROG_NAME, strerror(err));
+        return 1;
+    }
+    if (opt_ionice != IONICE_NONE) {
+#if defined(__linux__) && defined(SYS_ioprio_set)
+        /* IOPRIO_WHO_PROCESS: the class in the top bits, then the level. */
+        if (syscall(SYS_ioprio_set, 1, 0,
+                    (opt_ionice << 13) |
+                        (opt_ionice == IONICE_IDLE ? 0 : opt_ionice_level)) !=
+            0) {
+            int err = errno;
+            diag("%s: cannot set --ionice: %s\n",
+                 PROG_NAME, strerror(err));
+            return 1;
+        }
+#elif defined(__APPLE__) && defined(IOPOL_TYPE_DISK)
+        /* Throttled I/O waits behind everyone else's, as the idle class. */
+        if (opt_ionice == IONICE_REALTIME ||
+            setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS,
+                           opt_ionice == IONICE_IDLE ? IOPOL_THROTTLE
+                                                     : IOPOL_DEFAULT) != 0) {
+            int err = (opt_ionice == IONICE_REALTIME) ? ENOTSUP : errno;
+            diag("%s: cannot set --ionice: %s\n",
+                 PROG_NAME, strerror(err));
+            return 1;
+        }
+#else
+        diag("%s: --ionice is not supported on this system\n",
+             PROG_NAME);
+        return 1;
+#endif
+    }
+#endif
+    return 0;
+}
+
+#ifdef MAP_NORESERVE
+#define ARENA_NORESERVE MAP_NORESERVE /* Only touched pages count */
+#else
+#define ARENA_NORESERVE 0
+#endif
+
+/* Map at least 'size' bytes of zeroed memory aligned to ARENA_ALIGN, in
+ * huge pages where the system gives them out. With 'pinned', reserved huge
+ * pages (MAP_HUGETLB, or MEM_LARGE_PAGES on Windows, which commits at
+ * once) are tried first; otherwise, and as the fallback, the kernel is
+ * asked to back the region with transparent huge pages as it is touched.
+ * Fewer, larger pages mean fewer TLB misses and page faults for buffers
+ * that see every byte. Sets '*len' to the mapped size. Returns NULL with
+ * errno (GetLastError() on Windows) set on failure. */
+static void *arena_map(size_t size, int pinned, size_t *len) {
+    void *mem = NULL;
+
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    *len = size;
+#ifdef _WIN32
+    if (pinned) {
+        SIZE_T large = GetLargePageMinimum();
+
+        /* Fails unless SeLockMemoryPrivilege is held and enabled. */
+        if (large != 0 && size % large == 0) {
+            mem = VirtualAlloc(NULL, size,
+                               MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES,
+                               PAGE_READWRITE);
+        }
+    }
+    if (mem == NULL) {
+        mem = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE,
+                           PAGE_READWRITE);
+    }
+#elif defined(MAP_ANONYMOUS)
+    {
+        unsigned char *base;
+        size_t lead;
+
+#ifdef MAP_HUGETLB
+        if (pinned) {
+            mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (mem != MAP_FAILED) {
+                return mem;
+            }
+        }
+#else
+        (void)pinned;
+#endif
+        /* Over-map by one alignment unit and trim both ends. */
+        mem = mmap(NULL, size + ARENA_ALIGN, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | ARENA_NORESERVE, -1, 0);
+        if (mem == MAP_FAILED) {
+            return NULL;
+        }
+        base = (unsigned char *)mem;
+        lead = (ARENA_ALIGN - (size_t)base % ARENA_ALIGN) % ARENA_ALIGN;
+        if (lead != 0) {
+            (void)munmap(base, lead);
+        }
+        (void)munmap(base + lead + size, ARENA_ALIGN - lead);
+        mem = base + lead;
+#ifdef MADV_HUGEPAGE
+        (void)madvise(mem, size, MADV_HUGEPAGE);
+#endif
+    }
+#else
+    (void)pinned;
+    {
+        int err = posix_memalign(&mem, ARENA_ALIGN, size);
+        if (err != 0) {
+            errno = err;
+            return NULL;
+        }
+        memset(mem, 0, size);
+    }
+#endif
+    return mem;
+}
+
+/* Allocate the copy buffer (plus the stdio buffers in stdio builds) as one
+ * block from arena_map(). Pages are only touched as data passes through them,
+ * so reserving the automatic maximum up front costs nothing for small
+ * inputs. Returns 0 on success, 1 (reported) on failure. */
+static int buffer_setup(void) {
+    size_t total;
+    size_t mapped;
+    void *mem;
+
+    io_buf_size = (opt_buffer_size != 0) ? opt_buffer_size : BUFFER_MAX;
+    if (opt_cache != CACHE_KEEP) {
+        /* Whole DIRECT_ALIGN units, so the regions after it stay aligned. */
+        io_buf_size = (io_buf_size + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1);
+    }
+    total = io_buf_size;
+#ifdef SEE_USE_STDIO
+    total += 2 * STDIO_BUF_SIZE;
+#endif
+    if (opt_transform != 0) {
+        total += XFORM_BUF_SIZE;
+    }
+    if (grep_count > 0) {
+        total += GREP_BUF_SIZE;
+    }
+    if (opt_decompress) {
+        total += DECODE_BUF_SIZE;
+    }
+
+    mem = arena_map(total, 1, &mapped);
+    if (mem == NULL) {
+#ifdef _WIN32
+        diag("%s: cannot allocate I/O buffer (error code: %lu)\n",
+             PROG_NAME, (unsigned long)GetLastError());
+#else
+        int err = errno;
+        diag("%s: cannot allocate I/O buffer: %s\n",
+             PROG_NAME, strerror(err));
+#endif
+        return 1;
+    }
+
+    io_buf = (unsigned char *)mem;
+#ifdef SEE_USE_STDIO
+    stdout_buf = (char *)mem + io_buf_size;
+    file_buf = stdout_buf + STDIO_BUF_SIZE;
+#endif
+    if (opt_decompress) {
+        decode_buf = (unsigned char *)mem + total - DECODE_BUF_SIZE;
+        total -= DECODE_BUF_SIZE;
+    }
+    if (grep_count > 0) {
+        grep_buf = (unsigned char *)mem + total - GREP_BUF_SIZE;
+        total -= GREP_BUF_SIZE;
+    }
+    if (opt_transform != 0) {
+        xform_buf = (unsigned char *)mem + total - XFORM_BUF_SIZE;
+    }
+    return 0;
+}
+
+/* Pick the read size for one input. Regular files get one read per file
+ * up to BUFFER_MAX, rounded to the 'preferred' I/O unit (st_blksize, or
+ * the capacity of a pipe); anything else reads 'preferred' bytes, never
+ * less than BUFFER_SIZE. A pipe on stdout is filled up to its capacity. */
+static size_t choose_buffer_size(int is_regular, see_u64 input_size,
+                                 size_t preferred) {
+    size_t size = BUFFER_SIZE;
+
+    if (opt_buffer_size != 0) {
+        return opt_buffer_size;
+    }
+
+    if (preferred > size && preferred <= BUFFER_MAX) {
+        size = preferred;
+    }
+    if (is_regular && input_size > size) {
+        if (input_size >= BUFFER_MAX) {
+            size = BUFFER_MAX;
+        } else {
+            size_t unit = (preferred > 0) ? preferred : BUFFER_SIZE;
+            /* One extra unit lets the read that sees EOF share the call. */
+            size = ((size_t)input_size / unit + 1) * unit;
+        }
+    }
+#ifndef _WIN32
+    if (stdout_pipe_size > size) {
+        size = stdout_pipe_size;
+    }
+#endif
+
+    return (size < io_buf_size) ? size : io_buf_size;
+}
+
+/* Seconds on a monotonic clock, for --stats timings. */
+static double stats_clock(void) {
+#if defined(_WIN32)
+    LARGE_INTEGER count;
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (double)count.QuadPart / (double)frequency.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+        return 0.0;
+    }
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/* Fill the --rate-limit bucket: RATE_BURST seconds of output, so a burst
+ * after a pause is short and each call's share of it shorter still. */
+static void rate_setup(void) {
+    double burst = (double)opt_rate_limit * RATE_BURST;
+
+    rate_burst = (burst < (double)RATE_MIN)      ? RATE_MIN
+                 : (burst > (double)KCOPY_CHUNK) ? KCOPY_CHUNK
+                                                 : (size_t)burst;
+    rate_tokens = (double)rate_burst;
+    rate_stamp = stats_clock();
+}
+
+/* 'len' capped to what --rate-limit lets one write or copy call move. */
+static size_t rate_cap(size_t len) {
+    return (opt_rate_limit != 0 && len > rate_burst) ? rate_burst : len;
+}
+
+/* Take 'len' bytes just written out of the --rate-limit bucket, sleeping
+ * off whatever that leaves owed. */
+static void rate_pace(size_t len) {
+    double now;
+    double owed;
+
+    if (opt_rate_limit == 0) {
+        return;
+    }
+    now = stats_clock();
+    rate_tokens += (now - rate_stamp) * (double)opt_rate_limit;
+    if (rate_tokens > (double)rate_burst) {
+        rate_tokens = (double)rate_burst;
+    }
+    rate_stamp = now;
+    rate_tokens -= (double)len;
+    if (rate_tokens >= 0.0) {
+        return;
+    }
+    owed = -rate_tokens / (double)opt_rate_limit;
+#ifdef _WIN32
+    Sleep((DWORD)(owed * 1000.0 + 0.5));
+#else
+    {
+        struct timespec ts;
+
+        ts.tv_sec = (time_t)owed;
+        ts.tv_nsec = (long)((owed - (double)ts.tv_sec) * 1e9);
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+        }
+    }
+#endif
+}
+
+/* Account one read call begun at 'start' that returned 'result' (bytes,
+ * or negative on error) for 'requested' bytes. */
+static void stats_read(struct see_stats *stats, double start, long result,
+                       size_t requested) {
+    ++stats->reads;
+    stats->read_time += stats_clock() - start;
+    if (result > 0 && (size_t)result < requested) {
+        ++stats->short_reads;
+    }
+}
+
+/* Account one write call, as stats_read() does for reads. */
+static void stats_write(struct see_stats *stats, double start, long result,
+                        size_t requested) {
+    ++stats->writes;
+    stats->write_time += stats_clock() - start;
+    if (result >= 0 && (size_t)result < requested) {
+        ++stats->partial_writes;
+    }
+    if (result > 0) {
+        stats->bytes += (see_u64)result;
+    }
+}
+
+static void stats_merge(struct see_stats *into, const struct see_stats *from) {
+    into->bytes += from->bytes;
+    into->reads += from->reads;
+    into->writes += from->writes;
+    into->copies += from->copies;
+    into->short_reads += from->short_reads;
+    into->partial_writes += from->partial_writes;
+    into->retries += from->retries;
+    into->hole_bytes += from->hole_bytes;
+    into->read_time += from->read_time;
+    into->write_time += from->write_time;
+    into->engines |= from->engines;
+}
+
+/* Print " key=value" without relying on printf support for 64-bit
+ * integers, which C89 runtimes lack. */
+static void stats_field(const char *key, see_u64 value) {
+    char digits[24];
+    char *p = digits + sizeof(digits) - 1;
+
+    *p = '\0';
+    do {
+        *--p = (char)('0' + (int)(value % 10));
+        value /= 10;
+    } while (value != 0);
+    fprintf(stats_stream, " %s=%s", key, p);
+}
+
+/* Print one line of counters for 'name' ("total" for the summary). */
+static void stats_print(const char *name, const struct see_stats *stats) {
+    const char *separator = "";
+    int engine;
+
+    fprintf(stats_stream, "%s: stats: %s:", PROG_NAME, name);
+    if (stats == &total_stats) {
+        stats_field("files", stats_files);
+    }
+    fputs(" engine=", stats_stream);
+    for (engine = ENGINE_READ; engine <= ENGINE_URING; ++engine) {
+        if (stats->engines & (1U << engine)) {
+            fprintf(stats_stream, "%s%s", separator, engine_names[engine]);
+            separator = "+";
+        }
+    }
+    stats_field("bytes", stats->bytes);
+    stats_field("reads", stats->reads);
+    stats_field("writes", stats->writes);
+    stats_field("copies", stats->copies);
+    stats_field("short_reads", stats->short_reads);
+    stats_field("partial_writes", stats->partial_writes);
+    stats_field("eintr", stats->retries);
+    stats_field("holes", stats->hole_bytes);
+    fprintf(stats_stream, " read_s=%.6f write_s=%.6f\n",
+            stats->read_time, stats->write_time);
+}
+
+/* Report the FILE 'name' finished with 'stats', fold its counters into
+ * the total and clear them for the next FILE. */
+static void stats_file_done(const char *name, struct see_stats *stats) {
+    if (!STATS_ON) {
+        return;
+    }
+    if (stats->engines == 0) {
+        stats->engines = 1U << ENGINE_READ; /* Empty: only the read loop. */
+    }
+    stats_print(name, stats);
+    stats_merge(&total_stats, stats);
+    ++stats_files;
+    memset(stats, 0, sizeof(*stats));
+}
+
+/*
+ * Line transforms: the cat(1) options -n, -s, -E, -T and -A, applied to
+ * data as it leaves the read loops. The input is scanned for the next
+ * byte that needs attention (a newline, or a TAB or non-printing byte
+ * when those are shown) and everything before it is copied in one block,
+ * so ordinary text moves at memcpy() speed rather than a byte at a time.
+ */
+
+/* Options that map to transform bits: the short letter (0 for none) and
+ * the long name. */
+static const struct {
+    char        letter;
+    const char *name;
+    unsigned    flags;
+} transform_options[] = {
+    {'n', "--number",           XFORM_NUMBER},
+    {'s', "--squeeze-blank",    XFORM_SQUEEZE},
+    {'E', "--show-ends",        XFORM_ENDS},
+    {'T', "--show-tabs",        XFORM_TABS},
+    {'A', "--show-all",         XFORM_NONPRINT | XFORM_ENDS | XFORM_TABS},
+    {0,   "--show-nonprinting", XFORM_NONPRINT}
+};
+
+#define TRANSFORM_OPTIONS \
+    (sizeof(transform_options) / sizeof(transform_options[0]))
+
+/* Apply 'arg' if it is a transform option: a long name, or a cluster of
+ * short letters such as "-nE". Returns 1 if it was one, 0 otherwise. */
+static int transform_option(const char *arg) {
+    unsigned flags = 0;
+    size_t i;
+
+    for (i = 0; i < TRANSFORM_OPTIONS; ++i) {
+        if (strcmp(arg, transform_options[i].name) == 0) {
+            opt_transform |= transform_options[i].flags;
+            return 1;
+        }
+    }
+    if (arg[0] != '-' || arg[1] == '\0' || arg[1] == '-') {
+        return 0;
+    }
+    for (++arg; *arg != '\0'; ++arg) {
+        for (i = 0; i < TRANSFORM_OPTIONS; ++i) {
+            if (transform_options[i].letter == *arg) {
+                break;
+            }
+        }
+        if (i == TRANSFORM_OPTIONS) {
+            return 0; /* Not ours: leave the argument alone. */
+        }
+        flags |= transform_options[i].flags;
+    }
+    opt_transform |= flags;
+    return 1;
+}
+
+/* Build the scalar scan table for the enabled transforms and start the
+ * line count at zero. */
+static void transform_setup(void) {
+    int c;
+
+    transform_number(&xform, 0);
+
+    for (c = 0; c < 256; ++c) {
+        xform_special[c] = (unsigned char)(
+            c == '\n' || (c == '\t' && (opt_transform & XFORM_TABS)) ||
+            ((opt_transform & XFORM_NONPRINT) && c != '\t' &&
+             (c < 32 || c >= 127)));
+    }
+}
+
+#if defined(SEE_HAVE_SSE2) || defined(SEE_HAVE_NEON)
+/* Index of the lowest set bit of the nonzero 'mask'. */
+static unsigned first_bit(see_u64 mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+
+    if (!_BitScanForward(&index, (unsigned long)mask)) {
+        (void)_BitScanForward(&index, (unsigned long)(mask >> 32));
+        index += 32;
+    }
+    return (unsigned)index;
+#else
+    return (unsigned)__builtin_ctzll(mask);
+#endif
+}
+#endif
+
+#ifdef SEE_HAVE_AVX2
+/* The AVX2 loop of transform_scan(): the first byte it must handle in
+ * whole 32-byte blocks from '*from', which is left at the first block
+ * with no hit, or NULL. */
+static TARGET_AVX2 const unsigned char *scan_avx2(
+    const unsigned char **from, const unsigned char *end, int nonprint,
+    int show_tabs) {
+    const unsigned char *p = *from;
+    const __m256i newline = _mm256_set1_epi8('\n');
+    /* TAB is a hit with -T; otherwise it is kept even with -A. */
+    const __m256i tabs = _mm256_set1_epi8(show_tabs ? '\t' : '\n');
+    const __m256i keeps = _mm256_set1_epi8(show_tabs ? ' ' : '\t');
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i del = _mm256_set1_epi8(127);
+
+    for (; end - p >= 32; p += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)p);
+        __m256i hit;
+        unsigned mask;
+
+        if (nonprint) {
+            /* Signed compare: 0-31 and 128-255 are both below ' '. */
+            hit = _mm256_andnot_si256(
+                _mm256_cmpeq_epi8(x, keeps),
+                _mm256_or_si256(_mm256_cmpgt_epi8(space, x),
+                                _mm256_cmpeq_epi8(x, del)));
+        } else {
+            hit = _mm256_or_si256(_mm256_cmpeq_epi8(x, newline),
+                                  _mm256_cmpeq_epi8(x, tabs));
+        }
+        mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask != 0) {
+            return p + first_bit(mask);
+        }
+    }
+    *from = p;
+    return NULL;
+}
+
+/* The AVX2 loop of count_lines() over whole 32-byte blocks from '*from',
+ * which is left at the bytes they do not cover. */
+static TARGET_AVX2 size_t count_avx2(const unsigned char **from,
+                                     const unsigned char *end) {
+    const unsigned char *p = *from;
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t count = 0;
+
+    while (end - p >= 32) {
+        const unsigned char *stop = (end - p >= 32 * 255)
+                                        ? p + 32 * 255
+                                        : p + ((end - p) & ~31);
+        __m256i sums = _mm256_setzero_si256();
+
+        for (; p < stop; p += 32) {
+            sums = _mm256_sub_epi8(sums, _mm256_cmpeq_epi8(
+                _mm256_loadu_si256((const __m256i *)p), newline));
+        }
+        sums = _mm256_sad_epu8(sums, _mm256_setzero_si256());
+        count += (size_t)_mm256_extract_epi64(sums, 0) +
+                 (size_t)_mm256_extract_epi64(sums, 1) +
+                 (size_t)_mm256_extract_epi64(sums, 2) +
+                 (size_t)_mm256_extract_epi64(sums, 3);
+    }
+    *from = p;
+    return count;
+}
+#endif
+
+/* Return the first byte in [p, end) the transforms must handle, or 'end'.
+ * Plain newline searches are left to memchr(), which every mainstream C
+ * library already vectorises; the kernels below cover the byte classes
+ * it cannot: TAB (-T) and the non-printing ranges (-A). */
+static const unsigned char *transform_scan(const unsigned char *p,
+                                           const unsigned char *end) {
+    const int nonprint = (opt_transform & XFORM_NONPRINT) != 0;
+    const int show_tabs = (opt_transform & XFORM_TABS) != 0;
+
+    if (!nonprint && !show_tabs) {
+        const void *hit = memchr(p, '\n', (size_t)(end - p));
+        return (hit != NULL) ? (const unsigned char *)hit : end;
+    }
+
+#if defined(SEE_HAVE_AVX2)
+    if (CPU_AVX2) {
+        const unsigned char *hit = scan_avx2(&p, end, nonprint, show_tabs);
+        if (hit != NULL) {
+            return hit;
+        }
+    }
+#endif
+#if defined(SEE_HAVE_SSE2)
+    {
+        const __m128i newline = _mm_set1_epi8('\n');
+        const __m128i tabs = _mm_set1_epi8(show_tabs ? '\t' : '\n');
+        const __m128i keeps = _mm_set1_epi8(show_tabs ? ' ' : '\t');
+        const __m128i space = _mm_set1_epi8(' ');
+        const __m128i del = _mm_set1_epi8(127);
+
+        for (; end - p >= 16; p += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *)p);
+            __m128i hit;
+            unsigned mask;
+
+            if (nonprint) {
+                hit = _mm_andnot_si128(
+                    _mm_cmpeq_epi8(x, keeps),
+                    _mm_or_si128(_mm_cmplt_epi8(x, space),
+                                 _mm_cmpeq_epi8(x, del)));
+            } else {
+                hit = _mm_or_si128(_mm_cmpeq_epi8(x, newline),
+                                   _mm_cmpeq_epi8(x, tabs));
+            }
+            mask = (unsigned)_mm_movemask_epi8(hit);
+            if (mask != 0) {
+                return p + first_bit(mask);
+            }
+        }
+    }
+#elif defined(SEE_HAVE_NEON)
+    {
+        const uint8x16_t newline = vdupq_n_u8('\n');
+        const uint8x16_t tabs = vdupq_n_u8(show_tabs ? '\t' : '\n');
+        const uint8x16_t keeps = vdupq_n_u8(show_tabs ? ' ' : '\t');
+        const uint8x16_t space = vdupq_n_u8(' ');
+        const uint8x16_t del = vdupq_n_u8(127);
+
+        for (; end - p >= 16; p += 16) {
+            uint8x16_t x = vld1q_u8(p);
+            uint8x16_t hit;
+            see_u64 mask;
+
+            if (nonprint) {
+                hit = vbicq_u8(vorrq_u8(vcltq_u8(x, space),
+                                        vcgeq_u8(x, del)),
+                               vceqq_u8(x, keeps));
+            } else {
+                hit = vorrq_u8(vceqq_u8(x, newline), vceqq_u8(x, tabs));
+            }
+            /* No movemask on NEON: narrow each byte to a nibble. */
+            mask = vget_lane_u64(vreinterpret_u64_u8(
+                       vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+            if (mask != 0) {
+                return p + (first_bit(mask) >> 2);
+            }
+        }
+    }
+#endif
+
+    while (p < end && !xform_special[*p]) {
+        ++p;
+    }
+    return p;
+}
+
+/* Number of newlines among the 'len' bytes at 'p'. The vector loops add
+ * up per-byte match counts, folding them with a horizontal sum before any
+ * byte counter can wrap. */
+static size_t count_lines(const unsigned char *p, size_t len) {
+    const unsigned char *end = p + len;
+    size_t count = 0;
+    const void *hit;
+
+#if defined(SEE_HAVE_AVX2)
+    if (CPU_AVX2) {
+        count = count_avx2(&p, end);
+    }
+#endif
+#if defined(SEE_HAVE_SSE2)
+    {
+        const __m128i newline = _mm_set1_epi8('\n');
+
+        while (end - p >= 16) {
+            const unsigned char *stop = (end - p >= 16 * 255)
+                                            ? p + 16 * 255
+                                            : p + ((end - p) & ~15);
+            __m128i sums = _mm_setzero_si128();
+
+            for (; p < stop; p += 16) {
+                sums = _mm_sub_epi8(sums, _mm_cmpeq_epi8(
+                    _mm_loadu_si128((const __m128i *)p), newline));
+            }
+            sums = _mm_sad_epu8(sums, _mm_setzero_si128());
+            count += (size_t)_mm_cvtsi128_si32(sums) +
+                     (size_t)_mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+        }
+    }
+#elif defined(SEE_HAVE_NEON)
+    {
+        const uint8x16_t newline = vdupq_n_u8('\n');
+
+        while (end - p >= 16) {
+            const unsigned char *stop = (end - p >= 16 * 255)
+                                            ? p + 16 * 255
+                                            : p + ((end - p) & ~15);
+            uint8x16_t sums = vdupq_n_u8(0);
+
+            for (; p < stop; p += 16) {
+                sums = vsubq_u8(sums, vceqq_u8(vld1q_u8(p), newline));
+            }
+            count += (size_t)vaddlvq_u8(sums);
+        }
+    }
+#endif
+
+    while ((hit = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+        ++count;
+        p = (const unsigned char *)hit + 1;
+    }
+    return count;
+}
+
+/* Write out the staged bytes. Returns one of WRITE_*. */
+static int transform_flush(void) {
+    size_t len = xform_len;
+
+    xform_len = 0;
+    return (len > 0) ? write_filtered(xform_buf, len) : WRITE_OK;
+}
+
+/* Stage the 'len' bytes at 'data' unchanged. Runs too long to be worth a
+ * copy go straight to stdout once the staged bytes are out. Returns one
+ * of WRITE_*. */
+static int transform_put(const unsigned char *data, size_t len) {
+    int rc;
+
+    if (xform_len + len <= XFORM_BUF_SIZE - XFORM_SLACK) {
+        memcpy(xform_buf + xform_len, data, len);
+        xform_len += len;
+        return WRITE_OK;
+    }
+    rc = transform_flush();
+    if (rc != WRITE_OK || len >= XFORM_BUF_SIZE / 2) {
+        return (rc != WRITE_OK) ? rc : write_filtered(data, len);
+    }
+    memcpy(xform_buf, data, len);
+    xform_len = len;
+    return WRITE_OK;
+}
+
+/* Set the line number in 'st' to 'lines'. */
+static void transform_number(struct xform_state *st, see_u64 lines) {
+    size_t at = sizeof(st->number) - 2;
+
+    memset(st->number, ' ', sizeof(st->number));
+    st->number[sizeof(st->number) - 1] = '\t';
+    do {
+        st->number[at--] = (unsigned char)('0' + lines % 10);
+        lines /= 10;
+    } while (lines > 0);
+    st->number_at = (at < sizeof(st->number) - 8) ? at + 1
+                                                  : sizeof(st->number) - 7;
+}
+
+#ifdef SEE_HAVE_THREADS
+/* The line number in 'st'. */
+static see_u64 transform_lines(const struct xform_state *st) {
+    see_u64 lines = 0;
+    size_t at;
+
+    for (at = st->number_at; at < sizeof(st->number) - 1; ++at) {
+        if (st->number[at] != ' ') {
+            lines = lines * 10 + (see_u64)(st->number[at] - '0');
+        }
+    }
+    return lines;
+}
+#endif
+
+/* Count one more line in 'st', widening the number past six digits when
+ * the count carries into a new column. */
+static void transform_count(struct xform_state *st) {
+    size_t at = sizeof(st->number) - 2;
+
+    while (st->number[at] == '9') {
+        st->number[at--] = '0';
+    }
+    if (st->number[at] == ' ') {
+        st->number[at] = '1';
+        if (at < st->number_at) {
+            st->number_at = at;
+        }
+    } else {
+        ++st->number[at];
+    }
+}
+
+/* Open a line at 'out', 'empty' if it is just a newline: no output, or
+ * its number for -n. Returns the end of what was written, or NULL if -s
+ * drops the line. */
+static unsigned char *transform_line(struct xform_state *st, int empty,
+                                     unsigned char *out) {
+    if (empty) {
+        if (st->blank && (opt_transform & XFORM_SQUEEZE)) {
+            return NULL;
+        }
+        st->blank = 1;
+    } else {
+        st->blank = 0;
+    }
+    if (opt_transform & XFORM_NUMBER) {
+        size_t width;
+
+        transform_count(st);
+        width = sizeof(st->number) - st->number_at;
+        memcpy(out, st->number + st->number_at, width);
+        out += width;
+    }
+    st->mid_line = 1;
+    return out;
+}
+
+/* Write the form of the byte 'c' the scan stopped at to 'out' (at most
+ * four bytes). Returns the end of what was written. */
+static unsigned char *transform_special(struct xform_state *st, unsigned c,
+                                        unsigned char *out) {
+    if (c == '\n') {
+        if (opt_transform & XFORM_ENDS) {
+            *out++ = '$';
+        }
+        *out++ = '\n';
+        st->mid_line = 0;
+        return out;
+    }
+    /* Notation of cat -v: M- for the high bit, then ^ for control
+     * characters and ^? for DEL. */
+    if (c >= 128) {
+        *out++ = 'M';
+        *out++ = '-';
+        c -= 128;
+    }
+    if (c < 32) {
+        *out++ = '^';
+        *out++ = (unsigned char)(c + 64);
+    } else if (c == 127) {
+        *out++ = '^';
+        *out++ = '?';
+    } else {
+        *out++ = (unsigned char)c;
+    }
+    return out;
+}
+
+/* Transform the 'len' bytes at 'data' and write the result to stdout.
+ * Everything is written out before returning, so interactive input is
+ * echoed line by line. Returns one of WRITE_*. */
+static int transform_write(const unsigned char *data, size_t len) {
+    const unsigned char *p = data;
+    const unsigned char *end = data + len;
+    unsigned char *out = xform_buf + xform_len;
+    unsigned char *const buf_end = xform_buf + XFORM_BUF_SIZE;
+    int rc;
+
+    while (p < end) {
+        const unsigned char *stop;
+
+        /* Keep XFORM_SLACK bytes free for a line number and an escape. */
+        if ((size_t)(buf_end - out) < XFORM_SLACK) {
+            xform_len = (size_t)(out - xform_buf);
+            rc = transform_flush();
+            if (rc != WRITE_OK) {
+                return rc;
+            }
+            out = xform_buf;
+        }
+
+        if (!xform.mid_line) {
+            unsigned char *opened = transform_line(&xform, *p == '\n', out);
+
+            if (opened == NULL) {
+                ++p;
+                continue;
+            }
+            out = opened;
+        }
+
+        stop = transform_scan(p, end);
+        if (stop > p) {
+            size_t run = (size_t)(stop - p);
+
+            if (run + 8 <= (size_t)(buf_end - out)) {
+                memcpy(out, p, run);
+                out += run;
+            } else {
+                xform_len = (size_t)(out - xform_buf);
+                rc = transform_put(p, run);
+                if (rc != WRITE_OK) {
+                    return rc;
+                }
+                out = xform_buf + xform_len;
+            }
+            p = stop;
+            if (p == end) {
+                break;
+            }
+        }
+        out = transform_special(&xform, *p++, out);
+    }
+
+    xform_len = (size_t)(out - xform_buf);
+    return transform_flush();
+}
+
+#ifdef SEE_HAVE_THREADS
+/* Transform the bytes from 'p' to 'end' into 'out', which has room for
+ * four bytes per input byte and a line number per line started. Returns
+ * the end of what was written. */
+static unsigned char *transform_chunk(struct xform_state *st,
+                                      const unsigned char *p,
+                                      const unsigned char *end,
+                                      unsigned char *out) {
+    while (p < end) {
+        const unsigned char *stop;
+
+        if (!st->mid_line) {
+            unsigned char *opened = transform_line(st, *p == '\n', out);
+
+            if (opened == NULL) {
+                ++p;
+                continue;
+            }
+            out = opened;
+        }
+        stop = transform_scan(p, end);
+        memcpy(out, p, (size_t)(stop - p));
+        out += stop - p;
+        p = stop;
+        if (p < end) {
+            out = transform_special(st, *p++, out);
+        }
+    }
+    return out;
+}
+#endif
+
+/* Add the patterns in 'value', one per line as with grep -F. Returns 0 on
+ * success, 1 if there are more than GREP_MAX. */
+static int grep_option(const char *value) {
+    const char *p = value;
+
+    for (;;) {
+        const char *stop = strchr(p, '\n');
+        size_t len = (stop != NULL) ? (size_t)(stop - p) : strlen(p);
+
+        if (grep_count == GREP_MAX) {
+            return 1;
+        }
+        grep_list[grep_count].text = (const unsigned char *)p;
+        grep_list[grep_count].len = len;
+        ++grep_count;
+        if (len > grep_longest) {
+            grep_longest = len;
+        }
+        if (stop == NULL) {
+            return 0;
+        }
+        p = stop + 1;
+    }
+}
+
+#ifdef SEE_HAVE_AVX2
+/* The AVX2 loop of grep_search(): the first match of the 'len' (at least
+ * two) bytes at 'text' starting in whole 32-byte blocks from '*from' up
+ * to 'last', or NULL with '*from' left after the blocks searched. */
+static TARGET_AVX2 const unsigned char *search_avx2(
+    const unsigned char **from, const unsigned char *last,
+    const unsigned char *text, size_t len) {
+    const unsigned char *p = *from;
+    const __m256i first = _mm256_set1_epi8((char)text[0]);
+    const __m256i final = _mm256_set1_epi8((char)text[len - 1]);
+
+    for (; last - p >= 31; p += 32) {
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p),
+                              first),
+            _mm256_cmpeq_epi8(
+                _mm256_loadu_si256((const __m256i *)(p + len - 1)),
+                final)));
+
+        for (; mask != 0; mask &= mask - 1) {
+            const unsigned char *at = p + first_bit(mask);
+
+            if (memcmp(at + 1, text + 1, len - 2) == 0) {
+                return at;
+            }
+        }
+    }
+    *from = p;
+    return NULL;
+}
+#endif
+
+/* Return the first occurrence of 'pattern' in [p, end), or NULL. The
+ * vector loops test a block of start positions at once against the first
+ * and the last byte of the pattern, and compare the bytes in between only
+ * where both agree, which keeps false candidates rare even for common
+ * letters. */
+static const unsigned char *grep_search(const struct grep_pattern *pattern,
+                                        const unsigned char *p,
+                                        const unsigned char *end) {
+    const unsigned char *text = pattern->text;
+    const size_t len = pattern->len;
+    const unsigned char *last; /* Last start that leaves room for it */
+
+    if (len == 0) {
+        return (p < end) ? p : NULL;
+    }
+    if ((size_t)(end - p) < len) {
+        return NULL;
+    }
+    if (len == 1) {
+        return (const unsigned char *)memchr(p, text[0], (size_t)(end - p));
+    }
+    last = end - len;
+
+#if defined(SEE_HAVE_AVX2)
+    if (CPU_AVX2) {
+        const unsigned char *at = search_avx2(&p, last, text, len);
+        if (at != NULL) {
+            return at;
+        }
+    }
+#endif
+#if defined(SEE_HAVE_SSE2)
+    {
+        const __m128i first = _mm_set1_epi8((char)text[0]);
+        const __m128i final = _mm_set1_epi8((char)text[len - 1]);
+
+        for (; last - p >= 15; p += 16) {
+            unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), first),
+                _mm_cmpeq_epi8(
+                    _mm_loadu_si128((const __m128i *)(p + len - 1)),
+                    final)));
+
+            for (; mask != 0; mask &= mask - 1) {
+                const unsigned char *at = p + first_bit(mask);
+
+                if (memcmp(at + 1, text + 1, len - 2) == 0) {
+                    return at;
+                }
+            }
+        }
+    }
+#elif defined(SEE_HAVE_NEON)
+    {
+        const uint8x16_t first = vdupq_n_u8(text[0]);
+        const uint8x16_t final = vdupq_n_u8(text[len - 1]);
+
+        for (; last - p >= 15; p += 16) {
+            uint8x16_t hit = vandq_u8(vceqq_u8(vld1q_u8(p), first),
+                                      vceqq_u8(vld1q_u8(p + len - 1), final));
+            see_u64 mask = vget_lane_u64(vreinterpret_u64_u8(
+                vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+
+            /* A nibble per byte, as in transform_scan(). */
+            while (mask != 0) {
+                unsigned bit = first_bit(mask);
+                const unsigned char *at = p + (bit >> 2);
+
+                mask &= ~(0xFULL << (bit & ~3U));
+                if (memcmp(at + 1, text + 1, len - 2) == 0) {
+                    return at;
+                }
+            }
+        }
+    }
+#endif
+
+    while (p <= last) {
+        p = (const unsigned char *)memchr(p, text[0], (size_t)(last - p) + 1);
+        if (p == NULL) {
+            return NULL;
+        }
+        if (p[len - 1] == text[len - 1] &&
+            memcmp(p + 1, text + 1, len - 2) == 0) {
+            return p;
+        }
+        ++p;
+    }
+    return NULL;
+}
+
+/* Write out the staged lines. Returns one of WRITE_*. */
+static int grep_flush(void) {
+    size_t len = grep_len;
+
+    grep_len = 0;
+    return (len > 0) ? write_all(grep_buf, len) : WRITE_OK;
+}
+
+/* Stage the 'len' bytes at 'data', as transform_put() does. Returns one
+ * of WRITE_*. */
+static int grep_put(const unsigned char *data, size_t len) {
+    int rc;
+
+    if (grep_len + len <= GREP_BUF_SIZE) {
+        memcpy(grep_buf + grep_len, data, len);
+        grep_len += len;
+        return WRITE_OK;
+    }
+    rc = grep_flush();
+    if (rc != WRITE_OK || len >= GREP_BUF_SIZE / 2) {
+        return (rc != WRITE_OK) ? rc : write_all(data, len);
+    }
+    memcpy(grep_buf, data, len);
+    grep_len = len;
+    return WRITE_OK;
+}
+
+/* Stage the lines in [p, end), which ends just past a newline, that
+ * contain a pattern. Rather than going line by line, each pattern is
+ * searched for over the whole span, and its next hit kept until the
+ * output passes it, so a span without matches costs one scan per
+ * pattern. Returns one of WRITE_*. */
+static int grep_lines(const unsigned char *p, const unsigned char *end) {
+    const unsigned char *hits[GREP_MAX];
+    int i;
+
+    for (i = 0; i < grep_count; ++i) {
+        hits[i] = grep_search(&grep_list[i], p, end);
+    }
+    for (;;) {
+        const unsigned char *hit = NULL;
+        const unsigned char *start;
+        int rc;
+
+        for (i = 0; i < grep_count; ++i) {
+            if (hits[i] != NULL && (hit == NULL || hits[i] < hit)) {
+                hit = hits[i];
+            }
+        }
+        if (hit == NULL) {
+            return WRITE_OK;
+        }
+        for (start = hit; start > p && start[-1] != '\n'; --start) {
+        }
+        p = (const unsigned char *)memchr(hit, '\n', (size_t)(end - hit)) + 1;
+        rc = grep_put(start, (size_t)(p - start));
+        if (rc != WRITE_OK) {
+            return rc;
+        }
+        for (i = 0; i < grep_count; ++i) {
+            if (hits[i] != NULL && hits[i] < p) {
+                hits[i] = grep_search(&grep_list[i], p, end);
+            }
+        }
+    }
+}
+
+/* Continue the unfinished line with [p, end), which holds no newline but
+ * perhaps a last one. Once it contains a pattern, what there is of it is
+ * staged and the rest passes straight through. Returns one of WRITE_*. */
+static int grep_carry(const unsigned char *p, const unsigned char *end) {
+    size_t len = (size_t)(end - p);
+    size_t from;
+    int i;
+
+    if (grep_line_hit) {
+        grep_line_hit = (end[-1] != '\n');
+        return grep_put(p, len);
+    }
+    if (grep_line_cap - grep_line_len < len) {
+        size_t cap = (grep_line_cap != 0) ? grep_line_cap : GREP_LINE_MIN;
+        unsigned char *line;
+
+        while (cap - grep_line_len < len) {
+            cap *= 2;
+        }
+        line = (unsigned char *)realloc(grep_line, cap);
+        if (line == NULL) {
+            diag("%s: --grep: %s\n", PROG_NAME, strerror(ENOMEM));
+            return WRITE_ERROR;
+        }
+        grep_line = line;
+        grep_line_cap = cap;
+    }
+    /* Search only where a match may end in the new bytes. */
+    from = (grep_line_len > grep_longest) ? grep_line_len - grep_longest : 0;
+    memcpy(grep_line + grep_line_len, p, len);
+    grep_line_len += len;
+    for (i = 0; i < grep_count; ++i) {
+        if (grep_search(&grep_list[i], grep_line + from,
+                        grep_line + grep_line_len) != NULL) {
+            len = grep_line_len;
+            grep_line_len = 0;
+            grep_line_hit = (end[-1] != '\n');
+            return grep_put(grep_line, len);
+        }
+    }
+    if (end[-1] == '\n') {
+        grep_line_len = 0; /* No match: drop it. */
+    }
+    return WRITE_OK;
+}
+
+/* Pass on to stdout the lines of the 'len' bytes at 'data' that contain
+ * a pattern, unchanged. Lines may span calls: the one left unfinished is
+ * completed by the next. Everything staged is written out before
+ * returning. Returns one of WRITE_*. */
+static int grep_write(const unsigned char *data, size_t len) {
+    const unsigned char *p = data;
+    const unsigned char *end = data + len;
+    const unsigned char *tail = end;
+    int rc = WRITE_OK;
+
+    if (len == 0) {
+        return WRITE_OK;
+    }
+    if (grep_line_hit || grep_line_len > 0) {
+        const unsigned char *stop =
+            (const unsigned char *)memchr(p, '\n', len);
+
+        p = (stop != NULL) ? stop + 1 : end;
+        rc = grep_carry(data, p);
+    }
+    while (tail > p && tail[-1] != '\n') {
+        --tail;
+    }
+    if (rc == WRITE_OK && tail > p) {
+        rc = grep_lines(p, tail);
+    }
+    if (rc == WRITE_OK && tail < end) {
+        rc = grep_carry(tail, end);
+    }
+    return (rc == WRITE_OK) ? grep_flush() : rc;
+}
+
+/*
+ * --checksum: a digest of the bytes each FILE contributes, in the form
+ * sha256sum(1) prints, computed while they are copied: as they pass the
+ * read loops or leave a mapping, or, beside an in-kernel copy, from a
+ * hash-only read of the page cache that trails it on a thread.
+ */
+
+/* Little- and big-endian loads, which compilers turn into plain loads
+ * (and byte swaps) where the target allows. */
+static see_u64 load64le(const unsigned char *p) {
+    return (see_u64)p[0] | ((see_u64)p[1] << 8) | ((see_u64)p[2] << 16) |
+           ((see_u64)p[3] << 24) | ((see_u64)p[4] << 32) |
+           ((see_u64)p[5] << 40) | ((see_u64)p[6] << 48) |
+           ((see_u64)p[7] << 56);
+}
+
+static see_u32 load32le(const unsigned char *p) {
+    return (see_u32)p[0] | ((see_u32)p[1] << 8) | ((see_u32)p[2] << 16) |
+           ((see_u32)p[3] << 24);
+}
+
+#ifndef SEE_HAVE_SHA_HW
+static see_u32 load32be(const unsigned char *p) {
+    return ((see_u32)p[0] << 24) | ((see_u32)p[1] << 16) |
+           ((see_u32)p[2] << 8) | (see_u32)p[3];
+}
+#endif
+
+/* Build the tables of the portable CRC32C and clear the digest. */
+static void checksum_setup(void) {
+#ifndef SEE_HAVE_CRC32C_HW
+    see_u32 c;
+    int i;
+    int k;
+
+    for (i = 0; i < 256; ++i) {
+        c = (see_u32)i;
+        for (k = 0; k < 8; ++k) {
+            c = (c >> 1) ^ (0x82F63B78UL & (0U - (c & 1U)));
+        }
+        crc32c_table[0][i] = c;
+    }
+    for (i = 0; i < 256; ++i) {
+        c = crc32c_table[0][i];
+        for (k = 1; k < 8; ++k) {
+            c = crc32c_table[0][c & 0xFF] ^ (c >> 8);
+            crc32c_table[k][i] = c;
+        }
+    }
+#endif
+    checksum_reset(&file_checksum);
+}
+
+static void checksum_reset(struct see_checksum *c) {
+    static const see_u32 sha256_init[8] = {
+        0x6A09E667UL, 0xBB67AE85UL, 0x3C6EF372UL, 0xA54FF53AUL,
+        0x510E527FUL, 0x9B05688CUL, 0x1F83D9ABUL, 0x5BE0CD19UL
+    };
+
+    c->length = 0;
+    c->crc = 0xFFFFFFFFUL;
+    c->lane[0] = XXH_PRIME1 + XXH_PRIME2;
+    c->lane[1] = XXH_PRIME2;
+    c->lane[2] = 0;
+    c->lane[3] = 0 - XXH_PRIME1;
+    memcpy(c->state, sha256_init, sizeof(c->state));
+    c->block_len = 0;
+    c->failed = 0;
+}
+
+#ifdef SEE_HAVE_CRC32C_SSE42
+/* CRC32C with the SSE4.2 instructions, eight bytes at a time. */
+static TARGET_SSE42 see_u32 crc32c_sse42(see_u32 crc, const unsigned char *p,
+                                         size_t len) {
+#if defined(__x86_64__)
+    see_u64 wide = crc;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        wide = _mm_crc32_u64(wide, load64le(p));
+    }
+    crc = (see_u32)wide;
+#endif
+    for (; len > 0; ++p, --len) {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+    return crc;
+}
+#endif
+
+/* CRC32C (Castagnoli) of 'len' more bytes: the SSE4.2 or ARMv8 CRC32
+ * instructions eight bytes at a time, or slicing-by-8 tables. */
+static see_u32 crc32c_update(see_u32 crc, const unsigned char *p,
+                             size_t len) {
+#if defined(SEE_HAVE_CRC32C_HW) && defined(SEE_HAVE_CRC32C_SSE42)
+    return crc32c_sse42(crc, p, len);
+#elif defined(SEE_HAVE_CRC32C_HW)
+    for (; len >= 8; p += 8, len -= 8) {
+        crc = __crc32cd(crc, load64le(p));
+    }
+    for (; len > 0; ++p, --len) {
+        crc = __crc32cb(crc, *p);
+    }
+    return crc;
+#else
+#ifdef SEE_HAVE_CRC32C_SSE42
+    if (CPU_SSE42) {
+        return crc32c_sse42(crc, p, len);
+    }
+#endif
+    for (; len >= 8; p += 8, len -= 8) {
+        see_u32 low = crc ^ load32le(p);
+        see_u32 high = load32le(p + 4);
+
+        crc = crc32c_table[7][low & 0xFF] ^
+              crc32c_table[6][(low >> 8) & 0xFF] ^
+              crc32c_table[5][(low >> 16) & 0xFF] ^
+              crc32c_table[4][low >> 24] ^
+              crc32c_table[3][high & 0xFF] ^
+              crc32c_table[2][(high >> 8) & 0xFF] ^
+              crc32c_table[1][(high >> 16) & 0xFF] ^
+              crc32c_table[0][high >> 24];
+    }
+    for (; len > 0; ++p, --len) {
+        crc = crc32c_table[0][(crc ^ *p) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+#endif
+}
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+#define ROTR32(x, r) (((x) >> (r)) | ((x) << (32 - (r))))
+
+static see_u64 xxh64_round(see_u64 acc, see_u64 input) {
+    acc += input * XXH_PRIME2;
+    acc = ROTL64(acc, 31);
+    return acc * XXH_PRIME1;
+}
+
+/* XXH64 over whole 32-byte stripes. */
+static void xxh64_stripes(struct see_checksum *c, const unsigned char *p,
+                          size_t len) {
+    see_u64 v1 = c->lane[0];
+    see_u64 v2 = c->lane[1];
+    see_u64 v3 = c->lane[2];
+    see_u64 v4 = c->lane[3];
+
+    for (; len >= 32; p += 32, len -= 32) {
+        v1 = xxh64_round(v1, load64le(p));
+        v2 = xxh64_round(v2, load64le(p + 8));
+        v3 = xxh64_round(v3, load64le(p + 16));
+        v4 = xxh64_round(v4, load64le(p + 24));
+    }
+    c->lane[0] = v1;
+    c->lane[1] = v2;
+    c->lane[2] = v3;
+    c->lane[3] = v4;
+}
+
+static see_u64 xxh64_digest(const struct see_checksum *c) {
+    const unsigned char *p = c->block;
+    size_t len = c->block_len;
+    see_u64 h;
+    int i;
+
+    if (c->length >= 32) {
+        h = ROTL64(c->lane[0], 1) + ROTL64(c->lane[1], 7) +
+            ROTL64(c->lane[2], 12) + ROTL64(c->lane[3], 18);
+        for (i = 0; i < 4; ++i) {
+            h ^= xxh64_round(0, c->lane[i]);
+            h = h * XXH_PRIME1 + XXH_PRIME4;
+        }
+    } else {
+        h = XXH_PRIME5;
+    }
+    h += c->length;
+    for (; len >= 8; p += 8, len -= 8) {
+        h ^= xxh64_round(0, load64le(p));
+        h = ROTL64(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (len >= 4) {
+        h ^= (see_u64)load32le(p) * XXH_PRIME1;
+        h = ROTL64(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len > 0; ++p, --len) {
+        h ^= (see_u64)*p * XXH_PRIME5;
+        h = ROTL64(h, 11) * XXH_PRIME1;
+    }
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+static const see_u32 sha256_k[64] = {
+    0x428A2F98UL, 0x71374491UL, 0xB5C0FBCFUL, 0xE9B5DBA5UL, 0x3956C25BUL,
+    0x59F111F1UL, 0x923F82A4UL, 0xAB1C5ED5UL, 0xD807AA98UL, 0x12835B01UL,
+    0x243185BEUL, 0x550C7DC3UL, 0x72BE5D74UL, 0x80DEB1FEUL, 0x9BDC06A7UL,
+    0xC19BF174UL, 0xE49B69C1UL, 0xEFBE4786UL, 0x0FC19DC6UL, 0x240CA1CCUL,
+    0x2DE92C6FUL, 0x4A7484AAUL, 0x5CB0A9DCUL, 0x76F988DAUL, 0x983E5152UL,
+    0xA831C66DUL, 0xB00327C8UL, 0xBF597FC7UL, 0xC6E00BF3UL, 0xD5A79147UL,
+    0x06CA6351UL, 0x14292967UL, 0x27B70A85UL, 0x2E1B2138UL, 0x4D2C6DFCUL,
+    0x53380D13UL, 0x650A7354UL, 0x766A0ABBUL, 0x81C2C92EUL, 0x92722C85UL,
+    0xA2BFE8A1UL, 0xA81A664BUL, 0xC24B8B70UL, 0xC76C51A3UL, 0xD192E819UL,
+    0xD6990624UL, 0xF40E3585UL, 0x106AA070UL, 0x19A4C116UL, 0x1E376C08UL,
+    0x2748774CUL, 0x34B0BCB5UL, 0x391C0CB3UL, 0x4ED8AA4AUL, 0x5B9CCA4FUL,
+    0x682E6FF3UL, 0x748F82EEUL, 0x78A5636FUL, 0x84C87814UL, 0x8CC70208UL,
+    0x90BEFFFAUL, 0xA4506CEBUL, 0xBEF9A3F7UL, 0xC67178F2UL
+};
+
+#ifdef SEE_HAVE_SHA_NI
+/* SHA-256 over whole 64-byte blocks with the SHA extensions, two rounds
+ * per instruction. */
+static TARGET_SHA void sha256_blocks_ni(struct see_checksum *c,
+                                        const unsigned char *p, size_t len) {
+    const __m128i swap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+                                      4, 5, 6, 7, 0, 1, 2, 3);
+    __m128i msg[4];
+    __m128i state0;
+    __m128i state1;
+    __m128i tmp;
+
+    /* The instructions keep the state as ABEF and CDGH. */
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)c->state),
+                            0xB1);
+    state1 = _mm_shuffle_epi32(
+        _mm_loadu_si128((const __m128i *)(c->state + 4)), 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for (; len >= 64; p += 64, len -= 64) {
+        const __m128i abef = state0;
+        const __m128i cdgh = state1;
+        int g;
+
+        /* Sixteen groups of four rounds; the schedule runs three groups
+         * ahead in 'msg', indexed by group modulo four. */
+        for (g = 0; g < 16; ++g) {
+            __m128i words;
+
+            if (g < 4) {
+                msg[g] = _mm_shuffle_epi8(
+                    _mm_loadu_si128((const __m128i *)(p + 16 * g)), swap);
+            }
+            words = _mm_add_epi32(
+                msg[g & 3], _mm_loadu_si128((const __m128i *)&sha256_k[4 * g]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, words);
+            if (g >= 3 && g <= 14) {
+                tmp = _mm_alignr_epi8(msg[g & 3], msg[(g - 1) & 3], 4);
+                msg[(g + 1) & 3] = _mm_sha256msg2_epu32(
+                    _mm_add_epi32(msg[(g + 1) & 3], tmp), msg[g & 3]);
+            }
+            state0 = _mm_sha256rnds2_epu32(state0, state1,
+                                           _mm_shuffle_epi32(words, 0x0E));
+            if (g >= 1 && g <= 12) {
+                msg[(g - 1) & 3] =
+                    _mm_sha256msg1_epu32(msg[(g - 1) & 3], msg[g & 3]);
+            }
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    _mm_storeu_si128((__m128i *)c->state, _mm_blend_epi16(tmp, state1, 0xF0));
+    _mm_storeu_si128((__m128i *)(c->state + 4),
+                     _mm_alignr_epi8(state1, tmp, 8));
+}
+#endif
+
+/* SHA-256 over whole 64-byte blocks: with the SHA extensions where the
+ * CPU has them, else the FIPS 180-4 rounds in C. */
+static void sha256_blocks(struct see_checksum *c, const unsigned char *p,
+                          size_t len) {
+#ifdef SEE_HAVE_SHA_HW
+    sha256_blocks_ni(c, p, len);
+#else
+    see_u32 w[64];
+    int i;
+
+#ifdef SEE_HAVE_SHA_NI
+    if (CPU_SHA) {
+        sha256_blocks_ni(c, p, len);
+        return;
+    }
+#endif
+    for (; len >= 64; p += 64, len -= 64) {
+        see_u32 a = c->state[0], b = c->state[1], s2 = c->state[2];
+        see_u32 d = c->state[3], e = c->state[4], f = c->state[5];
+        see_u32 g = c->state[6], h = c->state[7];
+
+        for (i = 0; i < 16; ++i) {
+            w[i] = load32be(p + 4 * i);
+        }
+        for (; i < 64; ++i) {
+            see_u32 s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^
+                         (w[i - 15] >> 3);
+            see_u32 s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^
+                         (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        for (i = 0; i < 64; ++i) {
+            see_u32 t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) +
+                         ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            see_u32 t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) +
+                         ((a & b) ^ (a & s2) ^ (b & s2));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = s2;
+            s2 = b;
+            b = a;
+            a = t1 + t2;
+        }
+        c->state[0] += a;
+        c->state[1] += b;
+        c->state[2] += s2;
+        c->state[3] += d;
+        c->state[4] += e;
+        c->state[5] += f;
+        c->state[6] += g;
+        c->state[7] += h;
+    }
+#endif
+}
+
+/* Feed 'len' bytes to a digest made of 'size'-byte blocks, keeping what
+ * is short of a whole block for the next call. */
+static void checksum_feed(struct see_checksum *c, const unsigned char *p,
+                          size_t len, size_t size,
+                          void (*blocks)(struct see_checksum *,
+                                         const unsigned char *, size_t)) {
+    size_t whole;
+
+    if (c->block_len > 0) {
+        size_t fill = size - c->block_len;
+
+        if (fill > len) {
+            fill = len;
+        }
+        memcpy(c->block + c->block_len, p, fill);
+        c->block_len += fill;
+        p += fill;
+        len -= fill;
+        if (c->block_len < size) {
+            return;
+        }
+        blocks(c, c->block, size);
+        c->block_len = 0;
+    }
+    whole = len - len % size;
+    blocks(c, p, whole);
+    memcpy(c->block, p + whole, len - whole);
+    c->block_len = len - whole;
+}
+
+/* Add the 'len' bytes at 'data' to the digest 'c'. */
+static void checksum_update(struct see_checksum *c,
+                            const unsigned char *data, size_t len) {
+    c->length += len;
+    switch (opt_checksum) {
+    case CHECKSUM_CRC32C:
+        c->crc = crc32c_update(c->crc, data, len);
+        break;
+    case CHECKSUM_XXH64:
+        checksum_feed(c, data, len, 32, xxh64_stripes);
+        break;
+    case CHECKSUM_SHA256:
+        checksum_feed(c, data, len, 64, sha256_blocks);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Print the digest of the FILE 'name' and start over for the next. A
+ * digest that missed some of the output is not printed. */
+static void checksum_file_done(const char *name) {
+    static const char hex[] = "0123456789abcdef";
+    struct see_checksum *c = &file_checksum;
+    unsigned char digest[32];
+    char text[65];
+    size_t len = 0;
+    size_t i;
+
+    if (opt_checksum == CHECKSUM_NONE) {
+        return;
+    }
+    if (c->failed) {
+        checksum_reset(c);
+        return;
+    }
+    if (opt_checksum == CHECKSUM_SHA256) {
+        see_u64 bits = c->length * 8;
+        unsigned char pad[72];
+        size_t pad_len = 64 - (size_t)((c->length + 8) % 64);
+
+        memset(pad, 0, sizeof(pad));
+        pad[0] = 0x80;
+        for (i = 0; i < 8; ++i) {
+            pad[pad_len + i] = (unsigned char)(bits >> (56 - 8 * i));
+        }
+        checksum_feed(c, pad, pad_len + 8, 64, sha256_blocks);
+        for (i = 0; i < 32; ++i) {
+            digest[i] = (unsigned char)(c->state[i / 4] >> (24 - 8 * (i % 4)));
+        }
+        len = 32;
+    } else {
+        see_u64 value = (opt_checksum == CHECKSUM_CRC32C)
+                            ? (see_u64)(c->crc ^ 0xFFFFFFFFUL)
+                            : xxh64_digest(c);
+
+        len = (opt_checksum == CHECKSUM_CRC32C) ? 4 : 8;
+        for (i = 0; i < len; ++i) {
+            digest[i] = (unsigned char)(value >> (8 * (len - 1 - i)));
+        }
+    }
+    for (i = 0; i < len; ++i) {
+        text[2 * i] = hex[digest[i] >> 4];
+        text[2 * i + 1] = hex[digest[i] & 15];
+    }
+    text[2 * len] = '\0';
+    fprintf(checksum_stream, "%s  %s\n", text, name);
+    checksum_reset(c);
+}
+
+#if defined(SEE_HAVE_SPARSE) || (defined(SEE_HAVE_MMAP) && defined(_WIN32))
+/* Write the 'len' bytes at 'data', which come straight from the FILE
+ * being copied, to stdout, adding them to its digest. Returns one of
+ * WRITE_*. */
+static int write_raw(const unsigned char *data, size_t len) {
+    if (opt_checksum != CHECKSUM_NONE) {
+        checksum_update(&file_checksum, data, len);
+    }
+    return write_all(data, len);
+}
+#endif
+
+/* Send 'len' bytes of final output to stdout, through --grep when it has
+ * patterns. Returns one of WRITE_*. */
+static int write_filtered(const unsigned char *data, size_t len) {
+    return (grep_count > 0) ? grep_write(data, len) : write_all(data, len);
+}
+
+/* Send 'len' selected bytes to stdout, through the transforms when any
+ * is enabled. Returns one of WRITE_*. */
+static int write_output(const unsigned char *data, size_t len) {
+    if (opt_checksum != CHECKSUM_NONE) {
+        checksum_update(&file_checksum, data, len);
+    }
+    return (opt_transform != 0) ? transform_write(data, len)
+                                : write_filtered(data, len);
+}
+
+/* Pass 'len' bytes read from an input on: to stdout, or only the part
+ * --head lets through, or into 'tail_buf'. Returns one of WRITE_*; once
+ * --head is satisfied it returns WRITE_CLOSED, which ends the read loops
+ * just as a closed pipe does. */
+static int write_data(const unsigned char *data, size_t len) {
+    size_t pass = len;
+    int rc;
+
+    if (opt_slice == SLICE_NONE) {
+        return write_output(data, len);
+    }
+    if (opt_slice == SLICE_TAIL) {
+        return slice_buffering ? tail_keep(data, len)
+                               : write_output(data, len);
+    }
+
+    if (slice_left == 0) {
+        return WRITE_CLOSED;
+    }
+    if (opt_slice_bytes) {
+        if ((see_u64)pass > slice_left) {
+            pass = (size_t)slice_left;
+        }
+        slice_left -= pass;
+    } else {
+        see_u64 lines = count_lines(data, len);
+
+        if (lines < slice_left) {
+            slice_left -= lines;
+        } else {
+            const unsigned char *p = data;
+
+            for (; slice_left > 0; --slice_left) {
+                p = (const unsigned char *)memchr(p, '\n',
+                                                  (size_t)(data + len - p)) +
+                    1;
+            }
+            pass = (size_t)(p - data);
+        }
+    }
+    rc = write_output(data, pass);
+    return (rc == WRITE_OK && slice_left == 0) ? WRITE_CLOSED : rc;
+}
+
+#ifdef SEE_HAVE_THREADS
+/*
+ * Minimal threading layer: atomics on 'long', a thread start/join pair and
+ * an event count, which lets a thread sleep until another one publishes
+ * progress without any lock on the fast path.
+ */
+typedef volatile long see_atomic;
+
+#if defined(_MSC_VER)
+#define atomic_load(p)      InterlockedCompareExchange((p), 0, 0)
+#define atomic_store(p, v)  ((void)InterlockedExchange((p), (v)))
+#define atomic_add(p, v)    (InterlockedExchangeAdd((p), (v)) + (v))
+#define atomic_cas(p, expected, desired) \
+    (InterlockedCompareExchange((p), (desired), (expected)) == (expected))
+#else
+#define atomic_load(p)      __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define atomic_store(p, v)  __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define atomic_add(p, v)    __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define atomic_cas(p, expected, desired) atomic_cas_long((p), (expected), \
+                                                         (desired))
+
+static int atomic_cas_long(see_atomic *p, long expected, long desired) {
+    return __atomic_compare_exchange_n(p, &expected, desired, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+#endif
+
+#ifdef _WIN32
+typedef HANDLE see_thread;
+typedef CRITICAL_SECTION see_mutex;
+typedef CONDITION_VARIABLE see_cond;
+#define mutex_init(m)     InitializeCriticalSection(m)
+#define mutex_destroy(m)  DeleteCriticalSection(m)
+#define mutex_lock(m)     EnterCriticalSection(m)
+#define mutex_unlock(m)   LeaveCriticalSection(m)
+#define cond_init(c)      InitializeConditionVariable(c)
+#define cond_destroy(c)   ((void)(c))
+#define cond_wait(c, m)   ((void)SleepConditionVariableCS((c), (m), INFINITE))
+#define cond_broadcast(c) WakeAllConditionVariable(c)
+#else
+typedef pthread_t see_thread;
+typedef pthread_mutex_t see_mutex;
+typedef pthread_cond_t see_cond;
+#define mutex_init(m)     ((void)pthread_mutex_init((m), NULL))
+#define mutex_destroy(m)  ((void)pthread_mutex_destroy(m))
+#define mutex_lock(m)     ((void)pthread_mutex_lock(m))
+#define mutex_unlock(m)   ((void)pthread_mutex_unlock(m))
+#define cond_init(c)      ((void)pthread_cond_init((c), NULL))
+#define cond_destroy(c)   ((void)pthread_cond_destroy(c))
+#define cond_wait(c, m)   ((void)pthread_cond_wait((c), (m)))
+#define cond_broadcast(c) ((void)pthread_cond_broadcast(c))
+#endif
+
+/* Event count: read the epoch, re-check the condition, then wait for the
+ * epoch to move on. Notifiers only take the lock when someone sleeps. */
+struct see_event {
+    see_mutex  lock;
+    see_cond   cond;
+    see_atomic epoch;
+    see_atomic waiters;
+};
+
+static void event_init(struct see_event *ev) {
+    mutex_init(&ev->lock);
+    cond_init(&ev->cond);
+    ev->epoch = 0;
+    ev->waiters = 0;
+}
+
+static void event_destroy(struct see_event *ev) {
+    cond_destroy(&ev->cond);
+    mutex_destroy(&ev->lock);
+}
+
+static long event_epoch(struct see_event *ev) {
+    return atomic_load(&ev->epoch);
+}
+
+static void event_wait(struct see_event *ev, long epoch) {
+    mutex_lock(&ev->lock);
+    (void)atomic_add(&ev->waiters, 1);
+    while (atomic_load(&ev->epoch) == epoch) {
+        cond_wait(&ev->cond, &ev->lock);
+    }
+    (void)atomic_add(&ev->waiters, -1);
+    mutex_unlock(&ev->lock);
+}
+
+static void event_notify(struct see_event *ev) {
+    (void)atomic_add(&ev->epoch, 1);
+    if (atomic_load(&ev->waiters) != 0) {
+        mutex_lock(&ev->lock);
+        cond_broadcast(&ev->cond);
+        mutex_unlock(&ev->lock);
+    }
+}
+
+#ifdef _WIN32
+typedef unsigned (__stdcall *see_thread_fn)(void *);
+#define THREAD_FN(name, arg) static unsigned __stdcall name(void *arg)
+#define THREAD_RETURN        return 0
+#else
+typedef void *(*see_thread_fn)(void *);
+#define THREAD_FN(name, arg) static void *name(void *arg)
+#define THREAD_RETURN        return NULL
+#endif
+
+/* Returns 0 on success, or an errno-style code. */
+static int thread_start(see_thread *thread, see_thread_fn fn, void *arg) {
+#ifdef _WIN32
+    uintptr_t handle = _beginthreadex(NULL, 0, fn, arg, 0, NULL);
+    if (handle == 0) {
+        return errno != 0 ? errno : EAGAIN;
+    }
+    *thread = (HANDLE)handle;
+    return 0;
+#else
+    return pthread_create(thread, NULL, fn, arg);
+#endif
+}
+
+static void thread_join(see_thread thread) {
+#ifdef _WIN32
+    (void)WaitForSingleObject(thread, INFINITE);
+    (void)CloseHandle(thread);
+#else
+    (void)pthread_join(thread, NULL);
+#endif
+}
+
+/*
+ * Lock-free LIFO of indexes below 65535, linked through 'links': 'top'
+ * holds a 15-bit tag above the index + 1 of the first entry (0 when
+ * empty), and links[i] the index + 1 of the entry after i. The tag moves
+ * on with every change, so a pop that raced with others fails its
+ * exchange rather than following a stale link.
+ */
+static void freelist_push(see_atomic *top, see_atomic *links, long index) {
+    for (;;) {
+        long old = atomic_load(top);
+        long tag = (long)(((unsigned long)old >> 16) + 1) & 0x7fff;
+
+        atomic_store(&links[index], old & 0xffff);
+        if (atomic_cas(top, old, (tag << 16) | (index + 1))) {
+            return;
+        }
+    }
+}
+
+/* Returns the index taken off the list, or -1 if it is empty. */
+static long freelist_pop(see_atomic *top, see_atomic *links) {
+    for (;;) {
+        long old = atomic_load(top);
+        long tag = (long)(((unsigned long)old >> 16) + 1) & 0x7fff;
+        long index = (old & 0xffff) - 1;
+
+        if (index < 0) {
+            return -1;
+        }
+        if (atomic_cas(top, old, (tag << 16) | atomic_load(&links[index]))) {
+            return index;
+        }
+    }
+}
+
+/*
+ * Slab pool for chunk buffers: POOL_SLAB-byte slabs carved from one
+ * arena_map() region, handed out and taken back through a free list. The
+ * pool lives as long as the process, so the chunks of one large FILE are
+ * the already-faulted huge pages of the FILE before, where malloc() would
+ * map and unmap them on every FILE.
+ */
+struct see_pool {
+    unsigned char *arena; /* NULL until pool_setup() succeeds */
+    size_t         len;
+    see_atomic     top;
+    see_atomic    *links;
+};
+
+static struct see_pool slab_pool;
+
+/* Give 'slab_pool' 'count' slabs (up to POOL_MAX), if it has none yet;
+ * on failure it stays empty and slab_alloc() falls back to malloc(). */
+static void pool_setup(long count) {
+    struct see_pool *pool = &slab_pool;
+    long i;
+
+    if (count > POOL_MAX) {
+        count = POOL_MAX;
+    }
+    if (pool->arena != NULL || count <= 0 ||
+        (size_t)count > (size_t)-1 / POOL_SLAB) {
+        return;
+    }
+    pool->links = (see_atomic *)calloc((size_t)count, sizeof(*pool->links));
+    if (pool->links == NULL) {
+        return;
+    }
+    pool->arena = (unsigned char *)arena_map((size_t)count * POOL_SLAB, 0,
+                                             &pool->len);
+    if (pool->arena == NULL) {
+        free((void *)pool->links);
+        pool->links = NULL;
+        return;
+    }
+    for (i = count - 1; i >= 0; --i) {
+        freelist_push(&pool->top, pool->links, i);
+    }
+}
+
+/* A buffer of at least 'size' bytes: a slab when one is free and large
+ * enough, else from malloc(). Sets '*cap' to its usable size. Returns
+ * NULL on failure. */
+static unsigned char *slab_alloc(size_t size, size_t *cap) {
+    struct see_pool *pool = &slab_pool;
+    unsigned char *buf;
+
+    if (pool->arena != NULL && size <= POOL_SLAB) {
+        long index = freelist_pop(&pool->top, pool->links);
+
+        if (index >= 0) {
+            *cap = POOL_SLAB;
+            return pool->arena + (size_t)index * POOL_SLAB;
+        }
+    }
+    buf = (unsigned char *)malloc(size > 0 ? size : 1);
+    *cap = (buf != NULL) ? size : 0;
+    return buf;
+}
+
+/* Return a slab_alloc() buffer (or NULL). */
+static void slab_free(unsigned char *buf) {
+    struct see_pool *pool = &slab_pool;
+
+    if (pool->arena != NULL && buf >= pool->arena &&
+        buf < pool->arena + pool->len) {
+        freelist_push(&pool->top, pool->links,
+                      (long)((size_t)(buf - pool->arena) / POOL_SLAB));
+    } else {
+        free(buf);
+    }
+}
+
+/*
+ * Ordered writer. Workers turn sequence-numbered chunks into output in any
+ * order; the thread that submitted them writes the results in sequence.
+ * A chunk comes off a lock-free free list, is filled and submitted, is
+ * processed by whichever worker claims it, and is published in the reorder
+ * window, from which the writer takes chunk 'written' when it is done and
+ * returns it to the free list. Memory is bounded by the chunk count, as
+ * every sequence number in flight holds a chunk.
+ */
+struct see_chunk {
+    long                 seq;
+    const unsigned char *src;       /* Input for the worker */
+    size_t               src_len;
+    unsigned char       *in;        /* Owned slab_alloc() input, or NULL */
+    size_t               in_cap;
+    unsigned char       *out;       /* Owned slab_alloc() output, or NULL */
+    size_t               out_cap;
+    size_t               out_len;   /* Output produced */
+    size_t               code;      /* Result code for the user */
+    int                  deferred;  /* Left for the writer to handle */
+    struct xform_state   xform;     /* Line state where 'src' starts */
+};
+
+struct ordered {
+    struct see_chunk *chunks;
+    long              count;
+    void            (*process)(struct see_chunk *chunk);
+    see_atomic        free_top;  /* Free list of chunk indexes */
+    see_atomic       *free_links;
+    see_atomic       *order;     /* Chunk index per seq % count */
+    see_atomic       *ready;     /* seq + 1 per seq % count once processed */
+    see_atomic        submitted; /* Sequence numbers handed out */
+    see_atomic        claimed;   /* Sequence numbers taken by workers */
+    see_atomic        stop;
+    long              written;   /* Writer only: next sequence due */
+    struct see_event  work;      /* 'submitted' grew, or 'stop' was set */
+    struct see_event  progress;  /* A chunk was processed */
+    see_thread       *threads;
+    int               started;
+};
+
+/* Take a chunk off the free list. Returns NULL if all are in use. */
+static struct see_chunk *ordered_acquire(struct ordered *o) {
+    long index = freelist_pop(&o->free_top, o->free_links);
+
+    return (index >= 0) ? &o->chunks[index] : NULL;
+}
+
+THREAD_FN(ordered_worker, arg) {
+    struct ordered *o = (struct ordered *)arg;
+
+    for (;;) {
+        long epoch = event_epoch(&o->work);
+        long seq = atomic_load(&o->claimed);
+        struct see_chunk *chunk;
+
+        if (atomic_load(&o->stop)) {
+            break;
+        }
+        if (seq >= atomic_load(&o->submitted)) {
+            event_wait(&o->work, epoch);
+            continue;
+        }
+        if (!atomic_cas(&o->claimed, seq, seq + 1)) {
+            continue;
+        }
+        chunk = &o->chunks[atomic_load(&o->order[seq % o->count])];
+        if (!chunk->deferred) {
+            o->process(chunk);
+        }
+        atomic_store(&o->ready[seq % o->count], seq + 1);
+        event_notify(&o->progress);
+    }
+    THREAD_RETURN;
+}
+
+/* Set up 'o' with 'count' chunks (at most 65535) and start 'threads'
+ * workers running 'process'. Returns 0, or 1 if no worker could be
+ * started (nothing is left allocated). */
+static int ordered_start(struct ordered *o, long count, int threads,
+                         void (*process)(struct see_chunk *chunk)) {
+    long i;
+
+    memset(o, 0, sizeof(*o));
+    o->chunks = (struct see_chunk *)calloc((size_t)count,
+                                           sizeof(*o->chunks));
+    o->order = (see_atomic *)calloc((size_t)count, sizeof(*o->order));
+    o->ready = (see_atomic *)calloc((size_t)count, sizeof(*o->ready));
+    o->free_links = (see_atomic *)calloc((size_t)count,
+                                         sizeof(*o->free_links));
+    o->threads = (see_thread *)malloc((size_t)threads *
+                                      sizeof(*o->threads));
+    if (o->chunks == NULL || o->order == NULL || o->ready == NULL ||
+        o->free_links == NULL || o->threads == NULL) {
+        free(o->chunks);
+        free((void *)o->order);
+        free((void *)o->ready);
+        free((void *)o->free_links);
+        free(o->threads);
+        return 1;
+    }
+    pool_setup(2 * count); /* An input and an output buffer per chunk */
+    o->count = count;
+    o->process = process;
+    for (i = count - 1; i >= 0; --i) {
+        freelist_push(&o->free_top, o->free_links, i);
+    }
+    event_init(&o->work);
+    event_init(&o->progress);
+    while (o->started < threads &&
+           thread_start(&o->threads[o->started], ordered_worker, o) == 0) {
+        ++o->started;
+    }
+    if (o->started == 0) {
+        ordered_finish(o);
+        return 1;
+    }
+    return 0;
+}
+
+/* Hand the filled 'chunk' to the workers as the next in sequence. */
+static void ordered_submit(struct ordered *o, struct see_chunk *chunk) {
+    long seq = atomic_load(&o->submitted);
+
+    chunk->seq = seq;
+    atomic_store(&o->order[seq % o->count], chunk - o->chunks);
+    atomic_store(&o->submitted, seq + 1);
+    event_notify(&o->work);
+}
+
+/* The chunk due to be written, once it has been processed, or NULL. */
+static struct see_chunk *ordered_take(struct ordered *o) {
+    long slot = o->written % o->count;
+
+    if (o->written == atomic_load(&o->submitted) ||
+        atomic_load(&o->ready[slot]) != o->written + 1) {
+        return NULL;
+    }
+    return &o->chunks[atomic_load(&o->order[slot])];
+}
+
+/* Return the written 'chunk' to the free list, moving on to the next. */
+static void ordered_release(struct ordered *o, struct see_chunk *chunk) {
+    ++o->written;
+    freelist_push(&o->free_top, o->free_links, chunk - o->chunks);
+}
+
+/* Fill chunks with 'fill' and write them in order with 'write' until
+ * 'fill' runs out, keeping the workers busy in between. 'fill' returns 1
+ * for a chunk to submit, 0 at the end, or -1 after reporting an error;
+ * 'write' returns one of WRITE_*. Returns 0 on success (including a
+ * broken pipe), 1 on error. */
+static int ordered_run(struct ordered *o,
+                       int (*fill)(void *context, struct see_chunk *chunk),
+                       int (*write)(void *context, struct see_chunk *chunk),
+                       void *context) {
+    int filling = 1;
+    int status = 0;
+
+    for (;;) {
+        long epoch = event_epoch(&o->progress);
+        struct see_chunk *chunk = ordered_take(o);
+
+        if (chunk != NULL) {
+            int rc = write(context, chunk);
+
+            ordered_release(o, chunk);
+            if (rc != WRITE_OK) {
+                status = (rc == WRITE_ERROR);
+                break;
+            }
+            continue;
+        }
+        if (filling && (chunk = ordered_acquire(o)) != NULL) {
+            int rc = fill(context, chunk);
+
+            if (rc > 0) {
+                ordered_submit(o, chunk);
+                continue;
+            }
+            freelist_push(&o->free_top, o->free_links, chunk - o->chunks);
+            filling = 0;
+            status = (rc < 0);
+            continue;
+        }
+        if (!filling && o->written == atomic_load(&o->submitted)) {
+            break;
+        }
+        event_wait(&o->progress, epoch);
+    }
+    return status;
+}
+
+/* Stop the workers and free everything 'o' holds. */
+static void ordered_finish(struct ordered *o) {
+    long i;
+
+    atomic_store(&o->stop, 1);
+    event_notify(&o->work);
+    while (o->started > 0) {
+        thread_join(o->threads[--o->started]);
+    }
+    for (i = 0; i < o->count; ++i) {
+        slab_free(o->chunks[i].in);
+        slab_free(o->chunks[i].out);
+    }
+    event_destroy(&o->progress);
+    event_destroy(&o->work);
+    free(o->chunks);
+    free((void *)o->order);
+    free((void *)o->ready);
+    free((void *)o->free_links);
+    free(o->threads);
+}
+
+/* Worker threads for the ordered writer: --threads, or one per CPU up to
+ * ORDER_THREADS. */
+static int order_threads(void) {
+    int threads = opt_threads;
+
+    if (threads == 0) {
+        threads = online_cpus();
+        if (threads > ORDER_THREADS) {
+            threads = ORDER_THREADS;
+        }
+    }
+    return threads;
+}
+
+#ifdef SEE_HAVE_PIPELINE
+/* One buffer of the reader/writer ring. */
+struct ring_slot {
+    unsigned char *data;
+    size_t         len;
+    int            error; /* errno of a failed read, or 0 */
+};
+
+/* State shared by the reader thread and the writing (main) thread. The
+ * reader owns slots [tail, head + 1) until it publishes them by advancing
+ * 'head'; the writer owns [tail, head) until it advances 'tail'. A slot
+ * with len == 0 ends the stream (EOF, or a read error if 'error' is set). */
+struct pipeline {
+#ifdef SEE_USE_STDIO
+    FILE            *input_stream;
+#else
+    int              input_fd;
+#endif
+    size_t           chunk_size;
+    struct ring_slot slots[RING_SLOTS];
+    see_atomic       head;     /* Slots filled so far */
+    see_atomic       tail;     /* Slots drained so far */
+    see_atomic       stop;     /* Writer gave up; reader should exit */
+    struct see_event filled;   /* 'head' advanced */
+    struct see_event drained;  /* 'tail' advanced or 'stop' set */
+    struct see_stats stats;    /* Reader-side counters, merged after join */
+};
+
+/* Read up to 'len' bytes into 'data', retrying on EINTR. Returns the byte
+ * count (0 at EOF) or -1 with the errno value in 'error'. */
+static long pipeline_read(struct pipeline *p, unsigned char *data,
+                          size_t len, int *error) {
+    for (;;) {
+        double start = STATS_ON ? stats_clock() : 0.0;
+#ifdef SEE_USE_STDIO
+        size_t n = fread(data, 1, len, p->input_stream);
+        if (STATS_ON) {
+            stats_read(&p->stats, start, (long)n, len);
+        }
+        if (n > 0 || feof(p->input_stream) || !ferror(p->input_stream)) {
+            return (long)n;
+        }
+        *error = errno;
+        if (*error == EINTR) {
+            clearerr(p->input_stream);
+            if (STATS_ON) {
+                ++p->stats.retries;
+            }
+            continue;
+        }
+        return -1;
+#else
+        ssize_t n = read(p->input_fd, data, len);
+        if (STATS_ON) {
+            stats_read(&p->stats, start, (long)n, len);
+        }
+        if (n >= 0) {
+            cache_advance(p->input_fd);
+            return (long)n;
+        }
+        *error = errno;
+        if (*error == EINTR || cache_fallback(p->input_fd, *error)) {
+            if (STATS_ON) {
+                ++p->stats.retries;
+            }
+            continue;
+        }
+        return -1;
+#endif
+    }
+}
+
+THREAD_FN(pipeline_reader, arg) {
+    struct pipeline *p = (struct pipeline *)arg;
+    long head = 0;
+
+    for (;;) {
+        struct ring_slot *slot;
+        long n;
+        long epoch = event_epoch(&p->drained);
+
+        if (atomic_load(&p->stop)) {
+            break;
+        }
+        if (head - atomic_load(&p->tail) >= RING_SLOTS) {
+            event_wait(&p->drained, epoch); /* Ring full. */
+            continue;
+        }
+
+        slot = &p->slots[head % RING_SLOTS];
+        slot->error = 0;
+        /* Only this thread touches 'copy_limit' until it is joined. */
+        n = (copy_limit == 0)
+                ? 0
+                : pipeline_read(p, slot->data,
+                                (copy_limit < p->chunk_size)
+                                    ? (size_t)copy_limit
+                                    : p->chunk_size,
+                                &slot->error);
+        slot->len = (n > 0) ? (size_t)n : 0;
+        copy_limit -= slot->len;
+
+        atomic_store(&p->head, ++head);
+        event_notify(&p->filled);
+        if (n <= 0) {
+            break; /* EOF or error, published to the writer. */
+        }
+    }
+    THREAD_RETURN;
+}
+
+/* Copy the input described by 'pipe_state' to stdout while a reader thread
+ * keeps up to RING_SLOTS reads of 'chunk_size' bytes (at most a quarter of
+ * the I/O buffer each) ahead. Data, read
+ * errors and broken pipes surface in the same order and with the same
+ * results as the single-threaded loop. Returns 0 on success, 1 on error,
+ * or -1 if the thread could not be started (nothing has been read). */
+static int threaded_copy(struct pipeline *pipe_state, size_t chunk_size,
+                         const char *input_name) {
+    struct pipeline *p = pipe_state;
+    see_thread reader;
+    long tail = 0;
+    int status = 0;
+    int i;
+
+    if (chunk_size > io_buf_size / RING_SLOTS) {
+        chunk_size = io_buf_size / RING_SLOTS;
+        if (input_cache == CACHE_DIRECT) {
+            chunk_size -= chunk_size % DIRECT_ALIGN; /* Aligned slots */
+        }
+    }
+    if (chunk_size == 0) {
+        return -1;
+    }
+    p->chunk_size = chunk_size;
+    for (i = 0; i < RING_SLOTS; ++i) {
+        p->slots[i].data = io_buf + (size_t)i * chunk_size;
+    }
+    p->head = 0;
+    p->tail = 0;
+    p->stop = 0;
+    memset(&p->stats, 0, sizeof(p->stats));
+    event_init(&p->filled);
+    event_init(&p->drained);
+
+    if (thread_start(&reader, pipeline_reader, p) != 0) {
+        event_destroy(&p->filled);
+        event_destroy(&p->drained);
+        return -1;
+    }
+
+    for (;;) {
+        struct ring_slot *slot;
+        long epoch = event_epoch(&p->filled);
+        int rc;
+
+        if (atomic_load(&p->head) == tail) {
+            event_wait(&p->filled, epoch); /* Ring empty. */
+            continue;
+        }
+
+        slot = &p->slots[tail % RING_SLOTS];
+        if (slot->len == 0) {
+            if (slot->error != 0) {
+                diag("%s: read error on %s: %s\n",
+                     PROG_NAME, input_name, strerror(slot->error));
+                status = 1;
+            }
+            break;
+        }
+
+        rc = write_data(slot->data, slot->len);
+        if (rc != WRITE_OK) {
+            /* A broken pipe is normal termination for utilities. */
+            status = (rc == WRITE_CLOSED) ? 0 : 1;
+            atomic_store(&p->stop, 1);
+            event_notify(&p->drained);
+            break;
+        }
+
+        atomic_store(&p->tail, ++tail);
+        event_notify(&p->drained);
+    }
+
+    thread_join(reader);
+    event_destroy(&p->filled);
+    event_destroy(&p->drained);
+    if (STATS_ON) {
+        p->stats.engines = 1U << ENGINE_THREADED;
+        stats_merge(&file_stats, &p->stats);
+    }
+    return status;
+}
+#endif /* SEE_HAVE_PIPELINE */
+#endif
+
+#ifdef SEE_HAVE_KERNEL_COPY
+/* Zero-copy transfer methods, tried in order until one is supported. */
+enum kcopy_method {
+    KCOPY_NONE,
+    KCOPY_COPY_FILE_RANGE,
+    KCOPY_SENDFILE,
+    KCOPY_SPLICE
+};
+
+/* Returns nonzero if 'err' means the method cannot handle this fd pair. */
+static int kcopy_unsupported(int err) {
+    switch (err) {
+    case EINVAL:
+    case ENOSYS:
+    case EXDEV:
+    case EBADF: /* copy_file_range() rejects O_APPEND outputs */
+#ifdef EOPNOTSUPP
+    case EOPNOTSUPP:
+#endif
+#if defined(ENOTSUP) && (!defined(EOPNOTSUPP) || ENOTSUP != EOPNOTSUPP)
+    case ENOTSUP:
+#endif
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Picks the next method to try for this input/output pair after 'prev'.
+ * Regular file inputs with st_size == 0 (procfs, sysfs) are left to the
+ * read loop, since the kernel may report EOF for them immediately. */
+static enum kcopy_method kcopy_next(enum kcopy_method prev,
+                                    const struct stat *in_st,
+                                    const struct stat *out_st) {
+    int in_reg = S_ISREG(in_st->st_mode) && in_st->st_size > 0;
+    int in_pipe = S_ISFIFO(in_st->st_mode) || S_ISSOCK(in_st->st_mode);
+    int out_pipe = S_ISFIFO(out_st->st_mode);
+
+    switch (prev) {
+    case KCOPY_NONE:
+#ifdef SEE_HAVE_COPY_FILE_RANGE
+        if (in_reg && S_ISREG(out_st->st_mode)) {
+            return KCOPY_COPY_FILE_RANGE;
+        }
+#endif
+        if (out_pipe || (in_pipe && !in_reg)) {
+            return (in_reg || in_pipe) ? KCOPY_SPLICE : KCOPY_NONE;
+        }
+        return in_reg ? KCOPY_SENDFILE : KCOPY_NONE;
+    case KCOPY_COPY_FILE_RANGE:
+        return KCOPY_SENDFILE;
+    case KCOPY_SPLICE:
+        /* splice() into sockets and devices is not universal. */
+        return (in_reg && !out_pipe) ? KCOPY_SENDFILE : KCOPY_NONE;
+    default:
+        return KCOPY_NONE;
+    }
+}
+
+#ifdef SEE_HAVE_THREADS
+/* --checksum beside an in-kernel copy: a thread reads back from the page
+ * cache what the copy has moved and hashes it, at most HASH_LAG bytes
+ * behind, so neither side waits for the other. */
+struct hash_reader {
+    int            fd;
+    see_u64        start;    /* Offset the copy started at */
+    see_u64        copied;   /* Bytes it has moved, under 'lock' */
+    int            finished; /* It moves no more, under 'lock' */
+    int            error;    /* Read error, once the thread is joined */
+    unsigned char *buf;      /* HASH_CHUNK bytes */
+    see_mutex      lock;
+    see_cond       moved;
+    see_thread     thread;
+};
+
+THREAD_FN(hash_reader_run, arg) {
+    struct hash_reader *r = (struct hash_reader *)arg;
+    see_u64 hashed = 0;
+
+    for (;;) {
+        see_u64 copied;
+
+        mutex_lock(&r->lock);
+        while (r->copied == hashed && !r->finished) {
+            cond_wait(&r->moved, &r->lock);
+        }
+        copied = r->copied;
+        mutex_unlock(&r->lock);
+        if (copied == hashed) {
+            break; /* Finished, and all of it hashed. */
+        }
+
+        while (hashed < copied) {
+            size_t want = (copied - hashed < HASH_CHUNK)
+                              ? (size_t)(copied - hashed)
+                              : HASH_CHUNK;
+            ssize_t n = pread(r->fd, r->buf, want,
+                              (off_t)(r->start + hashed));
+
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                /* Truncated since it was copied: -1 marks EOF. */
+                r->error = (n < 0) ? errno : -1;
+                THREAD_RETURN;
+            }
+            checksum_update(&file_checksum, r->buf, (size_t)n);
+            hashed += (see_u64)n;
+        }
+    }
+    THREAD_RETURN;
+}
+
+/* Start hashing what is copied from 'fd' from its current offset on.
+ * Returns 0 on success, 1 if the thread could not be started. */
+static int hash_reader_start(struct hash_reader *r, int fd) {
+    off_t start = lseek(fd, 0, SEEK_CUR);
+
+    if (start == (off_t)-1) {
+        return 1;
+    }
+    r->buf = (unsigned char *)malloc(HASH_CHUNK);
+    if (r->buf == NULL) {
+        return 1;
+    }
+    r->fd = fd;
+    r->start = (see_u64)start;
+    r->copied = 0;
+    r->finished = 0;
+    r->error = 0;
+    mutex_init(&r->lock);
+    cond_init(&r->moved);
+    if (thread_start(&r->thread, hash_reader_run, r) != 0) {
+        cond_destroy(&r->moved);
+        mutex_destroy(&r->lock);
+        free(r->buf);
+        return 1;
+    }
+    return 0;
+}
+
+/* Tell the reader 'len' more bytes have been copied. */
+static void hash_reader_advance(struct hash_reader *r, see_u64 len) {
+    mutex_lock(&r->lock);
+    r->copied += len;
+    cond_broadcast(&r->moved);
+    mutex_unlock(&r->lock);
+}
+
+/* Wait for the reader to hash everything copied. Returns 0 on success, 1
+ * on a read error (reported). */
+static int hash_reader_finish(struct hash_reader *r, const char *input_name) {
+    mutex_lock(&r->lock);
+    r->finished = 1;
+    cond_broadcast(&r->moved);
+    mutex_unlock(&r->lock);
+    thread_join(r->thread);
+    cond_destroy(&r->moved);
+    mutex_destroy(&r->lock);
+    free(r->buf);
+    if (r->error != 0) {
+        diag("%s: read error on %s: %s\n", PROG_NAME, input_name,
+             (r->error > 0) ? strerror(r->error)
+                            : "file truncated while hashing");
+        file_checksum.failed = 1;
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+/* The loop of kernel_copy(), which also keeps 'hasher' (if not NULL) told
+ * of the bytes copied. */
+static int kernel_transfer(int input_fd, const struct stat *input_stat,
+                           const char *input_name,
+                           struct hash_reader *hasher) {
+    enum kcopy_method method;
+    ssize_t n;
+    int err;
+
+    if (!stdout_stat_ok) {
+        return COPY_FALLBACK;
+    }
+    method = kcopy_next(KCOPY_NONE, input_stat, &stdout_stat);
+    if (method == KCOPY_NONE) {
+        return COPY_FALLBACK;
+    }
+
+    /* Earlier stdio output must reach the fd before we write around it. */
+    if (output_is_stdout && flush_stream(stdout, "stdout", 1) != 0) {
+        return COPY_ERROR;
+    }
+
+    for (;;) {
+        double start = STATS_ON ? stats_clock() : 0.0;
+        size_t count = (copy_limit < KCOPY_CHUNK) ? (size_t)copy_limit
+                                                  : KCOPY_CHUNK;
+
+        if (count == 0) {
+            return COPY_DONE; /* End of the range. */
+        }
+        if (hasher != NULL && count > HASH_LAG) {
+            count = HASH_LAG; /* Keep the hash-only reader close behind. */
+        }
+        count = rate_cap(count);
+        switch (method) {
+#ifdef SEE_HAVE_COPY_FILE_RANGE
+        case KCOPY_COPY_FILE_RANGE:
+            n = copy_file_range(input_fd, NULL, output_fd, NULL, count,
+                                0);
+            break;
+#endif
+        case KCOPY_SENDFILE:
+            n = sendfile(output_fd, input_fd, NULL, count);
+            break;
+        case KCOPY_SPLICE:
+            n = splice(input_fd, NULL, output_fd, NULL, count,
+                       SPLICE_F_MOVE | SPLICE_F_MORE);
+            break;
+        default:
+            return COPY_FALLBACK;
+        }
+        if (STATS_ON) {
+            ++file_stats.copies;
+            file_stats.write_time += stats_clock() - start;
+            if (n > 0) {
+                file_stats.bytes += (see_u64)n;
+                file_stats.engines |= 1U << ENGINE_ZEROCOPY;
+            }
+        }
+
+        if (n > 0) {
+            copy_limit -= (see_u64)n;
+            rate_pace((size_t)n);
+#ifdef SEE_HAVE_THREADS
+            if (hasher != NULL) {
+                hash_reader_advance(hasher, (see_u64)n);
+            }
+#endif
+            continue;
+        }
+        if (n == 0) {
+            return COPY_DONE;
+        }
+
+        err = errno;
+        if (err == EINTR) {
+            if (STATS_ON) {
+                ++file_stats.retries;
+            }
+            continue;
+        }
+        if (err == EPIPE) {
+            stdout_closed = 1;
+            return COPY_CLOSED; /* Broken pipe is normal termination. */
+        }
+        if (kcopy_unsupported(err)) {
+            /* Data copied so far advanced the file offsets, so the next
+             * method (or the read loop) resumes exactly where we stopped. */
+            method = kcopy_next(method, input_stat, &stdout_stat);
+            if (method == KCOPY_NONE) {
+                return COPY_FALLBACK;
+            }
+            continue;
+        }
+
+        /* The kernel does not say which side failed; blame the output for
+         * the errors only a write can produce. */
+        if (err == ENOSPC || err == EFBIG || err == EDQUOT) {
+            diag("%s: write error on stdout: %s\n",
+                 PROG_NAME, strerror(err));
+        } else {
+            diag("%s: read error on %s: %s\n",
+                 PROG_NAME, input_name, strerror(err));
+        }
+        return COPY_ERROR;
+    }
+}
+
+/* Copy 'input_fd' to stdout inside the kernel, without passing the data
+ * through userspace: copy_file_range() into regular files, sendfile() into
+ * sockets and devices, splice() into pipes. With --checksum only regular
+ * files qualify, as the hash-only reader has to read the data again.
+ * Returns one of KCOPY_*. 'input_name' is used for diagnostics. */
+static int kernel_copy(int input_fd, const struct stat *input_stat,
+                       const char *input_name) {
+#ifdef SEE_HAVE_THREADS
+    struct hash_reader reader;
+    int rc;
+#endif
+
+    if (opt_checksum == CHECKSUM_NONE) {
+        return kernel_transfer(input_fd, input_stat, input_name, NULL);
+    }
+#ifdef SEE_HAVE_THREADS
+    if (S_ISREG(input_stat->st_mode) &&
+        hash_reader_start(&reader, input_fd) == 0) {
+        rc = kernel_transfer(input_fd, input_stat, input_name, &reader);
+        if (hash_reader_finish(&reader, input_name) != 0) {
+            rc = COPY_ERROR;
+        }
+        return rc;
+    }
+#endif
+    return COPY_FALLBACK;
+}
+#endif
+
+#if defined(SEE_HAVE_MMAP) && defined(_WIN32)
+/* Copy 'file', a regular file of 'length' bytes, to stdout from views of a
+ * file mapping, starting at '*offset' and advancing it past the bytes
+ * written. Windows refuses to truncate a file while a view of it is
+ * mapped, so it cannot shrink under us. Returns one of COPY_*; after
+ * COPY_FALLBACK the caller resumes reading at '*offset', which picks up
+ * any growth. */
+static int mmap_copy_handle(HANDLE file, __int64 *offset, __int64 length) {
+    HANDLE mapping;
+    SYSTEM_INFO info;
+    int rc = COPY_FALLBACK;
+
+    if (*offset < 0 || *offset >= length) {
+        return COPY_FALLBACK;
+    }
+    mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) {
+        return COPY_FALLBACK;
+    }
+    GetSystemInfo(&info);
+
+    while (*offset < length) {
+        /* View offsets must be multiples of the allocation granularity. */
+        __int64 view_offset =
+            *offset - *offset % (__int64)info.dwAllocationGranularity;
+        size_t skip = (size_t)(*offset - view_offset);
+        size_t view_len = MMAP_WINDOW;
+        const unsigned char *view;
+
+        if ((__int64)view_len > length - view_offset) {
+            view_len = (size_t)(length - view_offset);
+        }
+        view = (const unsigned char *)MapViewOfFile(
+            mapping, FILE_MAP_READ, (DWORD)((see_u64)view_offset >> 32),
+            (DWORD)((see_u64)view_offset & 0xffffffffUL), view_len);
+        if (view == NULL) {
+            break; /* Let the read loop continue from '*offset'. */
+        }
+
+        switch (write_raw(view + skip, view_len - skip)) {
+        case WRITE_OK:
+            *offset = view_offset + (__int64)view_len;
+            if (STATS_ON) {
+                file_stats.engines |= 1U << ENGINE_MMAP;
+            }
+            break;
+        case WRITE_CLOSED:
+            rc = COPY_CLOSED;
+            break;
+        default:
+            rc = COPY_ERROR;
+            break;
+        }
+        UnmapViewOfFile(view);
+        if (rc != COPY_FALLBACK) {
+            break;
+        }
+    }
+    CloseHandle(mapping);
+    return rc;
+}
+#endif
+
+#ifdef SEE_HAVE_SPARSE
+/* Returns ZERO_CHUNK bytes of zeros, or NULL. The block is an untouched
+ * read-only anonymous mapping, so every page of it is the kernel's shared
+ * zero page: writing holes out costs neither disk reads nor memory. */
+static const unsigned char *zero_block(void) {
+    static const unsigned char *zeros;
+
+    if (zeros == NULL) {
+#if defined(_WIN32)
+        zeros = (const unsigned char *)VirtualAlloc(
+            NULL, ZERO_CHUNK, MEM_COMMIT | MEM_RESERVE, PAGE_READONLY);
+#elif defined(MAP_ANONYMOUS)
+        void *map = mmap(NULL, ZERO_CHUNK, PROT_READ,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        zeros = (map != MAP_FAILED) ? (const unsigned char *)map : NULL;
+#else
+        zeros = (const unsigned char *)calloc(1, ZERO_CHUNK);
+#endif
+    }
+    return zeros;
+}
+
+/* Add 'len' zero bytes, a hole skipped on stdout, to the --checksum
+ * digest. */
+static void checksum_zeros(see_u64 len) {
+    const unsigned char *zeros = zero_block();
+
+    while (opt_checksum != CHECKSUM_NONE && len > 0) {
+        size_t chunk = (len < ZERO_CHUNK) ? (size_t)len : ZERO_CHUNK;
+
+        checksum_update(&file_checksum, zeros, chunk);
+        len -= chunk;
+    }
+}
+
+/* Write 'len' zero bytes to stdout. Returns one of WRITE_*. */
+static int zero_fill(see_u64 len) {
+    const unsigned char *zeros = zero_block();
+
+    if (STATS_ON) {
+        file_stats.hole_bytes += len;
+    }
+    while (len > 0) {
+        size_t chunk = (len < ZERO_CHUNK) ? (size_t)len : ZERO_CHUNK;
+        int rc = write_raw(zeros, chunk);
+        if (rc != WRITE_OK) {
+            return rc;
+        }
+        len -= chunk;
+    }
+    return WRITE_OK;
+}
+#endif
+
+#ifdef SEE_USE_STDIO
+/* Write 'len' bytes of 'data' to stdout, handling partial writes (critical
+ * for pipes and slow devices) and EINTR. Returns WRITE_OK, WRITE_ERROR
+ * (reported) or WRITE_CLOSED on a broken pipe. */
+static int write_stdout(const unsigned char *data, size_t len) {
+    size_t total_bytes_written = 0;
+    size_t bytes_written;
+
+    while (total_bytes_written < len) {
+        double start = STATS_ON ? stats_clock() : 0.0;
+
+        bytes_written = fwrite(data + total_bytes_written, 1,
+                               rate_cap(len - total_bytes_written), stdout);
+        if (STATS_ON) {
+            stats_write(&file_stats, start, (long)bytes_written,
+                        len - total_bytes_written);
+        }
+        if (bytes_written == 0) {
+            if (ferror(stdout)) {
+                int err = errno;
+#ifdef EPIPE
+                if (err == EPIPE) {
+                    clearerr(stdout);
+                    stdout_closed = 1;
+                    return WRITE_CLOSED;
+                }
+#endif
+                if (err == EINTR) {
+                    clearerr(stdout);
+                    if (STATS_ON) {
+                        ++file_stats.retries;
+                    }
+                    continue;
+                }
+                diag("%s: write error on stdout: %s\n",
+                     PROG_NAME, strerror(err));
+                return WRITE_ERROR;
+            } else {
+                diag("%s: write error on stdout: unexpected zero "
+                     "write\n",
+                     PROG_NAME);
+                return WRITE_ERROR;
+            }
+        } else {
+            total_bytes_written += bytes_written;
+            rate_pace(bytes_written);
+        }
+    }
+    return WRITE_OK;
+}
+
+/* Copy all data from 'input_stream' to stdout.
+ * Returns 0 on success, 1 on error.
+ * 'input_name' is used for diagnostics. */
+static int copy_stream(FILE *input_stream, const char *input_name) {
+    unsigned char *buffer = io_buf;
+    size_t buffer_size;
+    size_t bytes_read;
+#ifdef _WIN32
+    __int64 length = _filelengthi64(_fileno(input_stream));
+    int is_regular = length >= 0 &&
+                     GetFileType((HANDLE)_get_osfhandle(
+                         _fileno(input_stream))) == FILE_TYPE_DISK;
+
+    buffer_size = choose_buffer_size(is_regular,
+                                     (see_u64)(length >= 0 ? length : 0), 0);
+#ifdef SEE_HAVE_MMAP
+    /* A stream may buffer past a range: ranges take the loops below. */
+    if (is_regular && copy_limit == NO_LIMIT &&
+        (opt_engine == ENGINE_MMAP ||
+         (opt_engine == ENGINE_AUTO && (see_u64)length >= MMAP_THRESHOLD))) {
+        HANDLE file = (HANDLE)_get_osfhandle(_fileno(input_stream));
+        __int64 offset = _ftelli64(input_stream);
+
+        switch (mmap_copy_handle(file, &offset, length)) {
+        case COPY_DONE:
+        case COPY_CLOSED:
+            return 0;
+        case COPY_ERROR:
+            return 1;
+        default:
+            break;
+        }
+        if (offset >= 0 && _fseeki64(input_stream, offset, SEEK_SET) != 0) {
+            int err = errno;
+            diag("%s: read error on %s: %s\n",
+                 PROG_NAME, input_name, strerror(err));
+            return 1;
+        }
+    }
+#endif
+#else
+    struct stat input_stat;
+
+    if (fstat(fileno(input_stream), &input_stat) != 0) {
+        memset(&input_stat, 0, sizeof(input_stat));
+    }
+    buffer_size = choose_buffer_size(S_ISREG(input_stat.st_mode),
+                                     (see_u64)input_stat.st_size,
+                                     (size_t)input_stat.st_blksize);
+#ifdef SEE_HAVE_KERNEL_COPY
+    /* Nothing has been read through 'input_stream' yet, so its fd offset
+     * is exactly where the stream would start reading. Not so after a
+     * seek to a range, which the loops below handle. */
+    if (copy_limit == NO_LIMIT &&
+        (opt_engine == ENGINE_AUTO || opt_engine == ENGINE_ZEROCOPY)) {
+        switch (kernel_copy(fileno(input_stream), &input_stat, input_name)) {
+        case COPY_DONE:
+        case COPY_CLOSED:
+            return 0;
+        case COPY_ERROR:
+            return 1;
+        default:
+            break;
+        }
+    }
+#endif
+#endif
+
+#ifdef SEE_HAVE_PIPELINE
+#ifdef _WIN32
+    if (opt_engine == ENGINE_THREADED && is_regular) {
+#else
+    if (opt_engine == ENGINE_THREADED && S_ISREG(input_stat.st_mode)) {
+#endif
+        struct pipeline pipe_state;
+        int rc;
+
+        pipe_state.input_stream = input_stream;
+        rc = threaded_copy(&pipe_state, buffer_size, input_name);
+        if (rc >= 0) {
+            return rc;
+        }
+    }
+#endif
+
+    for (;;) {
+        double start = STATS_ON ? stats_clock() : 0.0;
+
+        if (copy_limit < buffer_size) {
+            buffer_size = (size_t)copy_limit; /* Last part of the range. */
+            if (buffer_size == 0) {
+                break;
+            }
+        }
+        bytes_read = fread(buffer, 1, buffer_size, input_stream);
+        if (STATS_ON) {
+            stats_read(&file_stats, start, (long)bytes_read, buffer_size);
+        }
+        if (bytes_read == 0) {
+            if (feof(input_stream)) {
+                break;
+            }
+            if (ferror(input_stream)) {
+                int err = errno;
+                if (err == EINTR) {
+                    clearerr(input_stream);
+                    if (STATS_ON) {
+                        ++file_stats.retries;
+                    }
+                    continue;
+                }
+                diag("%s: read error on %s: %s\n",
+                     PROG_NAME, input_name, strerror(err));
+                return 1;
+            }
+            /* Zero read without error/EOF treated as EOF. */
+            break;
+        }
+        if (STATS_ON) {
+            file_stats.engines |= 1U << ENGINE_READ;
+        }
+        copy_limit -= (see_u64)bytes_read;
+
+        switch (write_data(buffer, bytes_read)) {
+        case WRITE_OK:
+            break;
+        case WRITE_CLOSED:
+            return 0; /* Broken pipe is normal termination for utilities. */
+        default:
+            return 1;
+        }
+    }
+
+    return 0;
+}
+#elif defined(SEE_WIN32_IO)
+/* Text for the Win32 error 'code'. Common codes read as their strerror()
+ * counterparts, so messages match the other builds. */
+static const char *win_strerror(DWORD code) {
+    static char text[256];
+    DWORD len;
+
+    switch (code) {
+    case ERROR_FILE_NOT_FOUND:
+    case ERROR_PATH_NOT_FOUND:
+    case ERROR_INVALID_NAME:
+        return strerror(ENOENT);
+    case ERROR_ACCESS_DENIED:
+    case ERROR_SHARING_VIOLATION:
+        return strerror(EACCES);
+    case ERROR_NOT_ENOUGH_MEMORY:
+    case ERROR_OUTOFMEMORY:
+        return strerror(ENOMEM);
+    case ERROR_DISK_FULL:
+    case ERROR_HANDLE_DISK_FULL:
+        return strerror(ENOSPC);
+    default:
+        break;
+    }
+    len = FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM |
+                             FORMAT_MESSAGE_IGNORE_INSERTS,
+                         NULL, code, 0, text, (DWORD)sizeof(text), NULL);
+    if (len == 0) {
+        sprintf(text, "error code %lu", (unsigned long)code);
+    }
+    while (len > 0 && (text[len - 1] == '\n' || text[len - 1] == '\r' ||
+                       text[len - 1] == '.')) {
+        text[--len] = '\0';
+    }
+    return text;
+}
+
+/* Convert the UTF-8 string 'text' to a malloc'd UTF-16 string. Returns
+ * NULL with GetLastError() set on failure. */
+static wchar_t *utf8_to_wide(const char *text) {
+    int len = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, text, -1,
+                                  NULL, 0);
+    wchar_t *wide;
+
+    if (len <= 0) {
+        return NULL;
+    }
+    wide = (wchar_t *)malloc((size_t)len * sizeof(*wide));
+    if (wide == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    if (MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, text, -1, wide,
+                            len) <= 0) {
+        free(wide);
+        return NULL;
+    }
+    return wide;
+}
+
+/* Write 'len' bytes of 'data' to the stdout handle, handling partial
+ * writes. Console writes are split into CONSOLE_CHUNK pieces, as large
+ * ones fail on older consoles. Returns WRITE_OK, WRITE_CLOSED if the
+ * reader went away, or WRITE_ERROR (already reported). */
+static int write_stdout(const unsigned char *data, size_t len) {
+    size_t total_bytes_written = 0;
+
+    while (total_bytes_written < len) {
+        size_t chunk = len - total_bytes_written;
+        DWORD bytes_written = 0;
+        double start;
+        BOOL ok;
+
+        if (chunk > KCOPY_CHUNK) {
+            chunk = KCOPY_CHUNK;
+        }
+        if (stdout_type == FILE_TYPE_CHAR && chunk > CONSOLE_CHUNK) {
+            chunk = CONSOLE_CHUNK;
+        }
+        chunk = rate_cap(chunk);
+        start = STATS_ON ? stats_clock() : 0.0;
+        ok = WriteFile(stdout_handle, data + total_bytes_written,
+                       (DWORD)chunk, &bytes_written, NULL);
+        if (STATS_ON) {
+            stats_write(&file_stats, start, ok ? (long)bytes_written : -1,
+                        chunk);
+        }
+        if (!ok) {
+            DWORD werr = GetLastError();
+            if (werr == ERROR_NO_DATA || werr == ERROR_BROKEN_PIPE) {
+                stdout_closed = 1;
+                return WRITE_CLOSED;
+            }
+            diag("%s: write error on stdout: %s\n",
+                 PROG_NAME, win_strerror(werr));
+            return WRITE_ERROR;
+        }
+        if (bytes_written == 0) {
+            diag("%s: write error on stdout: unexpected zero write\n",
+                 PROG_NAME);
+            return WRITE_ERROR;
+        }
+        total_bytes_written += bytes_written;
+        rate_pace(bytes_written);
+    }
+    return WRITE_OK;
+}
+
+/* Send 'file', a regular file of 'length' bytes, to the stdout socket with
+ * TransmitFile() from '*offset' on, advancing it past the bytes sent.
+ * Returns one of COPY_*; COPY_FALLBACK if the pair is refused, so the read
+ * loop carries on from '*offset' and reports any real error itself. */
+static int transmit_copy(HANDLE file, __int64 *offset, __int64 length) {
+    OVERLAPPED request;
+    int rc = COPY_FALLBACK;
+
+    memset(&request, 0, sizeof(request));
+    request.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (request.hEvent == NULL) {
+        return COPY_FALLBACK;
+    }
+
+    while (*offset < length) {
+        size_t left = (length - *offset > (__int64)KCOPY_CHUNK)
+                          ? KCOPY_CHUNK
+                          : (size_t)(length - *offset);
+        DWORD chunk = (DWORD)rate_cap(left);
+        DWORD sent = 0;
+        DWORD flags = 0;
+        int werr = 0;
+
+        double start = STATS_ON ? stats_clock() : 0.0;
+
+        request.Offset = (DWORD)((see_u64)*offset & 0xffffffffUL);
+        request.OffsetHigh = (DWORD)((see_u64)*offset >> 32);
+        if (!TransmitFile(stdout_socket, file, chunk, 0, &request, NULL, 0)) {
+            werr = WSAGetLastError();
+        }
+        if ((werr == 0 || werr == WSA_IO_PENDING) &&
+            !WSAGetOverlappedResult(stdout_socket, &request, &sent, TRUE,
+                                    &flags)) {
+            werr = WSAGetLastError();
+        } else if (werr == WSA_IO_PENDING) {
+            werr = 0;
+        }
+        if (STATS_ON) {
+            ++file_stats.copies;
+            file_stats.write_time += stats_clock() - start;
+            if (werr == 0 && sent > 0) {
+                file_stats.bytes += sent;
+                file_stats.engines |= 1U << ENGINE_ZEROCOPY;
+            }
+        }
+        if (werr == WSAECONNRESET || werr == WSAECONNABORTED ||
+            werr == WSAESHUTDOWN) {
+            stdout_closed = 1;
+            rc = COPY_CLOSED;
+            break;
+        }
+        if (werr != 0 || sent == 0) {
+            break; /* Refused, or the file shrank: read from '*offset'. */
+        }
+        *offset += sent;
+        rate_pace(sent);
+    }
+    CloseHandle(request.hEvent);
+    return rc;
+}
+
+#ifdef SEE_HAVE_SPARSE
+/* Emit a hole of 'len' bytes. While '*skip_holes' is set, stdout (a sparse
+ * file being extended) is simply made longer; SetEndOfFile() keeps that
+ * right for append-only handles too. If it is refused, the hole and all
+ * later ones are written as zeros. Returns one of WRITE_*. */
+static int write_hole(see_u64 len, int *skip_holes) {
+    if (*skip_holes) {
+        LARGE_INTEGER distance;
+
+        distance.QuadPart = (__int64)len;
+        if (SetFilePointerEx(stdout_handle, distance, NULL, FILE_CURRENT)) {
+            if (SetEndOfFile(stdout_handle)) {
+                if (STATS_ON) {
+                    file_stats.hole_bytes += len;
+                }
+                checksum_zeros(len);
+                return WRITE_OK;
+            }
+            distance.QuadPart = -distance.QuadPart;
+            (void)SetFilePointerEx(stdout_handle, distance, NULL,
+                                   FILE_CURRENT);
+        }
+        *skip_holes = 0;
+    }
+    return zero_fill(len);
+}
+
+/* Copy the sparse file 'file' (an overlapped operand handle of 'length'
+ * bytes) from '*offset' on, reading only the ranges the filesystem
+ * reports allocated (FSCTL_QUERY_ALLOCATED_RANGES) and advancing
+ * '*offset'. Holes stay holes when stdout is a file being extended that
+ * accepts FSCTL_SET_SPARSE, and are written as zeros otherwise. Returns
+ * one of COPY_*, like sparse_copy() in the POSIX build. */
+static int sparse_copy_handle(HANDLE file, __int64 *offset, __int64 length,
+                              const char *input_name) {
+    FILE_ALLOCATED_RANGE_BUFFER query;
+    FILE_ALLOCATED_RANGE_BUFFER ranges[64];
+    OVERLAPPED request;
+    __int64 pos = *offset;
+    int skip_holes = 0;
+    int more = 1;
+    int rc = COPY_FALLBACK;
+
+    if (zero_block() == NULL) {
+        return COPY_FALLBACK;
+    }
+    memset(&request, 0, sizeof(request));
+    request.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (request.hEvent == NULL) {
+        return COPY_FALLBACK;
+    }
+    if (stdout_type == FILE_TYPE_DISK) {
+        LARGE_INTEGER zero;
+        LARGE_INTEGER out_pos;
+        LARGE_INTEGER out_size;
+        DWORD ignored;
+
+        zero.QuadPart = 0;
+        skip_holes =
+            SetFilePointerEx(stdout_handle, zero, &out_pos, FILE_CURRENT) &&
+            GetFileSizeEx(stdout_handle, &out_size) &&
+            out_pos.QuadPart >= out_size.QuadPart &&
+            DeviceIoControl(stdout_handle, FSCTL_SET_SPARSE, NULL, 0, NULL,
+                            0, &ignored, NULL);
+    }
+
+    while (rc == COPY_FALLBACK && pos < length) {
+        DWORD got = 0;
+        DWORD werr = 0;
+        DWORD count;
+        DWORD k;
+
+        if (more) {
+            query.FileOffset.QuadPart = pos;
+            query.Length.QuadPart = length - pos;
+            if (!DeviceIoControl(file, FSCTL_QUERY_ALLOCATED_RANGES, &query,
+                                 sizeof(query), ranges, sizeof(ranges), NULL,
+                                 &request)) {
+                werr = GetLastError();
+            }
+            if ((werr == 0 || werr == ERROR_IO_PENDING) &&
+                !GetOverlappedResult(file, &request, &got, TRUE)) {
+                werr = GetLastError();
+            } else if (werr == ERROR_IO_PENDING) {
+                werr = 0;
+            }
+            if (werr != 0 && werr != ERROR_MORE_DATA) {
+                if (pos == *offset) {
+                    break; /* No range support: ordinary reads. */
+                }
+                diag("%s: read error on %s: %s\n",
+                     PROG_NAME, input_name, win_strerror(werr));
+                rc = COPY_ERROR;
+                break;
+            }
+            more = werr == ERROR_MORE_DATA;
+        }
+        count = got / (DWORD)sizeof(ranges[0]);
+        if (count == 0) {
+            more = 0; /* Only a hole remains. */
+        }
+
+        for (k = 0; k <= count && rc == COPY_FALLBACK; ++k) {
+            __int64 start = (k < count) ? ranges[k].FileOffset.QuadPart
+                                        : length;
+            __int64 stop = (k < count) ? start + ranges[k].Length.QuadPart
+                                       : length;
+            int wrc = WRITE_OK;
+
+            if (k == count && more) {
+                break; /* Query again from 'pos'. */
+            }
+            if (start > length) {
+                start = length;
+            }
+            if (stop > length) {
+                stop = length;
+            }
+            if (start > pos) {
+                wrc = write_hole((see_u64)(start - pos), &skip_holes);
+                pos = start;
+            }
+            while (wrc == WRITE_OK && pos < stop) {
+                DWORD want = (stop - pos < (__int64)io_buf_size)
+                                 ? (DWORD)(stop - pos)
+                                 : (DWORD)io_buf_size;
+                DWORD bytes_read = 0;
+                double begin = STATS_ON ? stats_clock() : 0.0;
+                BOOL ok;
+
+                request.Offset = (DWORD)((see_u64)pos & 0xffffffffUL);
+                request.OffsetHigh = (DWORD)((see_u64)pos >> 32);
+                ok = ReadFile(file, io_buf, want, NULL, &request) ||
+                     GetLastError() == ERROR_IO_PENDING;
+                ok = ok && GetOverlappedResult(file, &request, &bytes_read,
+                                               TRUE);
+                werr = ok ? 0 : GetLastError();
+                request.Offset = 0;
+                request.OffsetHigh = 0;
+                if (STATS_ON) {
+                    stats_read(&file_stats, begin,
+                               ok ? (long)bytes_read : -1, want);
+                }
+                if (!ok && werr != ERROR_HANDLE_EOF) {
+                    diag("%s: read error on %s: %s\n",
+                         PROG_NAME, input_name, win_strerror(werr));
+                    rc = COPY_ERROR;
+                    break;
+                }
+                if (bytes_read == 0) {
+                    length = pos; /* Truncated under us: stop here. */
+                    break;
+                }
+                if (STATS_ON) {
+                    file_stats.engines |= 1U << ENGINE_READ;
+                }
+                wrc = write_raw(io_buf, bytes_read);
+                pos += bytes_read;
+            }
+            if (wrc != WRITE_OK) {
+                rc = (wrc == WRITE_CLOSED) ? COPY_CLOSED : COPY_ERROR;
+            }
+        }
+    }
+
+    CloseHandle(request.hEvent);
+    *offset = pos;
+    return rc;
+}
+#endif
+
+/* Wait out the 'count' overlapped reads in 'requests' starting at ring
+ * index 'first', discarding their data. */
+static void drain_reads(HANDLE file, OVERLAPPED *requests, int first,
+                        int count, int depth) {
+    DWORD ignored;
+
+    while (count-- > 0) {
+        (void)GetOverlappedResult(file, &requests[first], &ignored, TRUE);
+        first = (first + 1) % depth;
+    }
+}
+
+/* Copy all data from 'file' to stdout. Operand handles are opened for
+ * overlapped I/O ('overlapped' set): from disk files, up to
+ * OVERLAPPED_READS reads of consecutive chunks stay in flight while the
+ * oldest is written; pipes and devices have no offsets and take one at a
+ * time. stdin is read synchronously from its current position.
+ * Returns 0 on success, 1 on error. 'input_name' is used for
+ * diagnostics. */
+static int copy_handle(HANDLE file, int overlapped, const char *input_name) {
+    OVERLAPPED requests[OVERLAPPED_READS];
+    see_u64 request_offset[OVERLAPPED_READS];
+    LARGE_INTEGER size;
+    LARGE_INTEGER position;
+    __int64 offset = 0;
+    see_u64 budget; /* Bytes of the range not yet requested */
+    int is_regular;
+    size_t chunk;
+    int depth = 1;
+    int head = 0;
+    int queued = 0;
+    int at_eof = 0;
+    int status = 0;
+    int i;
+
+    size.QuadPart = 0;
+    is_regular = GetFileType(file) == FILE_TYPE_DISK &&
+                 GetFileSizeEx(file, &size);
+    chunk = choose_buffer_size(is_regular,
+                               is_regular ? (see_u64)size.QuadPart : 0, 0);
+    offset = slice_offset; /* Past 0 for --tail */
+    if (!overlapped) {
+        position.QuadPart = 0;
+        if (!is_regular ||
+            !SetFilePointerEx(file, position, &position, FILE_CURRENT)) {
+            position.QuadPart = -1; /* No usable offset: plain reads only. */
+        }
+        offset = position.QuadPart;
+    }
+
+    if (is_regular && offset >= 0 && opt_engine != ENGINE_READ) {
+        __int64 first = offset;
+        __int64 end = size.QuadPart;
+        int rc = COPY_FALLBACK;
+#ifdef SEE_HAVE_SPARSE
+        BY_HANDLE_FILE_INFORMATION info;
+#endif
+
+        if (offset < end && copy_limit < (see_u64)(end - offset)) {
+            end = offset + (__int64)copy_limit; /* End of the range. */
+        }
+#ifdef SEE_HAVE_SPARSE
+        if (overlapped && opt_engine == ENGINE_AUTO &&
+            GetFileInformationByHandle(file, &info) &&
+            (info.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE)) {
+            rc = sparse_copy_handle(file, &offset, end, input_name);
+        }
+#endif
+
+        if (rc == COPY_FALLBACK && stdout_socket != INVALID_SOCKET &&
+            (opt_engine == ENGINE_AUTO || opt_engine == ENGINE_ZEROCOPY)) {
+            rc = transmit_copy(file, &offset, end);
+        }
+#ifdef SEE_HAVE_MMAP
+        if (rc == COPY_FALLBACK &&
+            (opt_engine == ENGINE_MMAP ||
+             (opt_engine == ENGINE_AUTO &&
+              (see_u64)size.QuadPart >= MMAP_THRESHOLD))) {
+            rc = mmap_copy_handle(file, &offset, end);
+        }
+#endif
+        copy_limit -= (see_u64)(offset - first);
+        if (rc == COPY_DONE || rc == COPY_CLOSED) {
+            return 0;
+        } else if (rc == COPY_ERROR) {
+            return 1;
+        }
+        position.QuadPart = offset;
+        if (!overlapped && !SetFilePointerEx(file, position, NULL,
+                                             FILE_BEGIN)) {
+            diag("%s: read error on %s: %s\n",
+                 PROG_NAME, input_name, win_strerror(GetLastError()));
+            return 1;
+        }
+    }
+
+    if (!overlapped) {
+        for (;;) {
+            DWORD bytes_read = 0;
+            double start = STATS_ON ? stats_clock() : 0.0;
+            DWORD want = (copy_limit < chunk) ? (DWORD)copy_limit
+                                              : (DWORD)chunk;
+            BOOL ok = want > 0 && ReadFile(file, io_buf, want, &bytes_read,
+                                           NULL);
+
+            if (want == 0) {
+                break; /* End of the range. */
+            }
+            if (STATS_ON) {
+                stats_read(&file_stats, start, ok ? (long)bytes_read : -1,
+                           want);
+            }
+            if (!ok) {
+                DWORD werr = GetLastError();
+                if (werr == ERROR_HANDLE_EOF || werr == ERROR_BROKEN_PIPE) {
+                    break;
+                }
+                diag("%s: read error on %s: %s\n",
+                     PROG_NAME, input_name, win_strerror(werr));
+                return 1;
+            }
+            if (bytes_read == 0) {
+                break;
+            }
+            if (STATS_ON) {
+                file_stats.engines |= 1U << ENGINE_READ;
+            }
+            copy_limit -= bytes_read;
+            switch (write_data(io_buf, bytes_read)) {
+            case WRITE_OK:
+                break;
+            case WRITE_CLOSED:
+                return 0;
+            default:
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    if (is_regular && io_buf_size / OVERLAPPED_READS > 0) {
+        depth = OVERLAPPED_READS;
+        if (chunk > io_buf_size / OVERLAPPED_READS) {
+            chunk = io_buf_size / OVERLAPPED_READS;
+        }
+    }
+    if (input_cache == CACHE_DIRECT) {
+        /* FILE_FLAG_NO_BUFFERING: sector-aligned offsets and lengths. */
+        chunk = (chunk / DIRECT_ALIGN > 0) ? chunk - chunk % DIRECT_ALIGN
+                                           : DIRECT_ALIGN;
+        while (depth > 1 && chunk * (size_t)depth > io_buf_size) {
+            --depth;
+        }
+    }
+    for (i = 0; i < depth; ++i) {
+        memset(&requests[i], 0, sizeof(requests[i]));
+        requests[i].hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+        if (requests[i].hEvent == NULL) {
+            DWORD werr = GetLastError();
+            diag("%s: read error on %s: %s\n",
+                 PROG_NAME, input_name, win_strerror(werr));
+            while (i > 0) {
+                CloseHandle(requests[--i].hEvent);
+            }
+            return 1;
+        }
+    }
+
+    budget = copy_limit;
+    for (;;) {
+        DWORD bytes_read = 0;
+        DWORD werr = 0;
+        int rc;
+
+        /* Keep the ring full: slot (head + queued) reads the next chunk. */
+        while (queued < depth && !at_eof) {
+            int slot = (head + queued) % depth;
+            DWORD want = (budget < chunk) ? (DWORD)budget : (DWORD)chunk;
+
+            if (want == 0) {
+                at_eof = 1; /* End of the range. */
+                break;
+            }
+            request_offset[slot] = (see_u64)offset;
+            requests[slot].Offset = (DWORD)((see_u64)offset & 0xffffffffUL);
+            requests[slot].OffsetHigh = (DWORD)((see_u64)offset >> 32);
+            if (!ReadFile(file, io_buf + (size_t)slot * chunk, want,
+                          NULL, &requests[slot]) &&
+                (werr = GetLastError()) != ERROR_IO_PENDING) {
+                if (werr == ERROR_HANDLE_EOF || werr == ERROR_BROKEN_PIPE) {
+                    werr = 0;
+                    at_eof = 1;
+                }
+                break;
+            }
+            werr = 0;
+            offset += (__int64)want;
+            budget -= want;
+            ++queued;
+        }
+        if (werr == 0 && queued > 0) {
+            /* Only the wait counts: the reads overlap everything else. */
+            double start = STATS_ON ? stats_clock() : 0.0;
+            BOOL ok = GetOverlappedResult(file, &requests[head], &bytes_read,
+                                          TRUE);
+
+            if (STATS_ON) {
+                stats_read(&file_stats, start, ok ? (long)bytes_read : -1,
+                           chunk);
+            }
+            if (!ok) {
+                werr = GetLastError();
+                if (werr == ERROR_HANDLE_EOF || werr == ERROR_BROKEN_PIPE) {
+                    werr = 0;
+                    bytes_read = 0;
+                }
+            }
+        }
+        if (werr != 0) {
+            diag("%s: read error on %s: %s\n",
+                 PROG_NAME, input_name, win_strerror(werr));
+            status = 1;
+            break;
+        }
+        if (queued == 0 || bytes_read == 0) {
+            break; /* Reads still queued are drained below. */
+        }
+        if (bytes_read < chunk) {
+            /* Short read: later chunks were read past what was EOF then.
+             * Discard them and resume right after this one, which also
+             * picks up a file that is growing. */
+            drain_reads(file, requests, (head + 1) % depth, queued - 1,
+                        depth);
+            queued = 1;
+            offset = (__int64)(request_offset[head] + bytes_read);
+            budget = copy_limit - bytes_read;
+        }
+
+        if (STATS_ON) {
+            file_stats.engines |= 1U << ENGINE_READ;
+        }
+        copy_limit -= bytes_read;
+        rc = write_data(io_buf + (size_t)head * chunk, bytes_read);
+        --queued;
+        head = (head + 1) % depth;
+        if (rc != WRITE_OK) {
+            status = (rc == WRITE_CLOSED) ? 0 : 1;
+            break;
+        }
+    }
+
+    if (queued > 0) {
+        (void)CancelIo(file);
+        drain_reads(file, requests, head, queued, depth);
+    }
+    for (i = 0; i < depth; ++i) {
+        CloseHandle(requests[i].hEvent);
+    }
+    return status;
+}
+#else
+/* Write 'len' bytes of 'data' to 'fd', resuming partial writes and
+ * retrying on EINTR. Returns WRITE_OK, WRITE_CLOSED on a broken pipe, or
+ * WRITE_ERROR with the errno value in 'error' (not reported). 'written'
+ * receives the number of bytes written either way. */
+static int write_fd(int fd, const unsigned char *data, size_t len,
+                    size_t *written, int *error) {
+    ssize_t bytes_written;
+
+    *written = 0;
+    while (*written < len) {
+        double start = STATS_ON ? stats_clock() : 0.0;
+
+        bytes_written = write(fd, data + *written,
+                              rate_cap(len - *written));
+        if (STATS_ON) {
+            stats_write(&file_stats, start, (long)bytes_written,
+                        len - *written);
+        }
+        if (bytes_written > 0) {
+            *written += (size_t)bytes_written;
+            rate_pace((size_t)bytes_written);
+        } else if (bytes_written == 0) {
+            *error = 0;
+            return WRITE_ERROR;
+        } else {
+            int err = errno;
+            if (err == EINTR) {
+                if (STATS_ON) {
+                    ++file_stats.retries;
+                }
+                continue;
+            }
+            if (err == EPIPE) {
+                stdout_closed = 1;
+                return WRITE_CLOSED;
+            }
+            *error = err;
+            return WRITE_ERROR;
+        }
+    }
+    return WRITE_OK;
+}
+
+/* Write 'len' bytes of 'data' to the stdout fd. Returns WRITE_OK,
+ * WRITE_ERROR (reported) or WRITE_CLOSED on a broken pipe. */
+static int write_stdout(const unsigned char *data, size_t len) {
+    size_t written;
+    int err;
+    int rc = write_fd(output_fd, data, len, &written, &err);
+
+    if (rc == WRITE_ERROR) {
+        if (err == 0) {
+            diag("%s: write error on stdout: unexpected zero write\n",
+                 PROG_NAME);
+        } else {
+            diag("%s: write error on stdout: %s\n",
+                 PROG_NAME, strerror(err));
+        }
+    }
+    return rc;
+}
+
+#ifdef SEE_HAVE_MMAP
+/* Jump target for SIGBUS raised by touching pages past a file's end. */
+static sigjmp_buf mmap_fault_jmp;
+static volatile sig_atomic_t mmap_fault_armed;
+
+static void mmap_fault_handler(int signo) {
+    if (mmap_fault_armed) {
+        mmap_fault_armed = 0;
+        siglongjmp(mmap_fault_jmp, 1);
+    }
+    /* Not ours: restore the default action and let it fire. */
+    signal(signo, SIG_DFL);
+    raise(signo);
+}
+
+/* Copy a regular file to stdout straight from its mapping, a window of
+ * MMAP_WINDOW bytes at a time, starting at the fd's current offset. If the
+ * file shrinks under us, the kernel fails the write with EFAULT (or
+ * raises SIGBUS when the mapping is touched from userspace); either way
+ * we stop at the bytes actually written, as read(2) would have. Returns
+ * one of COPY_*; on COPY_FALLBACK the fd offset is where mapping stopped,
+ * so the read loop copies anything appended meanwhile and sees EOF. */
+static int mmap_copy(int input_fd, const struct stat *input_stat,
+                     const char *input_name) {
+    static long page_size;
+    struct sigaction sa;
+    struct sigaction old_sa;
+    volatile off_t offset;
+    volatile off_t length = input_stat->st_size;
+    volatile int rc = COPY_FALLBACK;
+    volatile int hashing = 0;
+
+    offset = lseek(input_fd, 0, SEEK_CUR);
+    if (offset < 0 || offset >= length) {
+        return COPY_FALLBACK;
+    }
+    if (copy_limit < (see_u64)(length - offset)) {
+        length = offset + (off_t)copy_limit; /* End of the range. */
+    }
+    if (page_size == 0) {
+        page_size = sysconf(_SC_PAGESIZE);
+        if (page_size <= 0) {
+            page_size = 4096;
+        }
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = mmap_fault_handler;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGBUS, &sa, &old_sa) != 0) {
+        return COPY_FALLBACK;
+    }
+
+    while (offset < length) {
+        off_t map_offset = offset - offset % page_size;
+        size_t skip = (size_t)(offset - map_offset);
+        /* Live across sigsetjmp(); 'written' is updated through memory. */
+        volatile size_t map_len = MMAP_WINDOW;
+        unsigned char *volatile map;
+        size_t written = 0;
+        int err = 0;
+        int wrc;
+
+        if ((off_t)map_len > length - map_offset) {
+            map_len = (size_t)(length - map_offset);
+        }
+        map = (unsigned char *)mmap(NULL, map_len, PROT_READ, MAP_SHARED,
+                                    input_fd, map_offset);
+        if (map == (unsigned char *)MAP_FAILED) {
+            break; /* Let the read loop continue from 'offset'. */
+        }
+        /* Advice values are not flags: issue them one at a time. */
+        (void)posix_madvise(map, map_len, POSIX_MADV_SEQUENTIAL);
+        (void)posix_madvise(map, map_len, POSIX_MADV_WILLNEED);
+
+        if (sigsetjmp(mmap_fault_jmp, 1) == 0) {
+            mmap_fault_armed = 1;
+            wrc = write_fd(output_fd, map + skip, map_len - skip,
+                           &written, &err);
+            if (opt_checksum != CHECKSUM_NONE) {
+                hashing = 1;
+                checksum_update(&file_checksum, map + skip, written);
+                hashing = 0;
+            }
+            mmap_fault_armed = 0;
+        } else {
+            wrc = WRITE_ERROR; /* SIGBUS: 'written' is still accurate. */
+            err = EFAULT;
+        }
+        (void)munmap(map, map_len);
+        offset += (off_t)written;
+        copy_limit -= written;
+        if (STATS_ON && written > 0) {
+            file_stats.engines |= 1U << ENGINE_MMAP;
+        }
+        if (hashing) {
+            /* Shrank after the write, leaving part of it unhashed. */
+            diag("%s: read error on %s: file truncated while hashing\n",
+                 PROG_NAME, input_name);
+            file_checksum.failed = 1;
+            rc = COPY_ERROR;
+            break;
+        }
+
+        if (wrc == WRITE_CLOSED) {
+            rc = COPY_CLOSED;
+            break;
+        }
+        if (wrc == WRITE_ERROR) {
+            if (err == EFAULT) {
+                break; /* Truncated under us; the read loop sees EOF. */
+            }
+            if (err == 0) {
+                diag("%s: write error on stdout: unexpected zero write\n",
+                     PROG_NAME);
+            } else {
+                diag("%s: write error on stdout: %s\n",
+                     PROG_NAME, strerror(err));
+            }
+            rc = COPY_ERROR;
+            break;
+        }
+    }
+
+    (void)sigaction(SIGBUS, &old_sa, NULL);
+
+    if (rc == COPY_FALLBACK && lseek(input_fd, offset, SEEK_SET) < 0) {
+        int err = errno;
+        diag("%s: read error on %s: %s\n",
+             PROG_NAME, input_name, strerror(err));
+        rc = COPY_ERROR;
+    }
+    return rc;
+}
+#endif
+
+#ifdef SEE_HAVE_SPARSE
+/* Copy a sparse regular file from the fd's current offset, reading only
+ * its data extents (SEEK_DATA/SEEK_HOLE). Holes become holes again when
+ * stdout is a regular file being extended (not O_APPEND, nothing past
+ * its offset to overwrite): we seek over them and ftruncate() to the
+ * final size. Anywhere else they are written as zeros from zero_block().
+ * Returns one of COPY_*; COPY_FALLBACK before any output if the
+ * filesystem cannot report holes, and after the copy with the fd offset
+ * at the old end, so the read loop picks up anything appended. */
+static int sparse_copy(int input_fd, const struct stat *input_stat,
+                       const char *input_name) {
+    off_t end = input_stat->st_size;
+    off_t pos = lseek(input_fd, 0, SEEK_CUR);
+    off_t first = pos;
+    off_t data;
+    int skip_holes = 0;
+    int trailing_hole = 0;
+
+    if (pos == (off_t)-1 || zero_block() == NULL) {
+        return COPY_FALLBACK;
+    }
+    if (pos < end && copy_limit < (see_u64)(end - pos)) {
+        end = pos + (off_t)copy_limit; /* End of the range. */
+    }
+    /* Probe first: EINVAL here means no hole support, nothing is lost. */
+    data = lseek(input_fd, pos, SEEK_DATA);
+    if (data == (off_t)-1 && errno != ENXIO) {
+        return COPY_FALLBACK;
+    }
+    if (stdout_stat_ok && S_ISREG(stdout_stat.st_mode)) {
+        int flags = fcntl(output_fd, F_GETFL);
+        off_t out_pos = lseek(output_fd, 0, SEEK_CUR);
+        struct stat out_stat;
+
+        skip_holes = flags != -1 && !(flags & O_APPEND) &&
+                     out_pos != (off_t)-1 &&
+                     fstat(output_fd, &out_stat) == 0 &&
+                     out_pos >= out_stat.st_size;
+    }
+    if (output_is_stdout && flush_stream(stdout, "stdout", 1) != 0) {
+        return COPY_ERROR;
+    }
+
+    while (pos < end) {
+        off_t hole;
+
+        if (data == (off_t)-1 || data > end) {
+            data = end; /* ENXIO: only a hole remains. */
+        }
+        if (data > pos) {
+            if (skip_holes) {
+                if (lseek(output_fd, data - pos, SEEK_CUR) ==
+                    (off_t)-1) {
+                    int err = errno;
+                    diag("%s: write error on stdout: %s\n",
+                         PROG_NAME, strerror(err));
+                    return COPY_ERROR;
+                }
+                if (STATS_ON) {
+                    file_stats.hole_bytes += (see_u64)(data - pos);
+                }
+                checksum_zeros((see_u64)(data - pos));
+                trailing_hole = 1;
+            } else {
+                int rc = zero_fill((see_u64)(data - pos));
+                if (rc != WRITE_OK) {
+                    return (rc == WRITE_CLOSED) ? COPY_CLOSED : COPY_ERROR;
+                }
+            }
+            pos = data;
+        }
+        if (pos >= end) {
+            break;
+        }
+
+        hole = lseek(input_fd, data, SEEK_HOLE);
+        if (hole == (off_t)-1 || hole > end) {
+            hole = end;
+        }
+        if (lseek(input_fd, data, SEEK_SET) == (off_t)-1) {
+            int err = errno;
+            diag("%s: read error on %s: %s\n",
+                 PROG_NAME, input_name, strerror(err));
+            return COPY_ERROR;
+        }
+        while (pos < hole) {
+            size_t want = (hole - pos < (off_t)io_buf_size)
+                              ? (size_t)(hole - pos)
+                              : io_buf_size;
+            double start = STATS_ON ? stats_clock() : 0.0;
+            ssize_t n = read(input_fd, io_buf, want);
+            int rc;
+
+            if (STATS_ON) {
+                stats_read(&file_stats, start, (long)n, want);
+            }
+            if (n < 0) {
+                int err = errno;
+                if (err == EINTR) {
+                    continue;
+                }
+                diag("%s: read error on %s: %s\n",
+                     PROG_NAME, input_name, strerror(err));
+                return COPY_ERROR;
+            }
+            if (n == 0) {
+                end = pos; /* Truncated under us: stop here. */
+                break;
+            }
+            if (STATS_ON) {
+                file_stats.engines |= 1U << ENGINE_READ;
+            }
+            rc = write_raw(io_buf, (size_t)n);
+            if (rc != WRITE_OK) {
+                return (rc == WRITE_CLOSED) ? COPY_CLOSED : COPY_ERROR;
+            }
+            pos += (off_t)n;
+            trailing_hole = 0;
+        }
+        data = (pos < end) ? lseek(input_fd, pos, SEEK_DATA) : end;
+    }
+
+    if (trailing_hole) {
+        off_t size = lseek(output_fd, 0, SEEK_CUR);
+        if (size == (off_t)-1 || ftruncate(output_fd, size) != 0) {
+            int err = errno;
+            diag("%s: write error on stdout: %s\n",
+                 PROG_NAME, strerror(err));
+            return COPY_ERROR;
+        }
+    }
+    (void)lseek(input_fd, pos, SEEK_SET);
+    copy_limit -= (see_u64)(pos - first);
+    return COPY_FALLBACK;
+}
+#endif
+
+/* The engines copy_fd() tries in turn before its read loop. 'applies'
+ * is the runtime selection for one input; 'copy' returns a COPY_* code,
+ * and after COPY_FALLBACK the next engine carries on from the current
+ * offset. 'chunk_size' is the read loop's buffer size for this input. */
+struct fd_engine {
+    int (*applies)(const struct stat *input_stat);
+    int (*copy)(int input_fd, const struct stat *input_stat,
+                size_t chunk_size, const char *input_name);
+};
+
+#ifdef SEE_HAVE_SPARSE
+/* Fewer blocks than the size implies: holes (or compression). */
+static int sparse_applies(const struct stat *input_stat) {
+    return opt_engine == ENGINE_AUTO && S_ISREG(input_stat->st_mode) &&
+           (see_u64)input_stat->st_blocks * 512 <
+               (see_u64)input_stat->st_size;
+}
+
+static int sparse_engine(int input_fd, const struct stat *input_stat,
+                         size_t chunk_size, const char *input_name) {
+    (void)chunk_size;
+    return sparse_copy(input_fd, input_stat, input_name);
+}
+#endif
+
+#ifdef SEE_HAVE_PIPELINE
+/* Only regular files and block devices: their reads always complete,
+ * so the reader can be joined promptly once the writer stops. */
+static int threaded_applies(const struct stat *input_stat) {
+    return opt_engine == ENGINE_THREADED &&
+           (S_ISREG(input_stat->st_mode) || S_ISBLK(input_stat->st_mode));
+}
+
+static int threaded_engine(int input_fd, const struct stat *input_stat,
+                           size_t chunk_size, const char *input_name) {
+    struct pipeline pipe_state;
+    int rc;
+
+    (void)input_stat;
+    pipe_state.input_fd = input_fd;
+    rc = threaded_copy(&pipe_state, chunk_size, input_name);
+    if (rc < 0) {
+        return COPY_FALLBACK;
+    }
+    return rc == 0 ? COPY_DONE : COPY_ERROR;
+}
+#endif
+
+#ifdef SEE_HAVE_KERNEL_COPY
+static int kernel_applies(const struct stat *input_stat) {
+    (void)input_stat;
+    return opt_engine == ENGINE_AUTO || opt_engine == ENGINE_ZEROCOPY;
+}
+
+static int kernel_engine(int input_fd, const struct stat *input_stat,
+                         size_t chunk_size, const char *input_name) {
+    (void)chunk_size;
+    return kernel_copy(input_fd, input_stat, input_name);
+}
+#endif
+
+#ifdef SEE_HAVE_MMAP
+/* Pipes and special files always take the read loop. */
+static int mmap_applies(const struct stat *input_stat) {
+    return S_ISREG(input_stat->st_mode) &&
+           (opt_engine == ENGINE_MMAP ||
+            (opt_engine == ENGINE_AUTO &&
+             (see_u64)input_stat->st_size >= MMAP_THRESHOLD));
+}
+
+static int mmap_engine(int input_fd, const struct stat *input_stat,
+                       size_t chunk_size, const char *input_name) {
+    (void)chunk_size;
+    return mmap_copy(input_fd, input_stat, input_name);
+}
+#endif
+
+static const struct fd_engine fd_engines[] = {
+#ifdef SEE_HAVE_SPARSE
+    {sparse_applies, sparse_engine},
+#endif
+#ifdef SEE_HAVE_PIPELINE
+    {threaded_applies, threaded_engine},
+#endif
+#ifdef SEE_HAVE_KERNEL_COPY
+    {kernel_applies, kernel_engine},
+#endif
+#ifdef SEE_HAVE_MMAP
+    {mmap_applies, mmap_engine},
+#endif
+    {NULL, NULL}
+};
+
+/* Copy all data from 'input_fd' to the output fd with the first of
+ * fd_engines[] that applies, then read(2)/write(2) straight through one
+ * aligned buffer for whatever is left. Returns 0 on success (including a
+ * broken pipe on stdout), 1 on error. 'input_name' is used for
+ * diagnostics. */
+static int copy_fd(int input_fd, const char *input_name) {
+    const struct fd_engine *engine;
+    unsigned char *buffer = io_buf;
+    size_t buffer_size;
+    size_t preferred;
+    struct stat input_stat;
+    ssize_t bytes_read;
+
+    if (fstat(input_fd, &input_stat) != 0) {
+        memset(&input_stat, 0, sizeof(input_stat));
+    }
+    preferred = (size_t)input_stat.st_blksize;
+#if defined(F_GETPIPE_SZ)
+    if (S_ISFIFO(input_stat.st_mode)) {
+        int pipe_size = fcntl(input_fd, F_GETPIPE_SZ);
+        if (pipe_size > 0) {
+            preferred = (size_t)pipe_size;
+        }
+    }
+#endif
+    buffer_size = choose_buffer_size(S_ISREG(input_stat.st_mode),
+                                     (see_u64)input_stat.st_size, preferred);
+    if (input_cache == CACHE_DIRECT) {
+        /* Whole units: the read that reaches EOF just comes back short. */
+        buffer_size = (buffer_size + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1);
+        if (buffer_size > io_buf_size) {
+            buffer_size = io_buf_size;
+        }
+    }
+
+    for (engine = fd_engines; engine->copy != NULL; ++engine) {
+        if (!engine->applies(&input_stat)) {
+            continue;
+        }
+        switch (engine->copy(input_fd, &input_stat, buffer_size,
+                             input_name)) {
+        case COPY_DONE:
+        case COPY_CLOSED:
+            return 0;
+        case COPY_ERROR:
+            return 1;
+        default:
+            break; /* The engines below copy whatever follows. */
+        }
+    }
+
+    for (;;) {
+        double start = STATS_ON ? stats_clock() : 0.0;
+
+        if (copy_limit < buffer_size) {
+            buffer_size = (size_t)copy_limit; /* Last part of the range. */
+            if (buffer_size == 0) {
+                break;
+            }
+        }
+        bytes_read = read(input_fd, buffer, buffer_size);
+        if (STATS_ON) {
+            stats_read(&file_stats, start, (long)bytes_read, buffer_size);
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        if (bytes_read < 0) {
+            int err = errno;
+            if (err == EINTR || cache_fallback(input_fd, err)) {
+                if (STATS_ON) {
+                    ++file_stats.retries;
+                }
+                continue;
+            }
+            diag("%s: read error on %s: %s\n",
+                 PROG_NAME, input_name, strerror(err));
+            return 1;
+        }
+        if (STATS_ON) {
+            file_stats.engines |= 1U << ENGINE_READ;
+        }
+        cache_advance(input_fd);
+        copy_limit -= (see_u64)bytes_read;
+
+        switch (write_data(buffer, (size_t)bytes_read)) {
+        case WRITE_OK:
+            break;
+        case WRITE_CLOSED:
+            return 0; /* Broken pipe is normal termination for utilities. */
+        default:
+            return 1;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+/* Find out whether 'input' is a regular file that can seek, and where it
+ * stands: 'position' gets the current offset and 'size' its length.
+ * Returns 1 if so, 0 if it has to be read sequentially. */
+static int input_extent(see_input input, see_u64 *position, see_u64 *size) {
+#if defined(SEE_USE_STDIO)
+    long pos = ftell(input);
+    long end;
+
+    if (pos < 0 || fseek(input, 0L, SEEK_END) != 0) {
+        return 0;
+    }
+    end = ftell(input);
+    if (end < pos || fseek(input, pos, SEEK_SET) != 0) {
+        return 0;
+    }
+    *position = (see_u64)pos;
+    *size = (see_u64)end;
+    return 1;
+#elif defined(SEE_WIN32_IO)
+    LARGE_INTEGER length;
+    LARGE_INTEGER pos;
+
+    pos.QuadPart = 0;
+    if (GetFileType(input) != FILE_TYPE_DISK ||
+        !GetFileSizeEx(input, &length)) {
+        return 0;
+    }
+    /* Operands are overlapped and read from offset 0; stdin is not. */
+    if (input == GetStdHandle(STD_INPUT_HANDLE) &&
+        !SetFilePointerEx(input, pos, &pos, FILE_CURRENT)) {
+        return 0;
+    }
+    *position = (see_u64)pos.QuadPart;
+    *size = (see_u64)length.QuadPart;
+    return *position <= *size;
+#else
+    struct stat input_stat;
+    off_t pos;
+
+    if (fstat(input, &input_stat) != 0 || !S_ISREG(input_stat.st_mode)) {
+        return 0;
+    }
+    pos = lseek(input, 0, SEEK_CUR);
+    if (pos == (off_t)-1 || pos > input_stat.st_size) {
+        return 0;
+    }
+    *position = (see_u64)pos;
+    *size = (see_u64)input_stat.st_size;
+    return 1;
+#endif
+}
+
+/* Read up to 'len' bytes at 'offset' of the seekable 'input', leaving its
+ * position undefined. Returns the byte count, or -1 with the error code in
+ * 'error'. */
+static long input_read_at(see_input input, see_u64 offset,
+                          unsigned char *buffer, size_t len, int *error) {
+#if defined(SEE_USE_STDIO)
+    size_t got;
+
+    if (fseek(input, (long)offset, SEEK_SET) != 0) {
+        *error = errno;
+        return -1;
+    }
+    got = fread(buffer, 1, len, input);
+    if (got < len && ferror(input)) {
+        *error = errno;
+        return -1;
+    }
+    return (long)got;
+#elif defined(SEE_WIN32_IO)
+    OVERLAPPED request;
+    DWORD got = 0;
+
+    memset(&request, 0, sizeof(request));
+    request.Offset = (DWORD)(offset & 0xffffffffUL);
+    request.OffsetHigh = (DWORD)(offset >> 32);
+    if ((!ReadFile(input, buffer, (DWORD)len, NULL, &request) &&
+         GetLastError() != ERROR_IO_PENDING) ||
+        !GetOverlappedResult(input, &request, &got, TRUE)) {
+        DWORD werr = GetLastError();
+        if (werr == ERROR_HANDLE_EOF) {
+            return 0;
+        }
+        *error = (int)werr;
+        return -1;
+    }
+    return (long)got;
+#else
+    for (;;) {
+        ssize_t n = pread(input, buffer, len, (off_t)offset);
+        if (n >= 0) {
+            return (long)n;
+        }
+        if (errno != EINTR) {
+            *error = errno;
+            return -1;
+        }
+    }
+#endif
+}
+
+/* Make the copy of the seekable 'input' start at 'offset'. Returns 0, or
+ * 1 with the error code in 'error'. */
+static int input_seek(see_input input, see_u64 offset, int *error) {
+#if defined(SEE_USE_STDIO)
+    if (fseek(input, (long)offset, SEEK_SET) != 0) {
+        *error = errno;
+        return 1;
+    }
+#elif defined(SEE_WIN32_IO)
+    LARGE_INTEGER pos;
+
+    pos.QuadPart = (__int64)offset;
+    if (input != GetStdHandle(STD_INPUT_HANDLE)) {
+        slice_offset = pos.QuadPart;
+    } else if (!SetFilePointerEx(input, pos, NULL, FILE_BEGIN)) {
+        *error = (int)GetLastError();
+        return 1;
+    }
+#else
+    if (lseek(input, (off_t)offset, SEEK_SET) == (off_t)-1) {
+        *error = errno;
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+/* Read up to 'len' bytes from where 'input' stands, moving it on. Returns
+ * the byte count, 0 at EOF, or -1 with the error code in 'error'. */
+static long input_read(see_input input, unsigned char *buffer, size_t len,
+                       int *error) {
+#if defined(SEE_USE_STDIO)
+    size_t got = fread(buffer, 1, len, input);
+
+    if (got == 0 && ferror(input)) {
+        *error = errno;
+        return -1;
+    }
+    return (long)got;
+#elif defined(SEE_WIN32_IO)
+    DWORD got = 0;
+    long n;
+
+    if (input != GetStdHandle(STD_INPUT_HANDLE)) {
+        /* Overlapped operands keep their position in 'slice_offset'. */
+        n = input_read_at(input, (see_u64)slice_offset, buffer, len, error);
+        if (n > 0) {
+            slice_offset += n;
+        }
+        return n;
+    }
+    if (!ReadFile(input, buffer, (DWORD)len, &got, NULL)) {
+        DWORD werr = GetLastError();
+        if (werr != ERROR_HANDLE_EOF && werr != ERROR_BROKEN_PIPE) {
+            *error = (int)werr;
+            return -1;
+        }
+    }
+    return (long)got;
+#else
+    for (;;) {
+        ssize_t n = read(input, buffer, len);
+
+        if (n >= 0) {
+            cache_advance(input);
+            return (long)n;
+        }
+        if (errno != EINTR && !cache_fallback(input, errno)) {
+            *error = errno;
+            return -1;
+        }
+    }
+#endif
+}
+
+/* Read and drop up to 'count' bytes of the sequential 'input'; 'skipped'
+ * gets how many went by before EOF. Returns 0, or 1 with the error code
+ * in 'error'. */
+static int input_skip(see_input input, see_u64 count, see_u64 *skipped,
+                      int *error) {
+    *skipped = 0;
+    while (*skipped < count) {
+        size_t want = (count - *skipped < io_buf_size)
+                          ? (size_t)(count - *skipped)
+                          : io_buf_size;
+        long n = input_read(input, io_buf, want, error);
+
+        if (n < 0) {
+            return 1;
+        }
+        if (n == 0) {
+            break;
+        }
+        *skipped += (see_u64)n;
+    }
+    return 0;
+}
+
+/* Prepare --head or --tail for the input about to be copied. A seekable
+ * --tail input is positioned at its last lines, found by scanning back
+ * from the end one TAIL_BLOCK at a time, so a huge log is never read
+ * through; anything else is kept in 'tail_buf' as it streams past.
+ * Returns 0 on success, 1 (reported) on error. */
+static int slice_begin(see_input input, const char *input_name) {
+    see_u64 position;
+    see_u64 size;
+    see_u64 start;
+    see_u64 end;
+    see_u64 need = opt_slice_count;
+    size_t block = (io_buf_size < TAIL_BLOCK) ? io_buf_size : TAIL_BLOCK;
+    int err = 0;
+
+    slice_left = opt_slice_count;
+    slice_buffering = 0;
+#ifdef SEE_WIN32_IO
+    slice_offset = 0;
+#endif
+    if (opt_slice != SLICE_TAIL) {
+        return 0;
+    }
+    /* The tail of ranges, or of decoded data, is only known once they
+     * have been read. */
+    if (input_ranges != NULL || opt_decompress ||
+        !input_extent(input, &position, &size)) {
+        slice_buffering = 1;
+        return 0;
+    }
+
+    start = position;
+    end = size;
+    if (opt_slice_bytes || need == 0) {
+        if (size - position > need) {
+            start = size - need;
+        }
+        end = position; /* No scan. */
+    }
+    while (end > position) {
+        see_u64 offset = (end - 1) / block * block;
+        size_t scan;
+        size_t lines;
+        long got;
+
+        if (offset < position) {
+            offset = position;
+        }
+        got = input_read_at(input, offset, io_buf, (size_t)(end - offset),
+                            &err);
+        if (got < 0) {
+            diag("%s: read error on %s: %s\n",
+                 PROG_NAME, input_name, input_strerror(err));
+            return 1;
+        }
+        if (got == 0) {
+            end = offset; /* Truncated under us. */
+            continue;
+        }
+        scan = (size_t)got;
+        if (end == size && io_buf[scan - 1] == '\n') {
+            --scan; /* Ends the last line rather than starting one. */
+        }
+        lines = count_lines(io_buf, scan);
+        if (lines >= need) {
+            while (io_buf[--scan] != '\n' || --need > 0) {
+                continue;
+            }
+            start = offset + scan + 1;
+            break;
+        }
+        need -= lines;
+        end = offset;
+    }
+
+    if (input_seek(input, start, &err) != 0) {
+        diag("%s: %s: %s\n",
+             PROG_NAME, input_name, input_strerror(err));
+        return 1;
+    }
+    return 0;
+}
+
+/* Add 'len' bytes of an unseekable --tail input to 'tail_buf', then drop
+ * whatever is no longer among the last lines or bytes. Returns one of
+ * WRITE_*. */
+static int tail_keep(const unsigned char *data, size_t len) {
+    if (opt_slice_count == 0) {
+        return WRITE_CLOSED; /* Nothing will be kept: stop reading. */
+    }
+    if (len > tail_cap - tail_len) {
+        memmove(tail_buf, tail_buf + tail_start, tail_len - tail_start);
+        tail_len -= tail_start;
+        tail_start = 0;
+    }
+    if (len > tail_cap - tail_len) {
+        size_t cap = 2 * (tail_len + len);
+        unsigned char *grown;
+
+        if (cap < BUFFER_SIZE) {
+            cap = BUFFER_SIZE;
+        }
+        grown = (unsigned char *)realloc(tail_buf, cap);
+        if (grown == NULL) {
+            diag("%s: cannot keep the tail: %s\n",
+                 PROG_NAME, strerror(ENOMEM));
+            return WRITE_ERROR;
+        }
+        tail_buf = grown;
+        tail_cap = cap;
+    }
+    memcpy(tail_buf + tail_len, data, len);
+    tail_len += len;
+
+    if (opt_slice_bytes) {
+        if ((see_u64)(tail_len - tail_start) > opt_slice_count) {
+            tail_start = tail_len - (size_t)opt_slice_count;
+        }
+        return WRITE_OK;
+    }
+    /* Lines after the kept newlines may still follow, so keep up to
+     * 'opt_slice_count' newlines; slice_end() settles a partial line. */
+    tail_lines += count_lines(data, len);
+    for (; tail_lines > opt_slice_count; --tail_lines) {
+        tail_start = (size_t)((const unsigned char *)memchr(
+                                  tail_buf + tail_start, '\n',
+                                  tail_len - tail_start) -
+                              tail_buf) +
+                     1;
+    }
+    return WRITE_OK;
+}
+
+/* Finish --head or --tail for the input just copied, writing out a kept
+ * tail. Returns 0 on success (including a broken pipe), 1 on error. */
+static int slice_end(void) {
+    int rc = WRITE_OK;
+
+    if (slice_buffering) {
+        if (!opt_slice_bytes && tail_lines == opt_slice_count &&
+            tail_len > tail_start && tail_buf[tail_len - 1] != '\n') {
+            /* The unterminated last line is one too many. */
+            tail_start = (size_t)((const unsigned char *)memchr(
+                                      tail_buf + tail_start, '\n',
+                                      tail_len - tail_start) -
+                                  tail_buf) +
+                         1;
+        }
+        rc = write_output(tail_buf + tail_start, tail_len - tail_start);
+        tail_start = 0;
+        tail_len = 0;
+        tail_lines = 0;
+        slice_buffering = 0;
+    }
+    return rc == WRITE_ERROR;
+}
+
+/* qsort() order of ranges: by offset. */
+static int range_compare(const void *a, const void *b) {
+    const struct see_range *x = (const struct see_range *)a;
+    const struct see_range *y = (const struct see_range *)b;
+
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/* Parse RANGES, "OFFSET[:LENGTH]" items separated by commas (without a
+ * LENGTH the range runs to EOF), into a list sorted by offset in which
+ * overlapping and adjacent ranges are merged, so each byte is read once
+ * and the reads only move forward. Returns 0, or 1 if 'text' is malformed
+ * (nothing is allocated then). */
+static int parse_ranges(const char *text, struct see_range **list) {
+    struct see_range *ranges;
+    const char *p = text;
+    size_t count = 1;
+    size_t used = 0;
+    size_t i;
+
+    for (; *p != '\0'; ++p) {
+        count += (*p == ',');
+    }
+    ranges = (struct see_range *)malloc((count + 1) * sizeof(*ranges));
+    if (ranges == NULL) {
+        return 1;
+    }
+
+    for (p = text; ; ++p) {
+        char item[64];
+        size_t len = strcspn(p, ",");
+        char *colon;
+
+        if (len == 0 || len >= sizeof(item)) {
+            free(ranges);
+            return 1;
+        }
+        memcpy(item, p, len);
+        item[len] = '\0';
+        colon = strchr(item, ':');
+        if (colon != NULL) {
+            *colon = '\0';
+        }
+        ranges[used].length = NO_LIMIT;
+        if (parse_size(item, &ranges[used].offset) != 0 ||
+            (colon != NULL && colon[1] != '\0' &&
+             parse_size(colon + 1, &ranges[used].length) != 0)) {
+            free(ranges);
+            return 1;
+        }
+        if (ranges[used].length != 0) {
+            ++used;
+        }
+        p += len;
+        if (*p == '\0') {
+            break;
+        }
+    }
+
+    qsort(ranges, used, sizeof(*ranges), range_compare);
+    for (i = 0, count = 0; i < used; ++i) {
+        see_u64 end = (ranges[i].length > NO_LIMIT - ranges[i].offset)
+                          ? NO_LIMIT
+                          : ranges[i].offset + ranges[i].length;
+
+        if (count > 0) {
+            struct see_range *last = &ranges[count - 1];
+            see_u64 last_end = (last->length > NO_LIMIT - last->offset)
+                                   ? NO_LIMIT
+                                   : last->offset + last->length;
+
+            if (ranges[i].offset <= last_end) {
+                if (end > last_end) {
+                    last->length = (end == NO_LIMIT) ? NO_LIMIT
+                                                     : end - last->offset;
+                }
+                continue;
+            }
+        }
+        ranges[count++] = ranges[i];
+    }
+    ranges[count].offset = 0;
+    ranges[count].length = 0;
+    *list = ranges;
+    return 0;
+}
+
+/* Whether something, even a dangling symlink, is at 'path'. */
+static int path_exists(const char *path) {
+#if defined(SEE_WIN32_IO)
+    wchar_t *wide_path = utf8_to_wide(path);
+    DWORD attributes;
+
+    if (wide_path == NULL) {
+        return 0;
+    }
+    attributes = GetFileAttributesW(wide_path);
+    free(wide_path);
+    return attributes != INVALID_FILE_ATTRIBUTES;
+#elif defined(_WIN32)
+    return _access(path, 0) == 0;
+#else
+    struct stat st;
+
+    return lstat(path, &st) == 0;
+#endif
+}
+
+/* Split "FILE@RANGES" operands into FILE, so the prefetcher and io_uring
+ * only ever see paths, and keep their ranges in 'operand_ranges'. An '@'
+ * not followed by valid RANGES is part of the name, and so is the whole
+ * operand if a file of that name exists, as plain cat would copy it.
+ * Returns 0, or 1 (reported) if out of memory. */
+static int split_operands(char *operands[], int count) {
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        char *at = strrchr(operands[i], '@');
+        struct see_range *list;
+
+        if (at == NULL || at == operands[i] || parse_ranges(at + 1, &list)) {
+            continue;
+        }
+        if (path_exists(operands[i])) {
+            free(list);
+            continue;
+        }
+        if (operand_ranges == NULL) {
+            operand_ranges = (struct see_range **)calloc(
+                (size_t)count, sizeof(*operand_ranges));
+            if (operand_ranges == NULL) {
+                free(list);
+                diag("%s: %s\n", PROG_NAME, strerror(ENOMEM));
+                return 1;
+            }
+        }
+        *at = '\0';
+        operand_ranges[i] = list;
+    }
+    return 0;
+}
+
+/* Make the ranges of operand 'index' (-1 for implicit stdin) those of the
+ * next input: its own, else those of --offset/--length, else none. */
+static void select_operand(int index) {
+    input_ranges = NULL;
+    if (index >= 0 && operand_ranges != NULL) {
+        input_ranges = operand_ranges[index];
+    }
+    if (input_ranges == NULL && opt_range_set) {
+        input_ranges = opt_range;
+    }
+}
+
+#ifdef SEE_HAVE_DECODE
+/* Read more compressed data from 'input' into decode_buf[from, DECODE_BUF_SIZE).
+ * Returns the byte count, 0 at EOF, or -1 after reporting a read error. */
+static long decode_read(see_input input, size_t from,
+                        const char *input_name) {
+    size_t want = DECODE_BUF_SIZE - from;
+    double start = STATS_ON ? stats_clock() : 0.0;
+    int err = 0;
+    long n = input_read(input, decode_buf + from, want, &err);
+
+    if (STATS_ON) {
+        stats_read(&file_stats, start, n, want);
+        if (n > 0) {
+            file_stats.engines |= 1U << ENGINE_READ;
+        }
+    }
+    if (n < 0) {
+        diag("%s: read error on %s: %s\n",
+             PROG_NAME, input_name, input_strerror(err));
+    }
+    return n;
+}
+
+/* The format of an input starting with the 'len' bytes at 'p', among
+ * those this build decodes. */
+static int decode_format(const unsigned char *p, size_t len) {
+#ifdef SEE_WITH_ZLIB
+    if (len >= 2 && p[0] == 0x1f && p[1] == 0x8b) {
+        return DECODE_GZIP;
+    }
+#endif
+#ifdef SEE_WITH_ZSTD
+    if (len >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f &&
+        p[3] == 0xfd) {
+        return DECODE_ZSTD;
+    }
+#endif
+#ifdef SEE_WITH_LZ4
+    if (len >= 4 && p[0] == 0x04 && p[1] == 0x22 && p[2] == 0x4d &&
+        p[3] == 0x18) {
+        return DECODE_LZ4;
+    }
+#endif
+    (void)p;
+    (void)len;
+    return DECODE_NONE;
+}
+
+/* Decode the 'len' bytes at 'src' with 'd' into io_buf and pass the
+ * output on with write_data(). 'd->pending' is left nonzero when they end
+ * inside a frame (or gzip member). Returns one of WRITE_*; decoding errors
+ * are reported and return WRITE_ERROR, and data after the last gzip
+ * member returns WRITE_CLOSED, as there is nothing more to copy. */
+static int decode_feed(struct decoder *d, const unsigned char *src,
+                       size_t len, const char *input_name) {
+    int rc = WRITE_OK;
+
+    switch (d->format) {
+#ifdef SEE_WITH_ZLIB
+    case DECODE_GZIP:
+        d->gzip.next_in = (unsigned char *)src;
+        d->gzip.avail_in = (uInt)len;
+        for (;;) {
+            int zrc;
+
+            d->gzip.next_out = io_buf;
+            d->gzip.avail_out = (uInt)io_buf_size;
+            zrc = inflate(&d->gzip, Z_NO_FLUSH);
+            if (d->gzip.avail_out < io_buf_size &&
+                (rc = write_data(io_buf,
+                                 io_buf_size - d->gzip.avail_out)) !=
+                    WRITE_OK) {
+                return rc;
+            }
+            if (zrc == Z_STREAM_END) {
+                d->pending = 0;
+                if (d->gzip.avail_in == 0) {
+                    return WRITE_OK;
+                }
+                if (d->gzip.next_in[0] != 0x1f) {
+                    diag("%s: %s: warning: trailing garbage "
+                         "ignored\n", PROG_NAME, input_name);
+                    return WRITE_CLOSED;
+                }
+                (void)inflateReset(&d->gzip); /* Next member. */
+                d->pending = 1;
+            } else if (zrc == Z_BUF_ERROR ||
+                       (zrc == Z_OK && d->gzip.avail_in == 0 &&
+                        d->gzip.avail_out > 0)) {
+                return WRITE_OK; /* Needs more input. */
+            } else if (zrc != Z_OK) {
+                diag("%s: %s: invalid compressed data: %s\n",
+                     PROG_NAME, input_name,
+                     (d->gzip.msg != NULL) ? d->gzip.msg : "error");
+                return WRITE_ERROR;
+            }
+        }
+#endif
+#ifdef SEE_WITH_ZSTD
+    case DECODE_ZSTD: {
+        ZSTD_inBuffer in;
+
+        in.src = src;
+        in.size = len;
+        in.pos = 0;
+        for (;;) {
+            ZSTD_outBuffer out;
+
+            out.dst = io_buf;
+            out.size = io_buf_size;
+            out.pos = 0;
+            d->pending = ZSTD_decompressStream(d->zstd, &out, &in);
+            if (ZSTD_isError(d->pending)) {
+                diag("%s: %s: invalid compressed data: %s\n",
+                     PROG_NAME, input_name,
+                     ZSTD_getErrorName(d->pending));
+                return WRITE_ERROR;
+            }
+            if (out.pos > 0 &&
+                (rc = write_data(io_buf, out.pos)) != WRITE_OK) {
+                return rc;
+            }
+            /* Room left over means all output is flushed. */
+            if (in.pos == in.size && out.pos < out.size) {
+                return WRITE_OK;
+            }
+        }
+    }
+#endif
+#ifdef SEE_WITH_LZ4
+    case DECODE_LZ4: {
+        size_t pos = 0;
+
+        for (;;) {
+            size_t src_size = len - pos;
+            size_t dst_size = io_buf_size;
+
+            d->pending = LZ4F_decompress(d->lz4, io_buf, &dst_size,
+                                         src + pos, &src_size, NULL);
+            if (LZ4F_isError(d->pending)) {
+                diag("%s: %s: invalid compressed data: %s\n",
+                     PROG_NAME, input_name,
+                     LZ4F_getErrorName(d->pending));
+                return WRITE_ERROR;
+            }
+            pos += src_size;
+            if (dst_size > 0 &&
+                (rc = write_data(io_buf, dst_size)) != WRITE_OK) {
+                return rc;
+            }
+            if (pos == len && dst_size < io_buf_size) {
+                return WRITE_OK;
+            }
+        }
+    }
+#endif
+    default:
+        break;
+    }
+    (void)src;
+    (void)len;
+    (void)input_name;
+    return rc;
+}
+
+#ifdef SEE_HAVE_ZSTD_THREADS
+/* Frames of a mapped zstd file, shared out by zstd_parallel(). */
+struct zstd_frames {
+    struct decoder      *d;
+    const unsigned char *data;
+    size_t               size;
+    size_t               pos;  /* Start of the next frame to hand out */
+    const char          *input_name;
+};
+
+/* Hand out the next frame: to the workers when its decoded size is known
+ * and at most DECODE_JOB_MAX, otherwise deferred to the writer, which
+ * streams it. A damaged frame gets the rest of the file, so the decoder
+ * reports the error. */
+static int zstd_fill(void *context, struct see_chunk *chunk) {
+    struct zstd_frames *z = (struct zstd_frames *)context;
+    size_t frame;
+    see_u64 content;
+
+    if (z->pos == z->size) {
+        return 0;
+    }
+    frame = ZSTD_findFrameCompressedSize(z->data + z->pos,
+                                         z->size - z->pos);
+    content = ZSTD_CONTENTSIZE_ERROR;
+    if (ZSTD_isError(frame)) {
+        frame = z->size - z->pos;
+    } else {
+        content = ZSTD_getFrameContentSize(z->data + z->pos, frame);
+    }
+    chunk->src = z->data + z->pos;
+    chunk->src_len = frame;
+    chunk->deferred = (content == ZSTD_CONTENTSIZE_UNKNOWN ||
+                       content == ZSTD_CONTENTSIZE_ERROR ||
+                       content > DECODE_JOB_MAX);
+    if (!chunk->deferred && (size_t)content > chunk->out_cap) {
+        slab_free(chunk->out);
+        chunk->out = slab_alloc((size_t)content, &chunk->out_cap);
+        if (chunk->out == NULL) {
+            chunk->deferred = 1;
+        }
+    }
+    chunk->out_len = (size_t)content;
+    z->pos += frame;
+    return 1;
+}
+
+static void zstd_process(struct see_chunk *chunk) {
+    chunk->code = ZSTD_decompress(chunk->out, chunk->out_len,
+                                  chunk->src, chunk->src_len);
+}
+
+static int zstd_emit(void *context, struct see_chunk *chunk) {
+    struct zstd_frames *z = (struct zstd_frames *)context;
+    int rc;
+
+    if (chunk->deferred) {
+        rc = decode_feed(z->d, chunk->src, chunk->src_len, z->input_name);
+        if (rc == WRITE_OK && z->d->pending != 0) {
+            diag("%s: %s: unexpected end of compressed data\n",
+                 PROG_NAME, z->input_name);
+            rc = WRITE_ERROR;
+        }
+        return rc;
+    }
+    if (ZSTD_isError(chunk->code)) {
+        diag("%s: %s: invalid compressed data: %s\n",
+             PROG_NAME, z->input_name, ZSTD_getErrorName(chunk->code));
+        return WRITE_ERROR;
+    }
+    return write_data(chunk->out, chunk->code);
+}
+
+/* Decode a regular zstd file of several frames on the ordered writer's
+ * threads, each taking whole frames from a mapping of the file. 'have'
+ * bytes were already read from 'input_fd'. Returns 0 on success
+ * (including a broken pipe), 1 on error, or -1 when this does not apply:
+ * nothing is written and the fd is untouched. */
+static int zstd_parallel(struct decoder *d, int input_fd, size_t have,
+                         const char *input_name) {
+    struct ordered o;
+    struct zstd_frames z;
+    struct stat st;
+    off_t start = lseek(input_fd, 0, SEEK_CUR);
+    off_t map_offset;
+    long page_size = sysconf(_SC_PAGESIZE);
+    unsigned char *map;
+    size_t map_len;
+    size_t first;
+    int threads = order_threads();
+    int status;
+
+    /* A mapping reads through the page cache. */
+    if (threads < 2 || input_cache != CACHE_KEEP || start == (off_t)-1 ||
+        fstat(input_fd, &st) != 0 ||
+        !S_ISREG(st.st_mode) || start < (off_t)have ||
+        st.st_size <= start) {
+        return -1;
+    }
+    start -= (off_t)have;
+    if (page_size <= 0) {
+        page_size = 4096;
+    }
+    map_offset = start - start % page_size;
+    if ((see_u64)(st.st_size - map_offset) > (see_u64)(size_t)-1) {
+        return -1;
+    }
+    map_len = (size_t)(st.st_size - map_offset);
+    map = (unsigned char *)mmap(NULL, map_len, PROT_READ, MAP_SHARED,
+                                input_fd, map_offset);
+    if (map == (unsigned char *)MAP_FAILED) {
+        return -1;
+    }
+    z.d = d;
+    z.data = map + (size_t)(start - map_offset);
+    z.size = (size_t)(st.st_size - start);
+    z.pos = 0;
+    z.input_name = input_name;
+    first = ZSTD_findFrameCompressedSize(z.data, z.size);
+    if (ZSTD_isError(first) || first >= z.size ||
+        ordered_start(&o, 2L * threads, threads, zstd_process) != 0) {
+        (void)munmap(map, map_len);
+        return -1; /* One frame: nothing to share out. */
+    }
+    (void)posix_madvise(map, map_len, POSIX_MADV_SEQUENTIAL);
+
+    status = ordered_run(&o, zstd_fill, zstd_emit, &z);
+    ordered_finish(&o);
+    (void)munmap(map, map_len);
+    (void)lseek(input_fd, start + (off_t)z.pos, SEEK_SET);
+    return status;
+}
+#endif
+
+/* Copy 'input' for -z: decoded if it starts with the magic number of a
+ * format this build knows, otherwise as it is. Returns 0 on success
+ * (including a broken pipe), 1 on error. */
+static int decode_input(see_input input, const char *input_name) {
+    struct decoder d;
+    size_t have = 0;
+    int status = 0;
+    int rc;
+
+    /* Pipes may hand the magic number over in pieces. */
+    while (have < 4) {
+        long n = decode_read(input, have, input_name);
+        if (n < 0) {
+            return 1;
+        }
+        if (n == 0) {
+            break;
+        }
+        have += (size_t)n;
+    }
+
+    memset(&d, 0, sizeof(d));
+    d.format = decode_format(decode_buf, have);
+    d.pending = 1;
+    switch (d.format) {
+#ifdef SEE_WITH_ZLIB
+    case DECODE_GZIP:
+        if (inflateInit2(&d.gzip, 15 + 16) != Z_OK) { /* gzip wrapper */
+            d.format = DECODE_NONE;
+        }
+        break;
+#endif
+#ifdef SEE_WITH_ZSTD
+    case DECODE_ZSTD:
+        d.zstd = ZSTD_createDCtx();
+        if (d.zstd == NULL) {
+            d.format = DECODE_NONE;
+        }
+        break;
+#endif
+#ifdef SEE_WITH_LZ4
+    case DECODE_LZ4:
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&d.lz4,
+                                                         LZ4F_VERSION))) {
+            d.format = DECODE_NONE;
+        }
+        break;
+#endif
+    default:
+        /* Not compressed: pass it on, and copy the rest as usual. */
+        rc = write_data(decode_buf, have);
+        if (rc != WRITE_OK) {
+            return rc == WRITE_ERROR;
+        }
+        return copy_one(input, input_name);
+    }
+    if (d.format == DECODE_NONE) {
+        diag("%s: %s: %s\n",
+             PROG_NAME, input_name, strerror(ENOMEM));
+        return 1;
+    }
+
+#ifdef SEE_HAVE_ZSTD_THREADS
+    if (d.format == DECODE_ZSTD) {
+        status = zstd_parallel(&d, input, have, input_name);
+    } else {
+        status = -1;
+    }
+    if (status >= 0) {
+        ZSTD_freeDCtx(d.zstd);
+        return status;
+    }
+    status = 0;
+#endif
+
+    for (rc = decode_feed(&d, decode_buf, have, input_name);
+         rc == WRITE_OK;
+         rc = decode_feed(&d, decode_buf, have, input_name)) {
+        long n = decode_read(input, 0, input_name);
+
+        if (n <= 0) {
+            if (n == 0 && d.pending != 0) {
+                diag("%s: %s: unexpected end of compressed "
+                     "data\n", PROG_NAME, input_name);
+            }
+            status = (n < 0 || d.pending != 0);
+            break;
+        }
+        have = (size_t)n;
+    }
+    status |= (rc == WRITE_ERROR);
+
+    switch (d.format) {
+#ifdef SEE_WITH_ZLIB
+    case DECODE_GZIP:
+        (void)inflateEnd(&d.gzip);
+        break;
+#endif
+#ifdef SEE_WITH_ZSTD
+    case DECODE_ZSTD:
+        ZSTD_freeDCtx(d.zstd);
+        break;
+#endif
+#ifdef SEE_WITH_LZ4
+    case DECODE_LZ4:
+        (void)LZ4F_freeDecompressionContext(d.lz4);
+        break;
+#endif
+    default:
+        break;
+    }
+    return status;
+}
+#endif
+
+#ifdef SEE_HAVE_THREADS
+/* Reading side of transform_parallel(). */
+struct transform_job {
+    see_input          input;
+    const char        *input_name;
+    struct xform_state next;  /* Line state where the next chunk starts */
+    see_u64            lines; /* Lines started before it */
+};
+
+/* Read the next chunk and work out, from its raw bytes alone, the line
+ * state it leaves behind for the one after. */
+static int transform_fill(void *context, struct see_chunk *chunk) {
+    struct transform_job *job = (struct transform_job *)context;
+    const unsigned char *last;
+    size_t newlines = 0;
+    size_t need;
+    double start;
+    long n;
+    int err = 0;
+
+    if (chunk->in == NULL) {
+        chunk->in = slab_alloc(ORDER_CHUNK, &chunk->in_cap);
+        if (chunk->in == NULL) {
+            diag("%s: %s: %s\n",
+                 PROG_NAME, job->input_name, strerror(ENOMEM));
+            return -1;
+        }
+    }
+    start = STATS_ON ? stats_clock() : 0.0;
+    n = input_read(job->input, chunk->in, ORDER_CHUNK, &err);
+    if (STATS_ON) {
+        stats_read(&file_stats, start, n, ORDER_CHUNK);
+        file_stats.engines |= 1U << ENGINE_READ;
+    }
+    if (n <= 0) {
+        if (n < 0) {
+            diag("%s: read error on %s: %s\n",
+                 PROG_NAME, job->input_name, input_strerror(err));
+            return -1;
+        }
+        return 0;
+    }
+
+    need = 4 * (size_t)n;
+    if (opt_transform & XFORM_NUMBER) {
+        newlines = count_lines(chunk->in, (size_t)n);
+        need += 24 * (newlines + 1);
+    }
+    if (need > chunk->out_cap) {
+        slab_free(chunk->out);
+        chunk->out = slab_alloc(need, &chunk->out_cap);
+        if (chunk->out == NULL) {
+            diag("%s: %s: %s\n",
+                 PROG_NAME, job->input_name, strerror(ENOMEM));
+            return -1;
+        }
+    }
+    chunk->src = chunk->in;
+    chunk->src_len = (size_t)n;
+    chunk->xform = job->next;
+    if (opt_checksum != CHECKSUM_NONE) {
+        checksum_update(&file_checksum, chunk->in, (size_t)n);
+    }
+
+    last = chunk->in + n - 1;
+    if (opt_transform & XFORM_NUMBER) {
+        job->lines += (see_u64)newlines + (*last != '\n') -
+                      (see_u64)job->next.mid_line;
+        transform_number(&job->next, job->lines);
+    }
+    if (*last != '\n') {
+        job->next.blank = 0;
+    } else {
+        job->next.blank = (n >= 2) ? last[-1] == '\n' : !job->next.mid_line;
+    }
+    job->next.mid_line = (*last != '\n');
+    return 1;
+}
+
+static void transform_process(struct see_chunk *chunk) {
+    chunk->out_len = (size_t)(transform_chunk(&chunk->xform, chunk->src,
+                                              chunk->src + chunk->src_len,
+                                              chunk->out) -
+                              chunk->out);
+}
+
+static int transform_emit(void *context, struct see_chunk *chunk) {
+    (void)context;
+    return write_filtered(chunk->out, chunk->out_len);
+}
+
+/* Transform a regular file of ORDER_MIN bytes or more on the ordered
+ * writer's threads, ORDER_CHUNK bytes at a time. -n with -s stays on this
+ * thread, as which lines get a number depends on those dropped before.
+ * Returns 0 on success (including a broken pipe), 1 on error, or -1 when
+ * this does not apply and nothing was read. */
+static int transform_parallel(see_input input, const char *input_name) {
+    struct ordered o;
+    struct transform_job job;
+    see_u64 position = 0;
+    see_u64 size = 0;
+    int threads = order_threads();
+    int status;
+
+    if (threads < 2 ||
+        (opt_transform & (XFORM_NUMBER | XFORM_SQUEEZE)) ==
+            (XFORM_NUMBER | XFORM_SQUEEZE) ||
+        !input_extent(input, &position, &size) ||
+        size < position + ORDER_MIN ||
+        ordered_start(&o, 2L * threads, threads, transform_process) != 0) {
+        return -1;
+    }
+    job.input = input;
+    job.input_name = input_name;
+    job.next = xform;
+    job.lines = transform_lines(&xform);
+    status = ordered_run(&o, transform_fill, transform_emit, &job);
+    ordered_finish(&o);
+    xform = job.next;
+    return status;
+}
+#endif
+
+#ifdef SEE_HAVE_BATCH
+/* Write out the batched output. Under --stats its write calls count
+ * toward the FILE being copied (or the total, after the last FILE), but
+ * not its bytes: each batched FILE counted its own as it joined. Returns
+ * one of WRITE_*. */
+static int batch_flush(void) {
+    struct see_stats current;
+    size_t len = batch_len;
+    int rc;
+
+    batch_len = 0;
+    batch_files = 0;
+    if (len == 0) {
+        return WRITE_OK;
+    }
+    if (!STATS_ON) {
+        return write_all(io_buf, len);
+    }
+    current = file_stats;
+    memset(&file_stats, 0, sizeof(file_stats));
+    rc = write_all(io_buf, len);
+    file_stats.bytes = 0;
+    stats_merge(&current, &file_stats);
+    file_stats = current;
+    return rc;
+}
+
+/* Append a regular FILE below BATCH_FILE to the batch instead of writing
+ * it on its own. Each costs one read, whose short count is the EOF, and
+ * the batch one write per BATCH_BYTES or BATCH_FILES, where every FILE
+ * took a read, a write and the read that sees EOF (or a sendfile() pair).
+ * Any other input writes the batch out first, so output keeps its order.
+ * Returns 0 on success (including a broken pipe), 1 on error, or -1 to
+ * copy the input as usual. */
+static int batch_input(see_input input, const char *input_name) {
+    see_u64 position = 0;
+    see_u64 size = 0;
+    size_t want;
+    double start;
+    long n;
+    int err = 0;
+    int rc;
+
+    if (opt_transform != 0 || grep_count > 0 ||
+        opt_slice != SLICE_NONE || opt_follow || opt_decompress ||
+        input_ranges != NULL ||
+        input_cache != CACHE_KEEP ||
+        (opt_engine != ENGINE_AUTO && opt_engine != ENGINE_READ) ||
+        !input_extent(input, &position, &size) || position > size ||
+        size - position >= BATCH_FILE ||
+        (size_t)(size - position) >= io_buf_size) {
+        rc = batch_flush();
+        return (rc == WRITE_OK) ? -1 : (rc == WRITE_ERROR);
+    }
+
+    want = (size_t)(size - position) + 1;
+    if (io_buf_size - batch_len < want) {
+        rc = batch_flush();
+        if (rc != WRITE_OK) {
+            return rc == WRITE_ERROR;
+        }
+    }
+    start = STATS_ON ? stats_clock() : 0.0;
+    n = input_read(input, io_buf + batch_len, want, &err);
+    if (STATS_ON) {
+        stats_read(&file_stats, start, n, want);
+        file_stats.engines |= 1U << ENGINE_READ;
+        if (n > 0) {
+            file_stats.bytes += (see_u64)n;
+        }
+    }
+    if (n < 0) {
+        rc = batch_flush();
+        diag("%s: read error on %s: %s\n",
+             PROG_NAME, input_name, input_strerror(err));
+        return 1;
+    }
+    if (opt_checksum != CHECKSUM_NONE) {
+        checksum_update(&file_checksum, io_buf + batch_len, (size_t)n);
+    }
+    batch_len += (size_t)n;
+    ++batch_files;
+    if ((size_t)n == want) {
+        /* It grew since fstat(): copy the rest as usual. */
+        rc = batch_flush();
+        return (rc == WRITE_OK) ? -1 : (rc == WRITE_ERROR);
+    }
+    if (batch_len >= BATCH_BYTES || batch_files >= BATCH_FILES) {
+        return batch_flush() == WRITE_ERROR;
+    }
+    return 0;
+}
+#endif
+
+/* Copy 'input' to stdout: whole, or its ranges. The input is taken to
+ * each range by seeking when it can, or by reading past the gap, and the
+ * engines stop at the range's end; seekable inputs keep zero-copy and
+ * mmap. Returns 0 on success (including a broken pipe), 1 on error. */
+static int copy_input(see_input input, const char *input_name) {
+    const struct see_range *range = input_ranges;
+    see_u64 base = 0;
+    see_u64 size = 0;
+    see_u64 at = 0; /* Position past 'base' of a sequential input */
+    int seekable;
+    int status = 0;
+    int err = 0;
+
+    copy_limit = NO_LIMIT;
+#ifdef SEE_HAVE_BATCH
+    status = batch_input(input, input_name);
+    if (status >= 0) {
+        return status;
+    }
+    status = 0;
+#endif
+#ifdef SEE_HAVE_DECODE
+    if (opt_decompress) {
+        return decode_input(input, input_name); /* Never with ranges. */
+    }
+#endif
+    if (range == NULL) {
+#ifdef SEE_HAVE_THREADS
+        if (opt_transform != 0 && opt_slice == SLICE_NONE) {
+            int rc = transform_parallel(input, input_name);
+            if (rc >= 0) {
+                return rc;
+            }
+        }
+#endif
+        return copy_one(input, input_name);
+    }
+
+    seekable = input_extent(input, &base, &size);
+    for (; range->length != 0 && status == 0; ++range) {
+        if (seekable) {
+            if (range->offset >= size - base) {
+                break; /* Past EOF, as are the ranges after it. */
+            }
+            if (input_seek(input, base + range->offset, &err) != 0) {
+                diag("%s: %s: %s\n",
+                     PROG_NAME, input_name, input_strerror(err));
+                return 1;
+            }
+        } else {
+            see_u64 skipped;
+
+            if (input_skip(input, range->offset - at, &skipped, &err) != 0) {
+                diag("%s: read error on %s: %s\n",
+                     PROG_NAME, input_name, input_strerror(err));
+                return 1;
+            }
+            at += skipped;
+            if (at < range->offset) {
+                break; /* EOF in the gap. */
+            }
+        }
+
+        copy_limit = range->length;
+        status = copy_one(input, input_name);
+        at += range->length - copy_limit;
+        if (copy_limit != 0) {
+            break; /* EOF inside the range, or stdout closed. */
+        }
+    }
+    copy_limit = NO_LIMIT;
+    return status;
+}
+
+#ifdef SEE_HAVE_CACHE_CONTROL
+/* Whether the reads of the FILE about to be opened stay aligned, as
+ * uncached I/O needs. Byte ranges, the seek of --tail, the partial reads
+ * and mapping of -z and the reads of appended data by -f do not. */
+static int cache_aligned(void) {
+    return input_ranges == NULL && opt_slice != SLICE_TAIL &&
+           !opt_decompress && !opt_follow;
+}
+#endif
+
+#ifdef SEE_FD_IO
+static off_t cache_dropped; /* Pages of the FILE before this are dropped */
+
+/* Put the FILE opened as 'fd' in the page-cache mode for it. O_DIRECT is
+ * set after open(), so that a filesystem refusing it (tmpfs, many FUSE and
+ * network mounts) is caught here and the FILE dropped behind instead.
+ * macOS has F_NOCACHE in place of both. */
+static void cache_begin(int fd) {
+    struct stat st;
+
+    input_cache = opt_cache;
+    if (input_cache == CACHE_DIRECT && !cache_aligned()) {
+        input_cache = CACHE_DROP; /* --direct gives way to --nocache. */
+    }
+    cache_dropped = 0;
+    if (input_cache == CACHE_KEEP) {
+        return;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        input_cache = CACHE_KEEP;
+        return;
+    }
+#if defined(O_DIRECT)
+    if (input_cache == CACHE_DIRECT) {
+        int flags = fcntl(fd, F_GETFL);
+
+        if (flags == -1 || fcntl(fd, F_SETFL, flags | O_DIRECT) == -1) {
+            input_cache = CACHE_DROP;
+        }
+    }
+#elif defined(F_NOCACHE)
+    if (fcntl(fd, F_NOCACHE, 1) == -1) {
+        input_cache = CACHE_KEEP;
+    }
+#else
+    input_cache = CACHE_DROP;
+#endif
+}
+
+/* --nocache: after a read, drop the pages behind the offset of 'fd' once
+ * DROP_CHUNK more of them have been read. */
+static void cache_advance(int fd) {
+#ifdef POSIX_FADV_DONTNEED
+    off_t pos;
+
+    if (input_cache != CACHE_DROP) {
+        return;
+    }
+    pos = lseek(fd, 0, SEEK_CUR);
+    if (pos != (off_t)-1 && pos - cache_dropped >= DROP_CHUNK) {
+        (void)posix_fadvise(fd, cache_dropped, pos - cache_dropped,
+                            POSIX_FADV_DONTNEED);
+        cache_dropped = pos;
+    }
+#else
+    (void)fd;
+#endif
+}
+
+/* A read of 'fd' failed with 'err'. EINVAL under O_DIRECT means the
+ * device wants a coarser alignment than DIRECT_ALIGN: clear O_DIRECT and
+ * drop pages behind instead. Returns 1 if the read should be retried. */
+static int cache_fallback(int fd, int err) {
+#ifdef O_DIRECT
+    int flags;
+
+    if (input_cache != CACHE_DIRECT || err != EINVAL) {
+        return 0;
+    }
+    flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags & ~O_DIRECT) == -1) {
+        return 0;
+    }
+    input_cache = CACHE_DROP;
+    return 1;
+#else
+    (void)fd;
+    (void)err;
+    return 0;
+#endif
+}
+
+/* Done with 'fd': drop whatever of it is still cached (readahead and the
+ * last chunk) under --nocache. */
+static void cache_end(int fd) {
+#ifdef POSIX_FADV_DONTNEED
+    if (input_cache == CACHE_DROP) {
+        (void)posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+#else
+    (void)fd;
+#endif
+    input_cache = CACHE_KEEP;
+}
+#endif
+
+/* --tee state. 'done' and 'state' of a FILE with a writer thread, and
+ * the ring counters, are only touched with 'tee_lock' held. */
+struct tee_sink {
+    const char *path;
+    see_sink    out;
+    see_u64     done;  /* Bytes of output written to it */
+    int         state; /* TEE_* */
+#ifdef SEE_HAVE_THREADS
+    see_thread  thread;
+#endif
+};
+
+static struct tee_sink tee_sinks[TEE_MAX];
+static int             tee_count;
+static int             tee_stdout_gone; /* Output goes on to the FILEs */
+#ifdef SEE_HAVE_THREADS
+static unsigned char  *tee_ring;
+static size_t          tee_ring_size;
+static see_u64         tee_written;  /* Bytes of output put in the ring */
+static int             tee_finished; /* No more output is coming */
+static int             tee_threads;  /* Writers started */
+static see_mutex       tee_lock;
+static see_cond        tee_more;     /* 'tee_written' or 'tee_finished' moved */
+static see_cond        tee_room;     /* A FILE's 'done' or 'state' moved */
+#endif
+
+/*
+ * --tee: the output also goes to each FILE given. With threads, a writer
+ * per FILE drains one shared ring that the output is copied into once;
+ * each may fall up to TEE_RING bytes behind the newest output before the
+ * copy waits for it, so a slow FILE holds back neither stdout nor the
+ * others until it has used up that lag. A FILE whose reader goes away is
+ * dropped quietly, one that fails is reported and dropped; a broken pipe
+ * on stdout stops the copy only once no FILE is left.
+ */
+
+/* Open 'path' for writing, truncated. Returns 0 on success, or 1 with the
+ * error code in 'error' (not reported). */
+static int tee_open(const char *path, see_sink *sink, int *error) {
+#if defined(SEE_USE_STDIO)
+    *sink = fopen(path, "wb");
+    if (*sink == NULL) {
+        *error = errno;
+        return 1;
+    }
+#elif defined(SEE_WIN32_IO)
+    wchar_t *wide_path = utf8_to_wide(path);
+
+    if (wide_path == NULL) {
+        *error = (int)GetLastError();
+        return 1;
+    }
+    *sink = CreateFileW(wide_path, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                        CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    free(wide_path);
+    if (*sink == INVALID_HANDLE_VALUE) {
+        *error = (int)GetLastError();
+        return 1;
+    }
+#else
+    *sink = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (*sink == -1) {
+        *error = errno;
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+/* Write 'len' bytes of 'data' to 'sink', resuming partial writes. Returns
+ * WRITE_OK, WRITE_CLOSED if its reader went away, or WRITE_ERROR with the
+ * error code in 'error' (not reported). */
+static int tee_write(see_sink sink, const unsigned char *data, size_t len,
+                     int *error) {
+    while (len > 0) {
+#if defined(SEE_USE_STDIO)
+        size_t n = fwrite(data, 1, len, sink);
+
+        if (n == 0) {
+            *error = errno;
+            clearerr(sink);
+            if (*error == EINTR) {
+                continue;
+            }
+#ifdef EPIPE
+            if (*error == EPIPE) {
+                return WRITE_CLOSED;
+            }
+#endif
+            return WRITE_ERROR;
+        }
+#elif defined(SEE_WIN32_IO)
+        DWORD n = 0;
+        DWORD chunk = (len > 0x40000000UL) ? 0x40000000UL : (DWORD)len;
+
+        if (!WriteFile(sink, data, chunk, &n, NULL)) {
+            DWORD werr = GetLastError();
+
+            if (werr == ERROR_NO_DATA || werr == ERROR_BROKEN_PIPE) {
+                return WRITE_CLOSED;
+            }
+            *error = (int)werr;
+            return WRITE_ERROR;
+        }
+#else
+        ssize_t n = write(sink, data, len);
+
+        if (n <= 0) {
+            *error = (n == 0) ? EIO : errno;
+            if (*error == EINTR) {
+                continue;
+            }
+            return (*error == EPIPE) ? WRITE_CLOSED : WRITE_ERROR;
+        }
+#endif
+        data += n;
+        len -= (size_t)n;
+    }
+    return WRITE_OK;
+}
+
+/* Close 'sink'. Returns 0 on success, or an error code. */
+static int tee_close(see_sink sink) {
+#if defined(SEE_USE_STDIO)
+    return (fclose(sink) != 0) ? errno : 0;
+#elif defined(SEE_WIN32_IO)
+    return CloseHandle(sink) ? 0 : (int)GetLastError();
+#else
+    return (close(sink) != 0) ? errno : 0;
+#endif
+}
+
+/* Record how writing 'len' bytes to 's' went: 'rc' is one of WRITE_*.
+ * Called with 'tee_lock' held when the writers run on threads. */
+static void tee_account(struct tee_sink *s, int rc, size_t len, int err) {
+    if (rc == WRITE_OK) {
+        s->done += len;
+        return;
+    }
+    s->state = (rc == WRITE_CLOSED) ? TEE_CLOSED : TEE_FAILED;
+    if (rc == WRITE_ERROR) {
+        diag("%s: write error on %s: %s\n",
+             PROG_NAME, s->path, input_strerror(err));
+    }
+}
+
+#ifdef SEE_HAVE_THREADS
+THREAD_FN(tee_writer, arg) {
+    struct tee_sink *s = (struct tee_sink *)arg;
+
+    mutex_lock(&tee_lock);
+    while (s->state == TEE_OPEN) {
+        see_u64 done = s->done;
+        size_t at = (size_t)(done % tee_ring_size);
+        size_t len;
+        int err = 0;
+        int rc;
+
+        if (done == tee_written) {
+            if (tee_finished) {
+                break;
+            }
+            cond_wait(&tee_more, &tee_lock);
+            continue;
+        }
+        len = (tee_written - done < tee_ring_size - at)
+                  ? (size_t)(tee_written - done)
+                  : tee_ring_size - at;
+        mutex_unlock(&tee_lock);
+        rc = tee_write(s->out, tee_ring + at, len, &err);
+        mutex_lock(&tee_lock);
+        tee_account(s, rc, len, err);
+        cond_broadcast(&tee_room);
+    }
+    mutex_unlock(&tee_lock);
+    THREAD_RETURN;
+}
+#endif
+
+#ifdef SEE_HAVE_THREADS
+/* Let the writers drain the ring, then stop them. */
+static void tee_stop(void) {
+    mutex_lock(&tee_lock);
+    tee_finished = 1;
+    cond_broadcast(&tee_more);
+    mutex_unlock(&tee_lock);
+    while (tee_threads > 0) {
+        thread_join(tee_sinks[--tee_threads].thread);
+    }
+}
+#endif
+
+/* Open every --tee FILE and start their writers. Returns 0 on success, 1
+ * on error (reported). */
+static int tee_setup(void) {
+    int i;
+
+    if (tee_count == 0) {
+        return 0;
+    }
+    for (i = 0; i < tee_count; ++i) {
+        struct tee_sink *s = &tee_sinks[i];
+        int err = 0;
+
+        if (tee_open(s->path, &s->out, &err) != 0) {
+            diag("%s: %s: %s\n",
+                 PROG_NAME, s->path, input_strerror(err));
+            while (--i >= 0) {
+                (void)tee_close(tee_sinks[i].out);
+            }
+            return 1;
+        }
+        s->done = 0;
+        s->state = TEE_OPEN;
+    }
+#ifdef SEE_HAVE_THREADS
+    /* Without the ring or the threads, the FILEs are written in turn. */
+    tee_ring = (unsigned char *)arena_map(TEE_RING, 0, &tee_ring_size);
+    if (tee_ring == NULL) {
+        return 0;
+    }
+    mutex_init(&tee_lock);
+    cond_init(&tee_more);
+    cond_init(&tee_room);
+    while (tee_threads < tee_count &&
+           thread_start(&tee_sinks[tee_threads].thread, tee_writer,
+                        &tee_sinks[tee_threads]) == 0) {
+        ++tee_threads;
+    }
+    if (tee_threads < tee_count) {
+        tee_stop(); /* Nothing written yet: every FILE is still open. */
+    }
+#endif
+    return 0;
+}
+
+/* Pass 'len' bytes of output on to the --tee FILEs. Returns the number of
+ * FILEs still taking output. */
+static int tee_push(const unsigned char *data, size_t len) {
+    int open = 0;
+    int i;
+
+#ifdef SEE_HAVE_THREADS
+    if (tee_threads > 0) {
+        mutex_lock(&tee_lock);
+        for (;;) {
+            see_u64 oldest = tee_written;
+            size_t at = (size_t)(tee_written % tee_ring_size);
+            size_t room;
+
+            open = 0;
+            for (i = 0; i < tee_count; ++i) {
+                if (tee_sinks[i].state == TEE_OPEN) {
+                    ++open;
+                    if (tee_sinks[i].done < oldest) {
+                        oldest = tee_sinks[i].done;
+                    }
+                }
+            }
+            if (open == 0 || len == 0) {
+                break;
+            }
+            room = tee_ring_size - (size_t)(tee_written - oldest);
+            if (room == 0) {
+                cond_wait(&tee_room, &tee_lock); /* The slowest FILE lags. */
+                continue;
+            }
+            if (room > tee_ring_size - at) {
+                room = tee_ring_size - at;
+            }
+            if (room > len) {
+                room = len;
+            }
+            /* The writers stay behind 'tee_written': no lock needed. */
+            mutex_unlock(&tee_lock);
+            memcpy(tee_ring + at, data, room);
+            data += room;
+            len -= room;
+            mutex_lock(&tee_lock);
+            tee_written += room;
+            cond_broadcast(&tee_more);
+        }
+        mutex_unlock(&tee_lock);
+        return open;
+    }
+#endif
+    for (i = 0; i < tee_count; ++i) {
+        struct tee_sink *s = &tee_sinks[i];
+        int err = 0;
+
+        if (s->state == TEE_OPEN) {
+            tee_account(s, tee_write(s->out, data, len, &err), len, err);
+            open += (s->state == TEE_OPEN);
+        }
+    }
+    return open;
+}
+
+/* Let the writers drain the ring and close every --tee FILE. Returns 0
+ * on success, 1 if one of them failed. */
+static int tee_finish(void) {
+    int status = 0;
+    int i;
+
+#ifdef SEE_HAVE_THREADS
+    if (tee_threads > 0) {
+        tee_stop();
+    }
+#endif
+    for (i = 0; i < tee_count; ++i) {
+        struct tee_sink *s = &tee_sinks[i];
+        int err = tee_close(s->out);
+
+        if (err != 0) {
+            diag("%s: close error on %s: %s\n",
+                 PROG_NAME, s->path, input_strerror(err));
+        }
+        status |= (err != 0 || s->state == TEE_FAILED);
+    }
+    return status;
+}
+
+/* Write 'len' bytes of 'data' to stdout and pass them on to the --tee
+ * FILEs. Returns WRITE_OK, WRITE_ERROR (reported) or WRITE_CLOSED once
+ * stdout and every FILE have gone away. */
+static int write_all(const unsigned char *data, size_t len) {
+    int rc;
+
+    if (tee_count == 0) {
+        return write_stdout(data, len);
+    }
+    if (!tee_stdout_gone) {
+        rc = write_stdout(data, len);
+        if (rc == WRITE_ERROR) {
+            return rc;
+        }
+        tee_stdout_gone = (rc == WRITE_CLOSED);
+    }
+    stdout_closed = (tee_push(data, len) == 0 && tee_stdout_gone);
+    return stdout_closed ? WRITE_CLOSED : WRITE_OK;
+}
+
+/* Open the FILE operand 'file_path' for reading. Returns 0 on success, or
+ * 1 with the errno value (Win32 error code in the native Windows build) in
+ * 'error' (not reported). */
+static int open_input(const char *file_path, see_input *input, int *error) {
+#if defined(SEE_USE_STDIO)
+    *input = fopen(file_path, "rb");
+    if (*input == NULL) {
+        *error = errno;
+        return 1;
+    }
+#elif defined(SEE_WIN32_IO)
+    wchar_t *wide_path = utf8_to_wide(file_path);
+
+    if (wide_path == NULL) {
+        *error = (int)GetLastError();
+        return 1;
+    }
+    /* Windows has no way to drop cached pages, so --nocache bypasses the
+     * cache as --direct does wherever reads stay aligned. */
+    input_cache = (opt_cache != CACHE_KEEP && cache_aligned())
+                      ? CACHE_DIRECT
+                      : CACHE_KEEP;
+    *input = CreateFileW(wide_path, GENERIC_READ,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE |
+                             FILE_SHARE_DELETE,
+                         NULL, OPEN_EXISTING,
+                         FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_OVERLAPPED |
+                             (input_cache == CACHE_DIRECT
+                                  ? FILE_FLAG_NO_BUFFERING
+                                  : 0),
+                         NULL);
+    free(wide_path);
+    if (*input == INVALID_HANDLE_VALUE) {
+        *error = (int)GetLastError();
+        return 1;
+    }
+#else
+    *input = open(file_path, O_RDONLY);
+    if (*input == -1) {
+        *error = errno;
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+/* Copy an opened FILE operand to stdout and close it. Returns 0 on
+ * success, 1 on error. */
+static int finish_input(see_input input, const char *file_path) {
+    int status = 0;
+
+#if defined(SEE_USE_STDIO)
+    if (setvbuf(input, file_buf, _IOFBF, STDIO_BUF_SIZE) != 0) {
+        int err = errno;
+        diag("%s: %s: warning: failed to set full buffering: %s\n",
+             PROG_NAME, file_path, strerror(err));
+    }
+
+    if (slice_begin(input, file_path) != 0 ||
+        copy_input(input, file_path) != 0) {
+        status = 1;
+    }
+    status |= slice_end();
+
+    if (fclose(input) != 0) {
+        int err = errno;
+        diag("%s: close error on %s: %s\n",
+             PROG_NAME, file_path, strerror(err));
+        status = 1;
+    }
+#elif defined(SEE_WIN32_IO)
+    if (slice_begin(input, file_path) != 0 ||
+        copy_input(input, file_path) != 0) {
+        status = 1;
+    }
+    status |= slice_end();
+
+    input_cache = CACHE_KEEP;
+    if (opt_follow && follow_keep(input, file_path)) {
+        /* Left open for follow_run(). */
+    } else if (!CloseHandle(input)) {
+        DWORD werr = GetLastError();
+        diag("%s: close error on %s: %s\n",
+             PROG_NAME, file_path, win_strerror(werr));
+        status = 1;
+    }
+#else
+    cache_begin(input);
+    if (slice_begin(input, file_path) != 0 ||
+        copy_input(input, file_path) != 0) {
+        status = 1;
+    }
+    status |= slice_end();
+    cache_end(input);
+
+    if (opt_follow && follow_keep(input, file_path)) {
+        /* Left open for follow_run(). */
+    } else if (close(input) != 0) {
+        int err = errno;
+        diag("%s: close error on %s: %s\n",
+             PROG_NAME, file_path, strerror(err));
+        status = 1;
+    }
+#endif
+
+    stats_file_done(file_path, &file_stats);
+    checksum_file_done(file_path);
+    return status;
+}
+
+#ifdef SEE_FD_IO
+/* The whole run when it is one small regular FILE copied as is: one read
+ * into a stack buffer, whose short count is the EOF as in batch_input(),
+ * and one write, without output_setup(), the I/O arena or the prefetch
+ * machinery, which would cost more than the copy. stat() rather than
+ * open() decides, so a FIFO is never opened twice. Returns 0 on success
+ * (including a broken pipe), 1 on error, or -1 for the usual path. */
+static int small_file(const char *file_path) {
+    unsigned char buffer[SMALL_FILE];
+    struct stat file_stat;
+    size_t want;
+    int status = 0;
+    int fd;
+
+    if (opt_transform != 0 || grep_count > 0 || opt_slice != SLICE_NONE ||
+        tee_count > 0 || STATS_ON || opt_checksum != CHECKSUM_NONE ||
+        opt_follow || opt_decompress || opt_range_set ||
+        operand_ranges != NULL || opt_cache != CACHE_KEEP ||
+        opt_rate_limit != 0 || opt_buffer_size != 0 ||
+        (opt_engine != ENGINE_AUTO && opt_engine != ENGINE_READ) ||
+        strcmp(file_path, "-") == 0 || stat(file_path, &file_stat) != 0 ||
+        !S_ISREG(file_stat.st_mode) ||
+        (see_u64)file_stat.st_size >= SMALL_FILE) {
+        return -1;
+    }
+    fd = open(file_path, O_RDONLY);
+    if (fd == -1) {
+        return -1; /* process_path() reports it. */
+    }
+
+    want = (size_t)file_stat.st_size + 1;
+    for (;;) {
+        ssize_t n = read(fd, buffer, want);
+        int rc;
+
+        if (n < 0) {
+            int err = errno;
+            if (err == EINTR) {
+                continue;
+            }
+            diag("%s: read error on %s: %s\n",
+                 PROG_NAME, file_path, strerror(err));
+            status = 1;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        rc = write_stdout(buffer, (size_t)n);
+        if (rc != WRITE_OK) {
+            status = (rc == WRITE_ERROR);
+            break;
+        }
+        if ((size_t)n < want && want == (size_t)file_stat.st_size + 1) {
+            break;
+        }
+        want = sizeof(buffer); /* It grew since stat(): read on to EOF. */
+    }
+
+    if (close(fd) != 0) {
+        int err = errno;
+        diag("%s: close error on %s: %s\n",
+             PROG_NAME, file_path, strerror(err));
+        status = 1;
+    }
+    return status;
+}
+#endif
+
+/* Process a path or stdin ("-" or NULL). Returns 0 on success, 1 on error. */
+static int process_path(const char *file_path) {
+    see_input input;
+    int err;
+
+    if (file_path == NULL || strcmp(file_path, "-") == 0) {
+        int status;
+#if defined(SEE_USE_STDIO)
+        status = slice_begin(stdin, "stdin") != 0 ||
+                 copy_input(stdin, "stdin") != 0;
+#elif defined(SEE_WIN32_IO)
+        HANDLE std_input = GetStdHandle(STD_INPUT_HANDLE);
+
+        status = slice_begin(std_input, "stdin") != 0 ||
+                 copy_input(std_input, "stdin") != 0;
+#else
+        status = slice_begin(STDIN_FILENO, "stdin") != 0 ||
+                 copy_input(STDIN_FILENO, "stdin") != 0;
+#endif
+        status |= slice_end();
+        stats_file_done("-", &file_stats);
+        checksum_file_done("-");
+        return status;
+    }
+
+    if (open_input(file_path, &input, &err) != 0) {
+        (void)batch_flush(); /* Output before the message, as it came. */
+        diag("%s: %s: %s\n",
+             PROG_NAME, file_path, input_strerror(err));
+        return 1;
+    }
+
+    return finish_input(input, file_path);
+}
+
+#ifdef SEE_HAVE_FOLLOW
+/* A regular FILE kept open by --follow after its first copy. */
+struct follower {
+    const char *path;
+    see_input   input;
+#ifdef SEE_WIN32_IO
+    __int64     offset;  /* Bytes of 'input' copied so far */
+    DWORD       volume;  /* Identity of the file 'input' refers to */
+    DWORD       index_high;
+    DWORD       index_low;
+    int         dir;     /* Its directory in follow_run(), or -1 */
+#else
+    dev_t       dev;
+    ino_t       ino;
+    int         file_watch; /* inotify watch of the file, or -1 */
+    int         dir_watch;  /* inotify watch or kqueue fd of the directory */
+#endif
+    /* FOLLOW_DATA after a change to the data, FOLLOW_NAME when the path
+     * may now name another file; 0 when there is nothing to look at. */
+    int         pending;
+};
+#define FOLLOW_DATA 1
+#define FOLLOW_NAME 2
+
+static struct follower *followers;
+static int              follower_count;
+static int              follower_cap;
+#ifndef SEE_WIN32_IO
+static int              follow_queue = -1; /* inotify or kqueue fd */
+#endif
+
+/* Take the regular FILE 'input' for --follow once its first copy is done.
+ * Returns 1 if it was kept open, 0 if the caller should close it. */
+static int follow_keep(see_input input, const char *file_path) {
+    struct follower *f;
+#ifdef SEE_WIN32_IO
+    BY_HANDLE_FILE_INFORMATION info;
+
+    if (GetFileType(input) != FILE_TYPE_DISK ||
+        !GetFileInformationByHandle(input, &info)) {
+        return 0;
+    }
+#else
+    struct stat st;
+
+    if (fstat(input, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+#endif
+    if (follower_count == follower_cap) {
+        int cap = (follower_cap > 0) ? follower_cap * 2 : 16;
+        struct follower *grown = (struct follower *)realloc(
+            followers, (size_t)cap * sizeof(*grown));
+
+        if (grown == NULL) {
+            diag("%s: %s: cannot follow: %s\n",
+                 PROG_NAME, file_path, strerror(ENOMEM));
+            return 0;
+        }
+        followers = grown;
+        follower_cap = cap;
+    }
+    f = &followers[follower_count++];
+    f->path = file_path;
+    f->input = input;
+    f->pending = FOLLOW_NAME; /* Catch up once the watches are in place. */
+#ifdef SEE_WIN32_IO
+    /* Overlapped reads leave no file pointer behind. Without ranges the
+     * engines count what they copied down from NO_LIMIT, starting where
+     * --tail put the input. */
+    f->offset = slice_offset + (__int64)(NO_LIMIT - copy_limit);
+    f->volume = info.dwVolumeSerialNumber;
+    f->index_high = info.nFileIndexHigh;
+    f->index_low = info.nFileIndexLow;
+    f->dir = -1;
+#else
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->file_watch = -1;
+    f->dir_watch = -1;
+#endif
+    return 1;
+}
+
+/* The last component of 'path'. */
+static const char *follow_base(const char *path) {
+    const char *base = path;
+    const char *p;
+
+    for (p = path; *p != '\0'; ++p) {
+#ifdef _WIN32
+        if (*p == '\\' || *p == ':') {
+            base = p + 1;
+        }
+#endif
+        if (*p == '/') {
+            base = p + 1;
+        }
+    }
+    return base;
+}
+
+/* The directory holding 'path', with its trailing separator, or "." for
+ * a bare name; NULL when out of memory. The caller frees it. */
+static char *follow_dir(const char *path) {
+    size_t len = (size_t)(follow_base(path) - path);
+    char *dir = (char *)malloc(len + 2);
+
+    if (dir == NULL) {
+        return NULL;
+    }
+    if (len == 0) {
+        dir[len++] = '.';
+    } else {
+        memcpy(dir, path, len);
+    }
+    dir[len] = '\0';
+    return dir;
+}
+
+#ifdef SEE_HAVE_INOTIFY
+#define FOLLOW_FILE_MASK (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+#endif
+
+/* Watch the file 'f' now refers to, and on first use its directory, where
+ * a file taking its name shows up. Returns 0, or 1 with errno set. */
+static int follow_watch(struct follower *f) {
+#if defined(SEE_HAVE_INOTIFY)
+    if (f->dir_watch == -1) {
+        char *dir = follow_dir(f->path);
+
+        if (dir == NULL) {
+            errno = ENOMEM;
+            return 1;
+        }
+        f->dir_watch = inotify_add_watch(follow_queue, dir,
+                                         IN_CREATE | IN_MOVED_TO |
+                                             IN_ONLYDIR);
+        free(dir);
+    }
+    if (f->file_watch != -1) {
+        (void)inotify_rm_watch(follow_queue, f->file_watch);
+    }
+    f->file_watch = inotify_add_watch(follow_queue, f->path,
+                                      FOLLOW_FILE_MASK);
+    return f->file_watch == -1;
+#elif defined(SEE_HAVE_KQUEUE)
+    struct kevent change;
+
+    if (f->dir_watch == -1) {
+        char *dir = follow_dir(f->path);
+        int flags = O_RDONLY;
+
+        if (dir == NULL) {
+            errno = ENOMEM;
+            return 1;
+        }
+#ifdef O_EVTONLY
+        flags = O_EVTONLY; /* Does not keep the volume from unmounting. */
+#endif
+        f->dir_watch = open(dir, flags);
+        free(dir);
+        if (f->dir_watch != -1) {
+            EV_SET(&change, f->dir_watch, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+                   NOTE_WRITE, 0, f);
+            (void)kevent(follow_queue, &change, 1, NULL, 0, NULL);
+        }
+    }
+    /* Closing the old fd already dropped its registration. */
+    EV_SET(&change, f->input, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+           NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | NOTE_DELETE |
+               NOTE_RENAME,
+           0, f);
+    return kevent(follow_queue, &change, 1, NULL, 0, NULL) != 0;
+#else
+    (void)f;
+    return 0; /* follow_run() watches directories itself. */
+#endif
+}
+
+/* Copy what the followed FILE 'f' gained since it was last looked at,
+ * starting over when it was truncated. With 'renamed' set, also switch to
+ * a different file now at its path (log rotation), after draining the old
+ * one. Returns 0 on success (including a broken pipe), 1 on error. */
+static int follow_check(struct follower *f, int renamed) {
+    see_input input;
+    int status = 0;
+    int err;
+#ifdef SEE_WIN32_IO
+    LARGE_INTEGER size;
+    BY_HANDLE_FILE_INFORMATION info;
+
+    if (GetFileSizeEx(f->input, &size)) {
+        if (size.QuadPart < f->offset) {
+            diag("%s: %s: file truncated\n", PROG_NAME, f->path);
+            f->offset = 0;
+        }
+        if (size.QuadPart > f->offset) {
+            /* Only the bytes seen: a write racing this copy is reported
+             * by a notification of its own. */
+            slice_offset = f->offset;
+            copy_limit = (see_u64)(size.QuadPart - f->offset);
+            status = copy_handle(f->input, 1, f->path);
+            f->offset = size.QuadPart - (__int64)copy_limit;
+            copy_limit = NO_LIMIT;
+        }
+    }
+    if (!renamed || open_input(f->path, &input, &err) != 0) {
+        return status; /* Gone for now: its directory reports a new one. */
+    }
+    if (GetFileType(input) != FILE_TYPE_DISK ||
+        !GetFileInformationByHandle(input, &info) ||
+        (info.dwVolumeSerialNumber == f->volume &&
+         info.nFileIndexHigh == f->index_high &&
+         info.nFileIndexLow == f->index_low)) {
+        CloseHandle(input);
+        return status;
+    }
+    CloseHandle(f->input);
+    f->input = input;
+    f->offset = 0;
+    f->volume = info.dwVolumeSerialNumber;
+    f->index_high = info.nFileIndexHigh;
+    f->index_low = info.nFileIndexLow;
+#else
+    struct stat st;
+    off_t pos = lseek(f->input, 0, SEEK_CUR);
+
+    if (pos != (off_t)-1 && fstat(f->input, &st) == 0) {
+        if (st.st_size < pos) {
+            diag("%s: %s: file truncated\n", PROG_NAME, f->path);
+            pos = lseek(f->input, 0, SEEK_SET);
+        }
+        if (st.st_size > pos) {
+            status = copy_fd(f->input, f->path);
+        }
+    }
+    if (!renamed || stat(f->path, &st) != 0 ||
+        (st.st_dev == f->dev && st.st_ino == f->ino) ||
+        open_input(f->path, &input, &err) != 0) {
+        return status;
+    }
+    if (fstat(input, &st) != 0 || !S_ISREG(st.st_mode)) {
+        (void)close(input);
+        return status;
+    }
+    (void)close(f->input);
+    f->input = input;
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    if (follow_watch(f) != 0) {
+        err = errno;
+        diag("%s: %s: cannot follow: %s\n",
+             PROG_NAME, f->path, strerror(err));
+        status = 1;
+    }
+#endif
+    diag("%s: %s: file replaced; following the new file\n",
+         PROG_NAME, f->path);
+    return status | follow_check(f, 0);
+}
+
+/* Check every follower an event named. Returns 0 on success, 1 on
+ * error. */
+static int follow_pending(void) {
+    int status = 0;
+    int i;
+
+    for (i = 0; i < follower_count && !stdout_closed; ++i) {
+        struct follower *f = &followers[i];
+        int pending = f->pending;
+
+        if (pending != 0) {
+            f->pending = 0;
+            status |= follow_check(f, pending == FOLLOW_NAME);
+        }
+    }
+    /* Follow-up copies count towards the total only. */
+    if (STATS_ON) {
+        stats_merge(&total_stats, &file_stats);
+        memset(&file_stats, 0, sizeof(file_stats));
+    }
+    return status;
+}
+
+#ifdef SEE_WIN32_IO
+/* A directory of followed FILEs, with its ReadDirectoryChangesW() request
+ * in flight. Changes are not told apart by name: each one re-checks every
+ * follower in the directory, which costs a GetFileSizeEx() each. */
+struct follow_directory {
+    char      *path;
+    HANDLE     handle;
+    OVERLAPPED request;
+    DWORD      changes[1024]; /* FILE_NOTIFY_INFORMATION records */
+};
+#define FOLLOW_DIR_FILTER \
+    (FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE | \
+     FILE_NOTIFY_CHANGE_LAST_WRITE)
+
+/* Queue the next change notification for 'dir'. Returns 0, or 1 if none
+ * could be queued. */
+static int follow_listen(struct follow_directory *dir) {
+    return !ReadDirectoryChangesW(dir->handle, dir->changes,
+                                  sizeof(dir->changes), FALSE,
+                                  FOLLOW_DIR_FILTER, NULL, &dir->request,
+                                  NULL);
+}
+
+/* Open the directory 'path' into 'dir' and start listening; 'dir' takes
+ * 'path' on success. Returns 0, or 1 if it cannot be watched. */
+static int follow_open(struct follow_directory *dir, char *path) {
+    wchar_t *wide_path = utf8_to_wide(path);
+
+    if (wide_path == NULL) {
+        return 1;
+    }
+    dir->handle = CreateFileW(wide_path, FILE_LIST_DIRECTORY,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE |
+                                  FILE_SHARE_DELETE,
+                              NULL, OPEN_EXISTING,
+                              FILE_FLAG_BACKUP_SEMANTICS |
+                                  FILE_FLAG_OVERLAPPED,
+                              NULL);
+    free(wide_path);
+    if (dir->handle == INVALID_HANDLE_VALUE) {
+        return 1;
+    }
+    memset(&dir->request, 0, sizeof(dir->request));
+    dir->request.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (dir->request.hEvent == NULL || follow_listen(dir) != 0) {
+        if (dir->request.hEvent != NULL) {
+            CloseHandle(dir->request.hEvent);
+        }
+        CloseHandle(dir->handle);
+        return 1;
+    }
+    dir->path = path;
+    return 0;
+}
+#endif
+
+/* Copy data appended to the kept FILEs as it arrives, until stdout goes
+ * away; waits on change notifications rather than polling. Returns 0 on
+ * success, 1 on error. */
+static int follow_run(void) {
+    int status = 0;
+    int i;
+#if defined(SEE_HAVE_INOTIFY)
+    union {
+        struct inotify_event event; /* For alignment */
+        char bytes[FOLLOW_EVENTS * (sizeof(struct inotify_event) + 256)];
+    } events;
+    struct pollfd waits[2];
+#elif defined(SEE_HAVE_KQUEUE)
+    struct kevent events[FOLLOW_EVENTS];
+#else
+    struct follow_directory *dirs;
+    HANDLE waits[MAXIMUM_WAIT_OBJECTS];
+    int dir_count = 0;
+    int unwatched = 0; /* Followers left to a once-a-second look */
+#endif
+
+    if (follower_count == 0) {
+        return 0;
+    }
+#ifndef SEE_WIN32_IO
+#ifdef SEE_HAVE_INOTIFY
+    follow_queue = inotify_init1(IN_CLOEXEC);
+#else
+    follow_queue = kqueue();
+#endif
+    if (follow_queue == -1) {
+        int err = errno;
+        diag("%s: cannot follow: %s\n", PROG_NAME, strerror(err));
+        return 1;
+    }
+    for (i = 0; i < follower_count; ++i) {
+        if (follow_watch(&followers[i]) != 0) {
+            int err = errno;
+            diag("%s: %s: cannot follow: %s\n",
+                 PROG_NAME, followers[i].path, strerror(err));
+            status = 1;
+        }
+    }
+#else
+    dirs = (struct follow_directory *)malloc(MAXIMUM_WAIT_OBJECTS * sizeof(*dirs));
+    if (dirs == NULL) {
+        diag("%s: cannot follow: %s\n",
+             PROG_NAME, strerror(ENOMEM));
+        return 1;
+    }
+    /* One request per directory, up to the most one wait can take. */
+    for (i = 0; i < follower_count; ++i) {
+        struct follower *f = &followers[i];
+        char *path = follow_dir(f->path);
+        int d;
+
+        f->dir = -1;
+        if (path == NULL) {
+            continue;
+        }
+        for (d = 0; d < dir_count && strcmp(dirs[d].path, path) != 0; ++d) {
+        }
+        if (d == dir_count && dir_count < MAXIMUM_WAIT_OBJECTS &&
+            follow_open(&dirs[d], path) == 0) {
+            waits[dir_count++] = dirs[d].request.hEvent;
+            path = NULL; /* Now owned by dirs[d]. */
+        }
+        if (d < dir_count) {
+            f->dir = d;
+        }
+        free(path);
+    }
+    for (i = 0; i < follower_count; ++i) {
+        unwatched |= followers[i].dir == -1;
+    }
+#endif
+
+    for (;;) {
+        status |= follow_pending();
+        if (stdout_closed) {
+            break;
+        }
+#if defined(SEE_HAVE_INOTIFY)
+        /* A pipe's reader going away shows up as POLLERR. */
+        waits[0].fd = follow_queue;
+        waits[0].events = POLLIN;
+        waits[1].fd = (tee_count == 0 && stdout_stat_ok &&
+                       S_ISFIFO(stdout_stat.st_mode))
+                          ? output_fd
+                          : -1;
+        waits[1].events = 0;
+        if (poll(waits, 2, -1) < 0) {
+            int err = errno;
+            if (err == EINTR) {
+                continue;
+            }
+            diag("%s: cannot follow: %s\n",
+                 PROG_NAME, strerror(err));
+            status = 1;
+            break;
+        }
+        if (waits[1].revents != 0) {
+            break;
+        }
+        if (waits[0].revents != 0) {
+            ssize_t n = read(follow_queue, events.bytes,
+                             sizeof(events.bytes));
+            const char *p = events.bytes;
+
+            for (; n > 0 && p < events.bytes + n;
+                 p += sizeof(struct inotify_event) +
+                      ((const struct inotify_event *)p)->len) {
+                const struct inotify_event *event =
+                    (const struct inotify_event *)p;
+                int level = (event->mask & IN_MODIFY) ? FOLLOW_DATA
+                                                      : FOLLOW_NAME;
+
+                for (i = 0; i < follower_count; ++i) {
+                    struct follower *f = &followers[i];
+
+                    if ((event->mask & IN_Q_OVERFLOW) ||
+                        event->wd == f->file_watch ||
+                        (event->wd == f->dir_watch && event->len > 0 &&
+                         strcmp(event->name, follow_base(f->path)) == 0)) {
+                        if (f->pending < level) {
+                            f->pending = level;
+                        }
+                    }
+                }
+            }
+        }
+#elif defined(SEE_HAVE_KQUEUE)
+        {
+            int n = kevent(follow_queue, NULL, 0, events, FOLLOW_EVENTS,
+                           NULL);
+
+            if (n < 0) {
+                int err = errno;
+                if (err == EINTR) {
+                    continue;
+                }
+                diag("%s: cannot follow: %s\n",
+                     PROG_NAME, strerror(err));
+                status = 1;
+                break;
+            }
+            for (i = 0; i < n; ++i) {
+                struct follower *f = (struct follower *)events[i].udata;
+                int level = ((int)events[i].ident == f->dir_watch ||
+                             (events[i].fflags &
+                              (NOTE_DELETE | NOTE_RENAME | NOTE_ATTRIB)))
+                                ? FOLLOW_NAME
+                                : FOLLOW_DATA;
+
+                if (f->pending < level) {
+                    f->pending = level;
+                }
+            }
+        }
+#else
+        {
+            DWORD rc = WAIT_TIMEOUT;
+            DWORD bytes = 0;
+            int level = FOLLOW_DATA;
+            int d;
+
+            if (dir_count > 0) {
+                rc = WaitForMultipleObjects((DWORD)dir_count, waits, FALSE,
+                                            unwatched ? 1000 : INFINITE);
+            } else {
+                Sleep(1000);
+            }
+            if (rc == WAIT_TIMEOUT) {
+                for (i = 0; i < follower_count; ++i) {
+                    if (followers[i].dir == -1) {
+                        followers[i].pending = FOLLOW_NAME;
+                    }
+                }
+                continue;
+            }
+            if (rc < WAIT_OBJECT_0 || rc >= WAIT_OBJECT_0 + (DWORD)dir_count) {
+                diag("%s: cannot follow: %s\n",
+                     PROG_NAME, win_strerror(GetLastError()));
+                status = 1;
+                break;
+            }
+            d = (int)(rc - WAIT_OBJECT_0);
+            if (!GetOverlappedResult(dirs[d].handle, &dirs[d].request,
+                                     &bytes, FALSE) ||
+                bytes == 0) {
+                level = FOLLOW_NAME; /* Overflowed: assume anything. */
+            } else {
+                const FILE_NOTIFY_INFORMATION *change =
+                    (const FILE_NOTIFY_INFORMATION *)dirs[d].changes;
+
+                for (;;) {
+                    if (change->Action != FILE_ACTION_MODIFIED) {
+                        level = FOLLOW_NAME;
+                    }
+                    if (change->NextEntryOffset == 0) {
+                        break;
+                    }
+                    change = (const FILE_NOTIFY_INFORMATION *)(
+                        (const char *)change + change->NextEntryOffset);
+                }
+            }
+            for (i = 0; i < follower_count; ++i) {
+                struct follower *f = &followers[i];
+
+                if (f->dir == d && f->pending < level) {
+                    f->pending = level;
+                }
+            }
+            if (follow_listen(&dirs[d]) != 0) {
+                /* Never signalled again; its FILEs are looked at on the
+                 * timeout instead. */
+                ResetEvent(dirs[d].request.hEvent);
+                for (i = 0; i < follower_count; ++i) {
+                    if (followers[i].dir == d) {
+                        followers[i].dir = -1;
+                        unwatched = 1;
+                    }
+                }
+            }
+        }
+#endif
+    }
+
+#ifdef SEE_WIN32_IO
+    for (i = 0; i < dir_count; ++i) {
+        CancelIo(dirs[i].handle);
+        CloseHandle(dirs[i].handle);
+        CloseHandle(dirs[i].request.hEvent);
+        free(dirs[i].path);
+    }
+    free(dirs);
+    for (i = 0; i < follower_count; ++i) {
+        CloseHandle(followers[i].input);
+    }
+#else
+    for (i = 0; i < follower_count; ++i) {
+        (void)close(followers[i].input);
+#ifdef SEE_HAVE_KQUEUE
+        if (followers[i].dir_watch != -1) {
+            (void)close(followers[i].dir_watch);
+        }
+#endif
+    }
+    (void)close(follow_queue);
+#endif
+    return status;
+}
+#endif
+
+#ifdef SEE_HAVE_THREADS
+/* Prefetch slot states. */
+#define SLOT_PENDING 0 /* Not yet handled by a prefetch thread */
+#define SLOT_OPENED  1 /* 'input' is open and hinted for read-ahead */
+#define SLOT_FAILED  2 /* open failed with 'error' */
+#define SLOT_DEFER   3 /* Left for the main thread to open (stdin, FIFOs) */
+
+struct prefetch_slot {
+    see_atomic state;
+    see_input  input;
+    int        error;
+};
+
+/* Operands [0, count) of 'paths'; operand i lives in slot i % window.
+ * Threads claim operands in order through 'next' and never run more than
+ * 'window' operands ahead of 'consumed', so slots are reused safely. */
+struct prefetcher {
+    char                **paths;
+    long                  count;
+    long                  window;
+    struct prefetch_slot *slots;
+    see_atomic            next;     /* Next operand to claim */
+    see_atomic            consumed; /* Operands finished by the main thread */
+    see_atomic            stop;
+    struct see_event      ready;    /* A slot left SLOT_PENDING */
+    struct see_event      advanced; /* 'consumed' grew, or 'stop' was set */
+};
+
+/* Open one operand ahead of time and start read-ahead on it. Only regular
+ * files are kept: opening a FIFO could block, or hand the main thread an
+ * fd with no writer yet; the main thread opens those itself. */
+static void prefetch_one(const char *path, struct prefetch_slot *slot) {
+    if (strcmp(path, "-") == 0) {
+        atomic_store(&slot->state, SLOT_DEFER);
+        return;
+    }
+#if defined(SEE_USE_STDIO)
+    if (open_input(path, &slot->input, &slot->error) != 0) {
+        atomic_store(&slot->state, SLOT_FAILED);
+        return;
+    }
+#elif defined(SEE_WIN32_IO)
+    if (open_input(path, &slot->input, &slot->error) != 0) {
+        atomic_store(&slot->state, SLOT_FAILED);
+        return;
+    }
+    if (GetFileType(slot->input) != FILE_TYPE_DISK) {
+        CloseHandle(slot->input);
+        atomic_store(&slot->state, SLOT_DEFER);
+        return;
+    }
+#else
+    {
+        struct stat st;
+        int fd = open(path, O_RDONLY | O_NONBLOCK);
+        int flags;
+
+        if (fd == -1) {
+            slot->error = errno;
+            atomic_store(&slot->state, SLOT_FAILED);
+            return;
+        }
+        flags = fcntl(fd, F_GETFL);
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || flags == -1 ||
+            fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+            (void)close(fd);
+            atomic_store(&slot->state, SLOT_DEFER);
+            return;
+        }
+#ifdef POSIX_FADV_WILLNEED
+        (void)posix_fadvise(fd, 0,
+                            st.st_size < PREFETCH_BYTES ? st.st_size
+                                                        : PREFETCH_BYTES,
+                            POSIX_FADV_WILLNEED);
+#endif
+        slot->input = fd;
+    }
+#endif
+    atomic_store(&slot->state, SLOT_OPENED);
+}
+
+/* Number of CPUs online, or 1 if unknown. Prefetch threads only pay off
+ * with a spare CPU: on a single one they compete with the copy itself,
+ * which made a hot-cache run over many small files ~3x slower. */
+static int online_cpus(void) {
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 1) ? (int)count : 1;
+#else
+    return 1;
+#endif
+}
+
+THREAD_FN(prefetch_worker, arg) {
+    struct prefetcher *pf = (struct prefetcher *)arg;
+
+    for (;;) {
+        long epoch = event_epoch(&pf->advanced);
+        long index = atomic_load(&pf->next);
+
+        if (atomic_load(&pf->stop) || index >= pf->count) {
+            break;
+        }
+        if (index >= atomic_load(&pf->consumed) + pf->window) {
+            event_wait(&pf->advanced, epoch); /* Window full. */
+            continue;
+        }
+        if (!atomic_cas(&pf->next, index, index + 1)) {
+            continue; /* Another thread claimed it. */
+        }
+
+        prefetch_one(pf->paths[index], &pf->slots[index % pf->window]);
+        event_notify(&pf->ready);
+    }
+    THREAD_RETURN;
+}
+
+/* Process 'count' operands in order, as process_path() would, while up to
+ * PREFETCH_THREADS threads open the next opt_prefetch of them. Output and
+ * diagnostics appear in exactly the order of a serial run. Returns -1 if
+ * no thread could be started (nothing has been processed), otherwise the
+ * combined status. */
+static int process_prefetched(char *paths[], int count) {
+    struct prefetcher pf;
+    see_thread threads[PREFETCH_THREADS];
+    int thread_count = 0;
+    int status = 0;
+    long i;
+
+    pf.paths = paths;
+    pf.count = count;
+    pf.window = (opt_prefetch < count) ? opt_prefetch : count;
+    pf.slots = (struct prefetch_slot *)calloc((size_t)pf.window,
+                                              sizeof(*pf.slots));
+    if (pf.slots == NULL) {
+        return -1;
+    }
+    pf.next = 0;
+    pf.consumed = 0;
+    pf.stop = 0;
+    event_init(&pf.ready);
+    event_init(&pf.advanced);
+
+    while (thread_count < PREFETCH_THREADS && thread_count < pf.window &&
+           thread_start(&threads[thread_count], prefetch_worker, &pf) == 0) {
+        ++thread_count;
+    }
+    if (thread_count == 0) {
+        event_destroy(&pf.ready);
+        event_destroy(&pf.advanced);
+        free(pf.slots);
+        return -1;
+    }
+
+    for (i = 0; i < pf.count; ++i) {
+        struct prefetch_slot *slot = &pf.slots[i % pf.window];
+        long state;
+
+        for (;;) {
+            long epoch = event_epoch(&pf.ready);
+            state = atomic_load(&slot->state);
+            if (state != SLOT_PENDING) {
+                break;
+            }
+            event_wait(&pf.ready, epoch);
+        }
+
+        select_operand((int)i);
+        if (state == SLOT_OPENED) {
+            status |= finish_input(slot->input, paths[i]);
+        } else if (state == SLOT_FAILED) {
+            (void)batch_flush();
+            diag("%s: %s: %s\n",
+                 PROG_NAME, paths[i], input_strerror(slot->error));
+            status = 1;
+        } else {
+            status |= process_path(paths[i]);
+        }
+
+        atomic_store(&slot->state, SLOT_PENDING);
+        atomic_store(&pf.consumed, i + 1);
+        event_notify(&pf.advanced);
+    }
+
+    atomic_store(&pf.stop, 1);
+    event_notify(&pf.advanced);
+    while (thread_count > 0) {
+        thread_join(threads[--thread_count]);
+    }
+    event_destroy(&pf.ready);
+    event_destroy(&pf.advanced);
+    free(pf.slots);
+    return status;
+}
+#endif
+
+#ifdef SEE_HAVE_URING
+/*
+ * io_uring engine: opens, reads, writes and closes many FILE operands in
+ * batches, a whole submission queue per io_uring_enter() call. Each of
+ * URING_SLOTS slots owns one registered buffer and walks operands through
+ *
+ *     open -> read -> (write -> read)* -> close
+ *
+ * Any slot may open and read ahead, but only the slot holding the oldest
+ * unfinished operand (the "head") writes, so output stays in argument
+ * order. Writes are linked to the read refilling the same buffer; on
+ * kernels with direct descriptors (5.17+ here, to be safe) the open is
+ * linked to the first read as well. Uses raw system calls: no liburing.
+ */
+
+/* Operation tags kept in the low bits of an SQE's user_data. */
+#define UOP_OPEN  0
+#define UOP_READ  1
+#define UOP_WRITE 2
+#define UOP_CLOSE 3
+#define UOP_BITS  2
+
+/* Slot states. */
+#define US_FREE    0 /* Available for the next operand */
+#define US_BUSY    1 /* Operand in progress (open/read/write) */
+#define US_CLOSING 2 /* Done with; close in flight */
+
+struct uring_slot {
+    const char    *path;
+    int            state;
+    int            fd;          /* Real fd, or -1 with direct descriptors */
+    unsigned       inflight;    /* SQEs not yet completed */
+    unsigned char *data;        /* Registered buffer */
+    size_t         len;         /* Bytes of 'data' being written */
+    size_t         written;     /* Bytes of those already written */
+    size_t         fill;        /* Bytes of the last read, not yet taken */
+    int            read_queued; /* A read for this slot is in flight */
+    int            eof;
+    int            open_error;  /* errno of a failed open, or 0 */
+    int            read_error;  /* errno of a failed read, or 0 */
+    struct see_stats stats;     /* --stats counters for this operand */
+};
+
+struct uring {
+    int                  fd;
+    unsigned             entries;
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned             sq_mask;
+    unsigned            *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned             cq_mask;
+    struct io_uring_cqe *cqes;
+    void                *sq_ring;
+    size_t               sq_ring_size;
+    void                *cq_ring;
+    size_t               cq_ring_size;
+    size_t               sqes_size;
+    unsigned             pending;    /* SQEs queued but not submitted */
+    int                  fixed_bufs; /* Buffers registered */
+    int                  direct;     /* Direct descriptors (fixed files) */
+};
+
+static void uring_teardown(struct uring *ring) {
+    if (ring->sqes != NULL) {
+        (void)munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        (void)munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL) {
+        (void)munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        (void)close(ring->fd);
+    }
+}
+
+/* Returns nonzero if the kernel supports every opcode the engine uses. */
+static int uring_probe(struct uring *ring) {
+    static const unsigned char needed[] = {
+        IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE,
+        IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED
+    };
+    struct io_uring_probe *probe;
+    size_t size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    size_t i;
+    int ok = 1;
+
+    probe = (struct io_uring_probe *)calloc(1, size);
+    if (probe == NULL) {
+        return 0;
+    }
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE,
+                probe, 256) < 0) {
+        free(probe);
+        return 0;
+    }
+    for (i = 0; i < sizeof(needed); ++i) {
+        if (needed[i] > probe->last_op ||
+            !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+            ok = 0;
+        }
+    }
+    free(probe);
+    return ok;
+}
+
+/* Create a ring of 'entries' SQEs and register the slot buffers (and, where
+ * supported, a table of direct descriptors). Returns 0 on success, -1 if
+ * io_uring is unavailable (ENOSYS, seccomp, too old for the opcodes). */
+static int uring_setup(struct uring *ring, unsigned entries,
+                       struct uring_slot *slots, unsigned slot_count,
+                       size_t chunk_size) {
+    struct io_uring_params params;
+    struct iovec iov[URING_SLOTS];
+    unsigned i;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        ring->fd = -1;
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_RW_CUR_POS) || !uring_probe(ring)) {
+        uring_teardown(ring);
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries *
+                                                   sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries *
+                                                  sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        uring_teardown(ring);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+                             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            uring_teardown(ring);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(
+        NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_teardown(ring);
+        return -1;
+    }
+
+    ring->entries = params.sq_entries;
+    ring->sq_head = (unsigned *)((char *)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)((char *)ring->sq_ring +
+                                  params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)((char *)ring->cq_ring +
+                                  params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring +
+                                         params.cq_off.cqes);
+
+    /* Registered buffers save a page walk per I/O, but the pinning may be
+     * refused (RLIMIT_MEMLOCK); plain READ/WRITE work without them. */
+    for (i = 0; i < slot_count; ++i) {
+        iov[i].iov_base = slots[i].data;
+        iov[i].iov_len = chunk_size;
+    }
+    ring->fixed_bufs = syscall(__NR_io_uring_register, ring->fd,
+                               IORING_REGISTER_BUFFERS, iov, slot_count) == 0;
+
+#ifdef IORING_FEAT_CQE_SKIP
+    if (params.features & IORING_FEAT_CQE_SKIP) {
+        int files[URING_SLOTS];
+        for (i = 0; i < slot_count; ++i) {
+            files[i] = -1; /* Sparse table, filled by direct opens. */
+        }
+        ring->direct = syscall(__NR_io_uring_register, ring->fd,
+                               IORING_REGISTER_FILES, files, slot_count) == 0;
+    }
+#endif
+    return 0;
+}
+
+/* Returns a zeroed SQE at the tail of the submission queue. The caller
+ * sizes the ring so that it never runs out. */
+static struct io_uring_sqe *uring_sqe(struct uring *ring, unsigned op,
+                                      unsigned slot) {
+    unsigned tail = *ring->sq_tail + ring->pending;
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = ((__u64)slot << UOP_BITS) | op;
+    ring->sq_array[index] = index;
+    ++ring->pending;
+    return sqe;
+}
+
+/* Submit queued SQEs and wait for at least one completion. Returns 0, or
+ * an errno value. */
+static int uring_enter(struct uring *ring) {
+    unsigned tail = *ring->sq_tail + ring->pending;
+
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    ring->pending = 0;
+    for (;;) {
+        /* Count from the kernel's head so that SQEs an interrupted or
+         * partial submission left behind go out too. */
+        unsigned submit =
+            tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        long rc = syscall(__NR_io_uring_enter, ring->fd, submit, 1,
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rc >= 0) {
+            return 0;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        return errno;
+    }
+}
+
+/* Queue a read of the next chunk of the slot's operand into its buffer. */
+static void uring_queue_read(struct uring *ring, struct uring_slot *slot,
+                             unsigned index, size_t chunk_size) {
+    struct io_uring_sqe *sqe = uring_sqe(ring, UOP_READ, index);
+
+    sqe->opcode = ring->fixed_bufs ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->addr = (__u64)(unsigned long)slot->data;
+    sqe->len = (__u32)chunk_size;
+    sqe->off = (__u64)-1; /* Current file position: works for pipes too. */
+    sqe->buf_index = (__u16)index;
+    if (ring->direct) {
+        sqe->fd = (int)index;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = slot->fd;
+    }
+    slot->read_queued = 1;
+    ++slot->inflight;
+}
+
+/* Start operand 'path' in a free slot: an open, linked to the first read
+ * when direct descriptors let the read name the file before it exists. */
+static void uring_start(struct uring *ring, struct uring_slot *slot,
+                        unsigned index, const char *path, size_t chunk_size) {
+    struct io_uring_sqe *sqe = uring_sqe(ring, UOP_OPEN, index);
+
+    slot->path = path;
+    slot->state = US_BUSY;
+    slot->fd = -1;
+    slot->len = 0;
+    slot->written = 0;
+    slot->fill = 0;
+    slot->read_queued = 0;
+    slot->eof = 0;
+    slot->open_error = 0;
+    slot->read_error = 0;
+    memset(&slot->stats, 0, sizeof(slot->stats));
+    slot->stats.engines = 1U << ENGINE_URING;
+
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (__u64)(unsigned long)path;
+    sqe->open_flags = O_RDONLY;
+    slot->inflight = 1;
+#ifdef IORING_FEAT_CQE_SKIP
+    if (ring->direct) {
+        sqe->file_index = index + 1;
+        sqe->flags = IOSQE_IO_LINK;
+        uring_queue_read(ring, slot, index, chunk_size);
+    }
+#else
+    (void)chunk_size;
+#endif
+}
+
+/* Retire a slot's operand: queue its close, or free it if never opened. */
+static void uring_finish(struct uring *ring, struct uring_slot *slot,
+                         unsigned index) {
+    struct io_uring_sqe *sqe;
+
+    if (slot->open_error != 0) {
+        slot->state = US_FREE;
+        return;
+    }
+    sqe = uring_sqe(ring, UOP_CLOSE, index);
+    sqe->opcode = IORING_OP_CLOSE;
+#ifdef IORING_FEAT_CQE_SKIP
+    if (ring->direct) {
+        sqe->file_index = index + 1;
+    } else
+#endif
+    {
+        sqe->fd = slot->fd;
+    }
+    slot->state = US_CLOSING;
+    ++slot->inflight;
+}
+
+/* Apply one completion to its slot. Results are only recorded; the head
+ * logic in uring_process() acts on them, so the order in which linked
+ * completions arrive does not matter. 'status' collects write and close
+ * failures, which are reported here. */
+static void uring_complete(struct uring *ring, struct uring_slot *slots,
+                           const struct io_uring_cqe *cqe, size_t chunk_size,
+                           int *status) {
+    unsigned index = (unsigned)(cqe->user_data >> UOP_BITS);
+    unsigned op = (unsigned)(cqe->user_data & ((1U << UOP_BITS) - 1));
+    struct uring_slot *slot = &slots[index];
+    int res = cqe->res;
+
+    --slot->inflight;
+    switch (op) {
+    case UOP_OPEN:
+        if (res < 0) {
+            slot->open_error = -res; /* A linked read fails with ECANCELED. */
+        } else if (!ring->direct) {
+            slot->fd = res;
+            uring_queue_read(ring, slot, index, chunk_size);
+        }
+        break;
+    case UOP_READ:
+        slot->read_queued = 0;
+        if (STATS_ON && res != -ECANCELED) {
+            ++slot->stats.reads;
+            if (res > 0 && (size_t)res < chunk_size) {
+                ++slot->stats.short_reads;
+            }
+        }
+        if (res > 0) {
+            slot->fill = (size_t)res;
+        } else if (res == 0) {
+            slot->eof = 1;
+        } else if (res != -ECANCELED) {
+            slot->read_error = -res;
+        }
+        /* ECANCELED: the open or the linked write failed or fell short;
+         * the head logic requeues whatever is still needed. */
+        break;
+    case UOP_WRITE:
+        if (STATS_ON) {
+            ++slot->stats.writes;
+            if (res >= 0 && (size_t)res < slot->len - slot->written) {
+                ++slot->stats.partial_writes;
+            }
+            if (res > 0) {
+                slot->stats.bytes += (see_u64)res;
+            }
+        }
+        if (res >= 0) {
+            /* A short write cancels the linked read; the rest is written
+             * again before the buffer is refilled. */
+            slot->written += (size_t)res;
+        } else {
+            if (-res != EPIPE) {
+                diag("%s: write error on stdout: %s\n",
+                     PROG_NAME, strerror(-res));
+                *status = 1;
+            }
+            /* Broken pipe is normal termination: stop this operand, as
+             * copy_fd() does. */
+            slot->eof = 1;
+            slot->len = 0;
+            slot->written = 0;
+        }
+        break;
+    default: /* UOP_CLOSE */
+        if (res < 0) {
+            diag("%s: close error on %s: %s\n",
+                 PROG_NAME, slot->path, strerror(-res));
+            *status = 1;
+        }
+        slot->state = US_FREE;
+        break;
+    }
+}
+
+/* Process 'count' operands through io_uring with the same output, messages
+ * and status as process_path() on each in turn. Returns -1 if io_uring is
+ * unavailable (nothing has been processed), otherwise the status. */
+static int uring_process(char *paths[], int count) {
+    struct uring ring;
+    struct uring_slot slots[URING_SLOTS];
+    size_t chunk_size = io_buf_size / URING_SLOTS;
+    int head = 0;     /* Oldest unfinished operand */
+    int next = 0;     /* Next operand to start */
+    int status = 0;
+    unsigned i;
+    int i_arg;
+
+    /* stdin goes through the regular engines. */
+    for (i_arg = 0; i_arg < count; ++i_arg) {
+        if (strcmp(paths[i_arg], "-") == 0) {
+            return -1;
+        }
+    }
+    chunk_size -= chunk_size % 4096;
+    if (chunk_size == 0) {
+        return -1;
+    }
+
+    memset(slots, 0, sizeof(slots));
+    for (i = 0; i < URING_SLOTS; ++i) {
+        slots[i].data = io_buf + (size_t)i * chunk_size;
+    }
+    /* At most two SQEs per slot are queued between submissions. */
+    if (uring_setup(&ring, 2 * URING_SLOTS, slots, URING_SLOTS,
+                    chunk_size) != 0) {
+        return -1;
+    }
+
+    for (;;) {
+        unsigned cq_head;
+        unsigned cq_tail;
+        int err;
+
+        /* Start operands in free slots, up to URING_SLOTS ahead. */
+        while (next < count && next < head + URING_SLOTS &&
+               slots[next % URING_SLOTS].state == US_FREE &&
+               slots[next % URING_SLOTS].inflight == 0) {
+            uring_start(&ring, &slots[next % URING_SLOTS],
+                        (unsigned)(next % URING_SLOTS), paths[next],
+                        chunk_size);
+            ++next;
+        }
+
+        /* Advance the head as far as its operands allow. */
+        while (head < next) {
+            unsigned index = (unsigned)(head % URING_SLOTS);
+            struct uring_slot *slot = &slots[index];
+
+            if (slot->state != US_BUSY || slot->inflight != 0) {
+                break; /* Waiting on the kernel. */
+            }
+            if (slot->written >= slot->len && slot->fill > 0) {
+                slot->len = slot->fill; /* Take the completed read. */
+                slot->written = 0;
+                slot->fill = 0;
+            }
+
+            if (slot->open_error != 0) {
+                diag("%s: %s: %s\n", PROG_NAME, slot->path,
+                     strerror(slot->open_error));
+                status = 1;
+            } else if (slot->written < slot->len) {
+                struct io_uring_sqe *sqe =
+                    uring_sqe(&ring, UOP_WRITE, index);
+                sqe->opcode = ring.fixed_bufs ? IORING_OP_WRITE_FIXED
+                                              : IORING_OP_WRITE;
+                sqe->flags = IOSQE_IO_LINK;
+                sqe->fd = output_fd;
+                sqe->addr = (__u64)(unsigned long)(slot->data +
+                                                   slot->written);
+                sqe->len = (__u32)(slot->len - slot->written);
+                sqe->off = (__u64)-1;
+                sqe->buf_index = (__u16)index;
+                ++slot->inflight;
+                uring_queue_read(&ring, slot, index, chunk_size);
+                break;
+            } else if (!slot->eof && slot->read_error == 0) {
+                uring_queue_read(&ring, slot, index, chunk_size);
+                break;
+            } else if (slot->read_error != 0) {
+                diag("%s: read error on %s: %s\n", PROG_NAME,
+                     slot->path, strerror(slot->read_error));
+                status = 1;
+            }
+            if (slot->open_error == 0) {
+                stats_file_done(slot->path, &slot->stats);
+            }
+            uring_finish(&ring, slot, index);
+            ++head;
+        }
+
+        if (ring.pending == 0) {
+            int busy = 0;
+            for (i = 0; i < URING_SLOTS; ++i) {
+                busy |= slots[i].inflight != 0;
+            }
+            if (!busy) {
+                break; /* Every operand done and closed. */
+            }
+        }
+
+        if (STATS_ON) {
+            /* Reads and writes complete together; the wait is not
+             * attributable to either side or to one operand. */
+            double start = stats_clock();
+            err = uring_enter(&ring);
+            total_stats.write_time += stats_clock() - start;
+        } else {
+            err = uring_enter(&ring);
+        }
+        if (err != 0) {
+            /* The ring itself failed; in-flight state is unknown. */
+            diag("%s: io_uring error: %s\n", PROG_NAME,
+                 strerror(err));
+            uring_teardown(&ring);
+            return 1;
+        }
+
+        cq_head = *ring.cq_head;
+        cq_tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (cq_head != cq_tail) {
+            uring_complete(&ring, slots, &ring.cqes[cq_head & ring.cq_mask],
+                           chunk_size, &status);
+            ++cq_head;
+        }
+        __atomic_store_n(ring.cq_head, cq_head, __ATOMIC_RELEASE);
+    }
+
+    uring_teardown(&ring);
+    return status;
+}
+#endif
+
+#ifdef SEE_HAVE_OPENAT
+/* One operand of a window of process_sorted(). */
+struct sorted_input {
+    const char *name;  /* Path relative to its directory fd */
+    int         dir;   /* That fd, or AT_FDCWD */
+    see_u64     dev;   /* Sort key: device, then inode or first extent */
+    see_u64     key;
+    int         index; /* Position in the window */
+    int         fd;    /* Opened input, or -1 */
+    int         error; /* errno of a failed stat or open; 0 defers */
+};
+
+/* A directory of the window, opened once for every name in it. */
+struct sorted_dir {
+    const char *path;
+    size_t      len;
+    int         fd;
+};
+
+/* qsort() order of a window: by disk position, then as given. */
+static int sorted_compare(const void *a, const void *b) {
+    const struct sorted_input *x = (const struct sorted_input *)a;
+    const struct sorted_input *y = (const struct sorted_input *)b;
+
+    if (x->dev != y->dev) {
+        return (x->dev > y->dev) ? 1 : -1;
+    }
+    if (x->key != y->key) {
+        return (x->key > y->key) ? 1 : -1;
+    }
+    return x->index - y->index;
+}
+
+/* qsort() order of a window: as given. */
+static int sorted_given(const void *a, const void *b) {
+    return ((const struct sorted_input *)a)->index -
+           ((const struct sorted_input *)b)->index;
+}
+
+/* Find 'path' in a window: split off its directory, opened once among the
+ * '*dir_count' in 'dirs', and stat the name in it. Regular files get a key
+ * for the inode order; stdin and all else are left for process_path(). */
+static void sorted_stat(const char *path, struct sorted_input *in,
+                        struct sorted_dir *dirs, int *dir_count) {
+    const char *slash = strrchr(path, '/');
+    struct stat st;
+    int d;
+
+    in->name = path;
+    in->dir = AT_FDCWD;
+    in->fd = -1;
+    in->error = 0;
+    in->dev = 0;
+    in->key = 0;
+    if (strcmp(path, "-") == 0) {
+        return;
+    }
+    if (slash != NULL && slash[1] != '\0') {
+        size_t len = (slash == path) ? 1 : (size_t)(slash - path);
+
+        for (d = *dir_count - 1; d >= 0; --d) {
+            if (dirs[d].len == len && memcmp(dirs[d].path, path, len) == 0) {
+                break;
+            }
+        }
+        if (d < 0) {
+            char *dir = (char *)malloc(len + 1);
+
+            d = *dir_count;
+            dirs[d].path = path;
+            dirs[d].len = len;
+            dirs[d].fd = -1;
+            if (dir != NULL) {
+                memcpy(dir, path, len);
+                dir[len] = '\0';
+                dirs[d].fd = open(dir, O_RDONLY | O_DIRECTORY);
+                free(dir);
+            }
+            ++*dir_count;
+        }
+        if (dirs[d].fd != -1) {
+            in->dir = dirs[d].fd; /* Else the full path resolves it. */
+            in->name = slash + 1;
+        }
+    }
+    if (fstatat(in->dir, in->name, &st, 0) != 0) {
+        in->error = errno;
+        return;
+    }
+    if (S_ISREG(st.st_mode)) {
+        in->dev = (see_u64)st.st_dev;
+        in->key = (see_u64)st.st_ino;
+        in->error = -1; /* To be opened. */
+    }
+}
+
+#ifdef SEE_HAVE_FIEMAP
+/* Key 'in' by the physical offset of its first extent, or 0 if it has
+ * none the filesystem will tell of. */
+static void sorted_extent(struct sorted_input *in) {
+    union {
+        struct fiemap map;
+        unsigned char bytes[sizeof(struct fiemap) +
+                            sizeof(struct fiemap_extent)];
+    } request;
+
+    memset(&request, 0, sizeof(request));
+    request.map.fm_length = ~(see_u64)0;
+    request.map.fm_extent_count = 1;
+    in->key = 0;
+    if (ioctl(in->fd, FS_IOC_FIEMAP, &request.map) == 0 &&
+        request.map.fm_mapped_extents > 0) {
+        in->key = request.map.fm_extents[0].fe_physical;
+    }
+}
+#endif
+
+/* Process 'count' operands in order, as process_path() would, a window of
+ * them at a time: each directory is opened once and its names resolved
+ * with openat(), the window's FILEs are opened in inode order and their
+ * read-ahead started in inode (or with --open-order=extent, disk) order,
+ * and then they are copied in the order given. Output and diagnostics are
+ * those of a serial run. Returns 0 on success, 1 on error. */
+static int process_sorted(char *paths[], int count) {
+    long open_max = sysconf(_SC_OPEN_MAX);
+    int window = SORT_WINDOW;
+    struct sorted_input *inputs;
+    struct sorted_dir *dirs;
+    int status = 0;
+    int base;
+
+    if (open_max > 0 && open_max / 4 < window) {
+        window = (open_max / 4 > 1) ? (int)(open_max / 4) : 1;
+    }
+    inputs = (struct sorted_input *)malloc((size_t)window * sizeof(*inputs));
+    dirs = (struct sorted_dir *)malloc((size_t)window * sizeof(*dirs));
+    if (inputs == NULL || dirs == NULL) {
+        diag("%s: %s\n", PROG_NAME, strerror(ENOMEM));
+        free(inputs);
+        free(dirs);
+        return 1;
+    }
+
+    for (base = 0; base < count; base += window) {
+        int n = (count - base < window) ? count - base : window;
+        int dir_count = 0;
+        int j;
+
+        for (j = 0; j < n; ++j) {
+            inputs[j].index = j;
+            sorted_stat(paths[base + j], &inputs[j], dirs, &dir_count);
+        }
+        qsort(inputs, (size_t)n, sizeof(*inputs), sorted_compare);
+        for (j = 0; j < n; ++j) {
+            struct sorted_input *in = &inputs[j];
+            int flags;
+
+            if (in->error != -1) {
+                continue;
+            }
+            /* The name may have become a FIFO since: do not block on it. */
+            in->fd = openat(in->dir, in->name, O_RDONLY | O_NONBLOCK);
+            in->error = 0;
+            if (in->fd == -1) {
+                in->error = errno;
+                continue;
+            }
+            flags = fcntl(in->fd, F_GETFL);
+            if (flags == -1 ||
+                fcntl(in->fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+                (void)close(in->fd);
+                in->fd = -1; /* Deferred. */
+            }
+        }
+#ifdef SEE_HAVE_FIEMAP
+        if (opt_open_order == OPEN_EXTENT) {
+            for (j = 0; j < n; ++j) {
+                if (inputs[j].fd != -1) {
+                    sorted_extent(&inputs[j]);
+                }
+            }
+            qsort(inputs, (size_t)n, sizeof(*inputs), sorted_compare);
+        }
+#endif
+#ifdef POSIX_FADV_WILLNEED
+        /* As for --prefetch: no read-ahead into a cache being avoided. */
+        for (j = 0; j < n && opt_cache == CACHE_KEEP && opt_rate_limit == 0;
+             ++j) {
+            if (inputs[j].fd != -1) {
+                (void)posix_fadvise(inputs[j].fd, 0, PREFETCH_BYTES,
+                                    POSIX_FADV_WILLNEED);
+            }
+        }
+#endif
+        qsort(inputs, (size_t)n, sizeof(*inputs), sorted_given);
+
+        for (j = 0; j < n; ++j) {
+            const char *path = paths[base + j];
+
+            select_operand(base + j);
+            if (inputs[j].fd != -1) {
+                status |= finish_input(inputs[j].fd, path);
+            } else if (inputs[j].error != 0) {
+                (void)batch_flush(); /* Output before the message. */
+                diag("%s: %s: %s\n",
+                     PROG_NAME, path, strerror(inputs[j].error));
+                status = 1;
+            } else {
+                status |= process_path(path);
+            }
+        }
+        while (dir_count > 0) {
+            if (dirs[--dir_count].fd != -1) {
+                (void)close(dirs[dir_count].fd);
+            }
+        }
+    }
+    free(inputs);
+    free(dirs);
+    return status;
+}
+#endif
+
+/* Copy 'count' FILE operands in order: with io_uring when asked for and
+ * it applies, else in --open-order, else through the prefetcher, else one
+ * at a time. Returns 0 on success, 1 on error. */
+static int process_operands(char *paths[], int count) {
+    int status = 0;
+    int i;
+
+#ifdef SEE_HAVE_URING
+    /* Falls back to the default engines if io_uring is unavailable. It
+     * copies whole files only. */
+    if (opt_engine == ENGINE_URING && operand_ranges == NULL &&
+        !opt_range_set && !opt_follow && !opt_decompress &&
+        opt_checksum == CHECKSUM_NONE && opt_rate_limit == 0) {
+        int rc = uring_process(paths, count);
+        if (rc >= 0) {
+            return rc;
+        }
+    }
+#endif
+#ifdef SEE_HAVE_OPENAT
+    if (count > 1 && opt_open_order != OPEN_GIVEN) {
+        return process_sorted(paths, count);
+    }
+#endif
+#ifdef SEE_HAVE_THREADS
+    if (count > 1 && opt_prefetch > 0) {
+        int rc = process_prefetched(paths, count);
+        if (rc >= 0) {
+            return rc;
+        }
+    }
+#endif
+    for (i = 0; i < count; ++i) {
+        select_operand(i);
+        status |= process_path(paths[i]);
+    }
+    return status;
+}
+
+/* Read more of the --files-from list 'list' into 'text' after its first
+ * '*len' bytes, doubling '*cap' first if they fill it (a path longer than
+ * LIST_BUF). Returns the bytes read, 0 at the end, or -1 on error
+ * (reported). */
+static long list_read(FILE *list, const char *list_name, char **text,
+                      size_t *len, size_t *cap) {
+    size_t n;
+
+    if (*len == *cap) {
+        char *grown = (char *)realloc(*text, *cap * 2);
+
+        if (grown == NULL) {
+            diag("%s: %s: %s\n",
+                 PROG_NAME, list_name, strerror(ENOMEM));
+            return -1;
+        }
+        *text = grown;
+        *cap *= 2;
+    }
+    n = fread(*text + *len, 1, *cap - *len, list);
+    if (n == 0 && ferror(list)) {
+        int err = errno;
+        diag("%s: read error on %s: %s\n",
+             PROG_NAME, list_name, strerror(err));
+        return -1;
+    }
+    return (long)n;
+}
+
+/* Copy the FILEs named in the --files-from list, one per line (or ended
+ * by NULs with -0; empty names are skipped). The list is read LIST_BUF
+ * bytes at a time and handed to process_operands() LIST_BATCH names at a
+ * time, so its length does not matter. Returns 0 on success, 1 on error
+ * (reported). */
+static int process_list(void) {
+    FILE *list = stdin;
+    const char *list_name = "stdin";
+    char **paths = (char **)malloc(LIST_BATCH * sizeof(*paths));
+    size_t cap = LIST_BUF;
+    char *text = (char *)malloc(cap);
+    size_t len = 0;
+    int sep = opt_list_nul ? '\0' : '\n';
+    int full = 0; /* The last batch filled up before the text ran out */
+    int eof = 0;
+    int status = 0;
+
+    if (paths == NULL || text == NULL) {
+        diag("%s: %s\n", PROG_NAME, strerror(ENOMEM));
+        free(paths);
+        free(text);
+        return 1;
+    }
+    if (strcmp(opt_files_from, "-") != 0) {
+        list_name = opt_files_from;
+        list = fopen(opt_files_from, "rb");
+        if (list == NULL) {
+            int err = errno;
+            diag("%s: %s: %s\n",
+                 PROG_NAME, list_name, strerror(err));
+            free(paths);
+            free(text);
+            return 1;
+        }
+    }
+
+    while (!stdout_closed) {
+        size_t start = 0;
+        int count = 0;
+        char *end;
+
+        if (!eof && !full) {
+            long n = list_read(list, list_name, &text, &len, &cap);
+
+            if (n < 0) {
+                status = 1;
+                break;
+            }
+            if (n == 0) {
+                eof = 1;
+                if (len > 0) {
+                    text[len++] = (char)sep; /* End the last name. */
+                }
+            }
+            len += (size_t)n;
+        }
+        while (count < LIST_BATCH &&
+               (end = (char *)memchr(text + start, sep, len - start)) !=
+                   NULL) {
+            *end = '\0';
+            if (end > text + start) {
+                paths[count++] = text + start;
+            }
+            start = (size_t)(end - text) + 1;
+        }
+        full = (count == LIST_BATCH);
+        if (count > 0) {
+            status |= process_operands(paths, count);
+        }
+        memmove(text, text + start, len - start);
+        len -= start;
+        if (eof && !full) {
+            break;
+        }
+    }
+
+    if (list != stdin) {
+        (void)fclose(list);
+    }
+    free(paths);
+    free(text);
+    return status;
+}
+
+#ifdef SEE_HAVE_SERVE
+/*
+ * --serve: a resident server for programs that would otherwise start see
+ * once per small FILE. A client sends a serve_header and its arguments,
+ * with its stdin, stdout, stderr and working directory attached as
+ * SCM_RIGHTS. The server forks a worker per request that takes those fds
+ * over and runs see_main() on the arguments, so the copy writes straight
+ * to the client's stdout with every engine, in-kernel ones included. The
+ * server reaps the worker and sends the client its exit status as one
+ * byte. A fork of the already-running server skips exec, the dynamic
+ * loader and platform_setup(); one fork per request, as see_main() keeps
+ * its options in globals and may exit(). There is no client mode of see
+ * itself: it would pay the exec that the server is there to save.
+ */
+
+/* A request whose worker is running, and the connection to answer; -1
+ * once the client has hung up. */
+struct serve_job {
+    pid_t pid;
+    int   conn;
+};
+
+static int serve_wake = -1; /* Write end of the signal self-pipe */
+static volatile sig_atomic_t serve_stop; /* SIGTERM and the like, or 0 */
+
+/* SIGCHLD, or a signal to stop on: wake the accept loop. */
+static void serve_signal_handler(int signo) {
+    int saved = errno;
+    char byte = 0;
+
+    if (signo != SIGCHLD) {
+        serve_stop = signo;
+    }
+    if (write(serve_wake, &byte, 1) < 0) {
+        /* Full: a wake-up is pending anyway. */
+    }
+    errno = saved;
+}
+
+/* Send all 'len' bytes of 'data' on 'sock'. Returns 0, or -1 on error. */
+static int serve_send(int sock, const void *data, size_t len) {
+    const char *p = (const char *)data;
+
+    while (len > 0) {
+        ssize_t n = write(sock, p, len);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Read all 'len' bytes of 'data' from 'sock'. Returns 0, or -1 on error
+ * or a short stream. */
+static int serve_recv(int sock, void *data, size_t len) {
+    char *p = (char *)data;
+
+    while (len > 0) {
+        ssize_t n = read(sock, p, len);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Fill 'addr' for the socket at 'path'. Returns 0, or 1 if it is too
+ * long (reported). */
+static int serve_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        diag("%s: %s: %s\n", PROG_NAME, path, strerror(ENAMETOOLONG));
+        return 1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/* Worker for one connection 'conn': take the client's fds and arguments
+ * and run them, exiting with their status for serve_run() to send back.
+ * Never returns. */
+static void serve_request(int conn) {
+    struct serve_header header;
+    union {
+        struct cmsghdr header;
+        char           space[CMSG_SPACE(SERVE_FDS * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    int fds[SERVE_FDS];
+    char *text;
+    char **args;
+    ssize_t n;
+    size_t at;
+    see_u32 i;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+    do {
+        n = recvmsg(conn, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (n != (ssize_t)sizeof(header) || cmsg == NULL ||
+        cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(SERVE_FDS * sizeof(int)) ||
+        header.magic != SERVE_MAGIC || header.argc == 0 ||
+        header.argc > SERVE_ARGC_MAX || header.bytes > SERVE_ARGS_MAX) {
+        _exit(EXIT_FAILURE); /* Not a client of ours: just hang up. */
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    /* Only our own user may ask. */
+#ifdef SO_PEERCRED
+    {
+        struct ucred peer;
+        socklen_t peer_len = sizeof(peer);
+
+        if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) !=
+                0 ||
+            peer.uid != getuid()) {
+            _exit(EXIT_FAILURE);
+        }
+    }
+#else
+    {
+        uid_t peer_uid;
+        gid_t peer_gid;
+
+        if (getpeereid(conn, &peer_uid, &peer_gid) != 0 ||
+            peer_uid != getuid()) {
+            _exit(EXIT_FAILURE);
+        }
+    }
+#endif
+
+    text = (char *)malloc((size_t)header.bytes + 1);
+    args = (char **)malloc(((size_t)header.argc + 1) * sizeof(*args));
+    if (text == NULL || args == NULL ||
+        serve_recv(conn, text, header.bytes) != 0) {
+        _exit(EXIT_FAILURE);
+    }
+    text[header.bytes] = '\0';
+    for (i = 0, at = 0; i < header.argc; ++i) {
+        if (at >= header.bytes) {
+            _exit(EXIT_FAILURE); /* Fewer arguments than announced. */
+        }
+        args[i] = text + at;
+        at += strlen(text + at) + 1;
+    }
+    args[header.argc] = NULL;
+
+    /* The request runs as the client would have: its fds, its directory. */
+    if (fchdir(fds[3]) != 0) {
+        _exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < 3; ++i) {
+        if (fds[i] != (int)i && dup2(fds[i], (int)i) == -1) {
+            _exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < SERVE_FDS; ++i) {
+        if (fds[i] > 2) {
+            (void)close(fds[i]);
+        }
+    }
+
+    (void)close(conn);
+    exit(see_main((int)header.argc, args));
+}
+
+/* Serve requests on the Unix socket 'path' until killed. Returns the exit
+ * status on failure (reported). */
+static int serve_run(const char *path) {
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    struct serve_job *jobs = NULL;
+    struct pollfd *waits = NULL; /* Socket, pipe, then each job's conn */
+    int job_count = 0;
+    int job_cap = 0;
+    struct stat st;
+    mode_t mask;
+    int wake[2];
+    int sock;
+    int rc;
+    int i;
+
+    if (serve_address(path, &addr) != 0) {
+        return EXIT_FAILURE;
+    }
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        int err = errno;
+        diag("%s: %s: %s\n", PROG_NAME, path, strerror(err));
+        return EXIT_FAILURE;
+    }
+    /* Replace a socket left by a server that has gone, but not one that
+     * still answers. */
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        int err = 0;
+
+        if (probe != -1 &&
+            connect(probe, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            err = errno;
+        }
+        if (probe != -1) {
+            (void)close(probe);
+        }
+        if (probe != -1 && err == 0) {
+            diag("%s: %s: %s\n",
+                 PROG_NAME, path, strerror(EADDRINUSE));
+            (void)close(sock);
+            return EXIT_FAILURE;
+        }
+        if (err == ECONNREFUSED) {
+            (void)unlink(path);
+        }
+    }
+    /* Only the owner may connect, as requests run with the server's
+     * rights. */
+    mask = umask(077);
+    rc = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    (void)umask(mask);
+    if (rc != 0 || listen(sock, SOMAXCONN) != 0) {
+        int err = errno;
+        diag("%s: %s: %s\n", PROG_NAME, path, strerror(err));
+        (void)close(sock);
+        return EXIT_FAILURE;
+    }
+
+    /* Signals wake the loop through a pipe: SIGCHLD to answer finished
+     * requests, the others to stop with the workers. */
+    if (pipe(wake) != 0) {
+        int err = errno;
+        diag("%s: %s\n", PROG_NAME, strerror(err));
+        (void)close(sock);
+        return EXIT_FAILURE;
+    }
+    (void)fcntl(wake[0], F_SETFL, O_NONBLOCK);
+    (void)fcntl(wake[1], F_SETFL, O_NONBLOCK);
+    serve_wake = wake[1];
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_signal_handler;
+    sa.sa_flags = SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGCHLD, &sa, NULL) != 0 ||
+        sigaction(SIGTERM, &sa, NULL) != 0 ||
+        sigaction(SIGINT, &sa, NULL) != 0 ||
+        sigaction(SIGHUP, &sa, NULL) != 0) {
+        int err = errno;
+        diag("%s: %s\n", PROG_NAME, strerror(err));
+        (void)close(sock);
+        return EXIT_FAILURE;
+    }
+
+    for (;;) {
+        int conn;
+        pid_t pid;
+        int status;
+
+        if (job_count + 2 > job_cap) {
+            int cap = (job_cap == 0) ? 16 : job_cap * 2;
+            struct serve_job *grown_jobs = (struct serve_job *)realloc(
+                jobs, (size_t)cap * sizeof(*jobs));
+            struct pollfd *grown_waits;
+
+            if (grown_jobs == NULL) {
+                diag("%s: %s\n", PROG_NAME, strerror(ENOMEM));
+                break;
+            }
+            jobs = grown_jobs;
+            grown_waits = (struct pollfd *)realloc(
+                waits, (size_t)cap * sizeof(*waits));
+            if (grown_waits == NULL) {
+                diag("%s: %s\n", PROG_NAME, strerror(ENOMEM));
+                break;
+            }
+            waits = grown_waits;
+            job_cap = cap;
+        }
+        waits[0].fd = sock;
+        waits[0].events = POLLIN;
+        waits[1].fd = wake[0];
+        waits[1].events = POLLIN;
+        /* POLLHUP needs no asking for: it reports a client that has gone,
+         * while anything more it sends is left unread. */
+        for (i = 0; i < job_count; ++i) {
+            waits[2 + i].fd = jobs[i].conn; /* Ignored once it is -1 */
+            waits[2 + i].events = 0;
+            waits[2 + i].revents = 0;
+        }
+        if (poll(waits, (nfds_t)(2 + job_count), -1) < 0) {
+            int err = errno;
+            if (err == EINTR) {
+                continue;
+            }
+            diag("%s: %s: %s\n", PROG_NAME, path, strerror(err));
+            break;
+        }
+
+        /* A client that hangs up cancels its request. */
+        for (i = 0; i < job_count; ++i) {
+            if (jobs[i].conn != -1 &&
+                (waits[2 + i].revents & (POLLHUP | POLLERR)) != 0) {
+                (void)kill(jobs[i].pid, SIGTERM);
+                (void)close(jobs[i].conn);
+                jobs[i].conn = -1;
+            }
+        }
+
+        if (waits[1].revents != 0) {
+            char drain[64];
+
+            while (read(wake[0], drain, sizeof(drain)) > 0) {
+            }
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                for (i = 0; i < job_count && jobs[i].pid != pid; ++i) {
+                }
+                if (i < job_count) {
+                    unsigned char code =
+                        WIFEXITED(status)
+                            ? (unsigned char)WEXITSTATUS(status)
+                            : (unsigned char)(128 + WTERMSIG(status));
+
+                    if (jobs[i].conn != -1) {
+                        (void)serve_send(jobs[i].conn, &code, 1);
+                        (void)close(jobs[i].conn);
+                    }
+                    jobs[i] = jobs[--job_count];
+                }
+            }
+            if (serve_stop != 0) {
+                break;
+            }
+        }
+
+        if ((waits[0].revents & POLLIN) == 0) {
+            continue;
+        }
+        conn = accept(sock, NULL, NULL);
+        if (conn == -1) {
+            int err = errno;
+            if (err == EINTR || err == EAGAIN || err == ECONNABORTED ||
+                err == EMFILE || err == ENFILE) {
+                continue;
+            }
+            diag("%s: %s: %s\n", PROG_NAME, path, strerror(err));
+            break;
+        }
+        pid = fork();
+        if (pid == 0) {
+            /* The worker keeps only its own connection, and goes with the
+             * server. */
+            sa.sa_handler = SIG_DFL;
+            (void)sigaction(SIGCHLD, &sa, NULL);
+            (void)sigaction(SIGTERM, &sa, NULL);
+            (void)sigaction(SIGINT, &sa, NULL);
+            (void)sigaction(SIGHUP, &sa, NULL);
+#ifdef __linux__
+            (void)prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+            (void)close(sock);
+            (void)close(wake[0]);
+            (void)close(wake[1]);
+            for (i = 0; i < job_count; ++i) {
+                if (jobs[i].conn != -1) {
+                    (void)close(jobs[i].conn);
+                }
+            }
+            serve_request(conn);
+        }
+        if (pid == -1) {
+            int err = errno;
+            diag("%s: %s: cannot serve a request: %s\n",
+                 PROG_NAME, path, strerror(err));
+            (void)close(conn);
+            continue;
+        }
+        jobs[job_count].pid = pid;
+        jobs[job_count].conn = conn;
+        ++job_count;
+    }
+
+    /* Stopped, or failed: take the workers and the socket down too. */
+    for (i = 0; i < job_count; ++i) {
+        (void)kill(jobs[i].pid, SIGTERM);
+    }
+    for (i = 0; i < job_count; ++i) {
+        while (waitpid(jobs[i].pid, NULL, 0) < 0 && errno == EINTR) {
+        }
+        if (jobs[i].conn != -1) {
+            (void)close(jobs[i].conn);
+        }
+    }
+    (void)close(sock);
+    (void)unlink(path);
+    free(jobs);
+    free(waits);
+    if (serve_stop != 0) {
+        /* Die of the signal, as without the handler. */
+        sa.sa_handler = SIG_DFL;
+        (void)sigaction(serve_stop, &sa, NULL);
+        (void)raise(serve_stop);
+    }
+    return EXIT_FAILURE;
+}
+
+#endif
+
+/* Runs the program on UTF-8 arguments; returns the exit status. */
+static int see_main(int argc, char *argv[]) {
+    int operand_count = 0;
+    int i;
+    int overall_rc = 0;
+    int options_ended = 0;
+#ifdef SEE_HAVE_FOLLOW
+    int requested_engine;
+#endif
+
+    /* Options apply to every FILE wherever they appear, so parse them all
+     * first; operands are compacted to the front of argv, in order. */
+    for (i = 1; i < argc; ++i) {
+        char *arg = argv[i];
+        const char *value;
+
+        if (!options_ended && arg[0] == '-') {
+            if (strcmp(arg, "--") == 0) {
+                options_ended = 1;
+                continue;
+            } else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+                usage();
+            } else if (strcmp(arg, "-v") == 0 || strcmp(arg, "--version") == 0) {
+                version();
+            } else if (strcmp(arg, "-f") == 0 ||
+                       strcmp(arg, "--follow") == 0) {
+#ifdef SEE_HAVE_FOLLOW
+                opt_follow = 1;
+                continue;
+#else
+                diag("%s: --follow is not supported in this "
+                     "build\n", PROG_NAME);
+                return EXIT_FAILURE;
+#endif
+            } else if (strcmp(arg, "--direct") == 0 ||
+                       strcmp(arg, "--nocache") == 0) {
+#ifdef SEE_HAVE_CACHE_CONTROL
+                if (arg[2] == 'd') {
+                    opt_cache = CACHE_DIRECT;
+                } else if (opt_cache == CACHE_KEEP) {
+                    opt_cache = CACHE_DROP;
+                }
+                continue;
+#else
+                diag("%s: %s is not supported in this build\n",
+                     PROG_NAME, arg);
+                return EXIT_FAILURE;
+#endif
+            } else if (strcmp(arg, "-z") == 0 ||
+                       strcmp(arg, "--decompress") == 0) {
+#ifdef SEE_HAVE_DECODE
+                opt_decompress = 1;
+                continue;
+#else
+                diag("%s: --decompress is not supported in this "
+                     "build\n", PROG_NAME);
+                return EXIT_FAILURE;
+#endif
+            } else if (transform_option(arg)) {
+                continue;
+            } else if (option_value("--grep", argc, argv, &i, &value)) {
+                if (grep_option(value) != 0) {
+                    diag("%s: too many --grep patterns (at most "
+                         "%d)\n", PROG_NAME, GREP_MAX);
+                    return EXIT_FAILURE;
+                }
+                continue;
+            } else if (option_value("--files-from", argc, argv, &i,
+                                    &value)) {
+                opt_files_from = value;
+                continue;
+            } else if (option_value("--serve", argc, argv, &i, &value)) {
+#ifdef SEE_HAVE_SERVE
+                if (arg != argv[1] || i != argc - 1) {
+                    diag("%s: --serve takes no other options or "
+                         "FILEs\n", PROG_NAME);
+                    return EXIT_FAILURE;
+                }
+                return serve_run(value);
+#else
+                diag("%s: --serve is not supported in this "
+                     "build\n", PROG_NAME);
+                return EXIT_FAILURE;
+#endif
+            } else if (option_value("--open-order", argc, argv, &i,
+                                    &value)) {
+                for (opt_open_order = OPEN_EXTENT;
+                     opt_open_order > OPEN_GIVEN; --opt_open_order) {
+                    if (strcmp(value, open_order_names[opt_open_order]) ==
+                        0) {
+                        break;
+                    }
+                }
+                if (opt_open_order == OPEN_GIVEN &&
+                    strcmp(value, open_order_names[OPEN_GIVEN]) != 0) {
+                    diag("%s: unknown open order: '%s'\n",
+                         PROG_NAME, value);
+                    return EXIT_FAILURE;
+                }
+#ifndef SEE_HAVE_OPENAT
+                if (opt_open_order != OPEN_GIVEN) {
+                    diag("%s: --open-order is not supported in "
+                         "this build\n", PROG_NAME);
+                    return EXIT_FAILURE;
+                }
+#endif
+                continue;
+            } else if (strcmp(arg, "-0") == 0 || strcmp(arg, "--null") == 0) {
+                opt_list_nul = 1;
+                continue;
+            } else if (option_value("--tee", argc, argv, &i, &value)) {
+                if (tee_count == TEE_MAX) {
+                    diag("%s: too many --tee FILEs (at most %d)\n",
+                         PROG_NAME, TEE_MAX);
+                    return EXIT_FAILURE;
+                }
+                tee_sinks[tee_count++].path = value;
+                continue;
+            } else if (option_value("--offset", argc, argv, &i, &value) ||
+                       option_value("--length", argc, argv, &i, &value)) {
+                see_u64 size;
+                if (parse_size(value, &size) != 0) {
+                    diag("%s: invalid %s: '%s'\n",
+                         PROG_NAME, arg[2] == 'o' ? "offset" : "length",
+                         value);
+                    return EXIT_FAILURE;
+                }
+                if (arg[2] == 'o') {
+                    opt_range[0].offset = size;
+                } else {
+                    opt_range[0].length = size;
+                }
+                opt_range_set = 1;
+                continue;
+            } else if (option_value("--head", argc, argv, &i, &value) ||
+                       option_value("--tail", argc, argv, &i, &value) ||
+                       option_value("--head-bytes", argc, argv, &i,
+                                    &value) ||
+                       option_value("--tail-bytes", argc, argv, &i,
+                                    &value)) {
+                if (parse_size(value, &opt_slice_count) != 0) {
+                    diag("%s: invalid count: '%s'\n",
+                         PROG_NAME, value);
+                    return EXIT_FAILURE;
+                }
+                /* The last of these options wins. */
+                opt_slice = (arg[2] == 'h') ? SLICE_HEAD : SLICE_TAIL;
+                opt_slice_bytes = strstr(arg, "-bytes") != NULL;
+                continue;
+            } else if (option_value("--buffer-size", argc, argv, &i, &value)) {
+                see_u64 size;
+                if (parse_size(value, &size) != 0 || size == 0 ||
+                    size > BUFFER_LIMIT) {
+                    diag("%s: invalid buffer size: '%s'\n",
+                         PROG_NAME, value);
+                    return EXIT_FAILURE;
+                }
+                opt_buffer_size = (size_t)size;
+                continue;
+            } else if (option_value("--prefetch", argc, argv, &i, &value)) {
+                see_u64 count;
+                if (parse_size(value, &count) != 0 || count > PREFETCH_LIMIT) {
+                    diag("%s: invalid prefetch count: '%s'\n",
+                         PROG_NAME, value);
+                    return EXIT_FAILURE;
+                }
+                opt_prefetch = (int)count;
+                continue;
+            } else if (option_value("--rate-limit", argc, argv, &i,
+                                    &value)) {
+                if (parse_size(value, &opt_rate_limit) != 0 ||
+                    opt_rate_limit == 0) {
+                    diag("%s: invalid rate limit: '%s'\n",
+                         PROG_NAME, value);
+                    return EXIT_FAILURE;
+                }
+                continue;
+            } else if (option_value("--nice", argc, argv, &i, &value)) {
+                see_u64 step;
+                if (parse_size(value + (value[0] == '-'), &step) != 0 ||
+                    step > 39) {
+                    diag("%s: invalid nice increment: '%s'\n",
+                         PROG_NAME, value);
+                    return EXIT_FAILURE;
+                }
+                opt_nice = (value[0] == '-') ? -(int)step : (int)step;
+                continue;
+            } else if (option_value("--ionice", argc, argv, &i, &value)) {
+                static const char *const classes[] = {
+                    NULL, "realtime", "best-effort", "idle"
+                };
+                const char *level = strchr(value, ':');
+                size_t len = (level != NULL) ? (size_t)(level - value)
+                                             : strlen(value);
+                see_u64 n = IONICE_LEVEL;
+
+                for (opt_ionice = IONICE_IDLE; opt_ionice > IONICE_NONE;
+                     --opt_ionice) {
+                    if (strlen(classes[opt_ionice]) == len &&
+                        strncmp(value, classes[opt_ionice], len) == 0) {
+                        break;
+                    }
+                }
+                if (opt_ionice == IONICE_NONE ||
+                    (level != NULL && (parse_size(level + 1, &n) != 0 ||
+                                       n >= IONICE_LEVELS))) {
+                    diag("%s: invalid I/O priority: '%s'\n",
+                         PROG_NAME, value);
+                    return EXIT_FAILURE;
+                }
+                opt_ionice_level = (int)n;
+                continue;
+            } else if (option_value("--threads", argc, argv, &i, &value)) {
+                see_u64 count;
+                if (parse_size(value, &count) != 0 || count > ORDER_LIMIT) {
+                    diag("%s: invalid thread count: '%s'\n",
+                         PROG_NAME, value);
+                    return EXIT_FAILURE;
+                }
+                opt_threads = (int)count;
+                continue;
+            } else if (option_value("--checksum", argc, argv, &i, &value)) {
+                for (opt_checksum = CHECKSUM_SHA256;
+                     opt_checksum > CHECKSUM_NONE; --opt_checksum) {
+                    if (strcmp(value, checksum_names[opt_checksum]) == 0) {
+                        break;
+                    }
+                }
+                if (opt_checksum == CHECKSUM_NONE) {
+                    diag("%s: unknown checksum: '%s'\n",
+                         PROG_NAME, value);
+                    return EXIT_FAILURE;
+                }
+                continue;
+            } else if (option_value("--checksum-file", argc, argv, &i,
+                                    &value)) {
+                if (checksum_stream != NULL && checksum_stream != stderr) {
+                    (void)fclose(checksum_stream);
+                }
+                checksum_stream = fopen(value, "w");
+                if (checksum_stream == NULL) {
+                    int err = errno;
+                    diag("%s: %s: %s\n",
+                         PROG_NAME, value, strerror(err));
+                    return EXIT_FAILURE;
+                }
+                continue;
+            } else if (option_value("--engine", argc, argv, &i, &value)) {
+                for (opt_engine = ENGINE_URING; opt_engine >= ENGINE_AUTO;
+                     --opt_engine) {
+                    if (strcmp(value, engine_names[opt_engine]) == 0) {
+                        break;
+                    }
+                }
+                if (opt_engine < ENGINE_AUTO) {
+                    diag("%s: unknown engine: '%s'\n",
+                         PROG_NAME, value);
+                    return EXIT_FAILURE;
+                }
+                continue;
+            } else if (strcmp(arg, "--stats") == 0) {
+                stats_stream = stderr;
+                stats_on = 1;
+                continue;
+            } else if (strncmp(arg, "--stats=", 8) == 0) {
+                /* The value is optional, so only the '=' form takes one. */
+                if (stats_stream != NULL && stats_stream != stderr) {
+                    (void)fclose(stats_stream);
+                }
+                stats_stream = fopen(arg + 8, "w");
+                if (stats_stream == NULL) {
+                    int err = errno;
+                    diag("%s: %s: %s\n",
+                         PROG_NAME, arg + 8, strerror(err));
+                    return EXIT_FAILURE;
+                }
+                stats_on = 1;
+                continue;
+            }
+        }
+
+        argv[1 + operand_count++] = arg;
+    }
+
+    /* Transforms, --grep, --tee and --head/--tail need the data in memory:
+     * no in-kernel copies, and mmap and io_uring give way to the read
+     * loop. */
+    if (opt_transform != 0) {
+        transform_setup();
+    }
+    /* --direct and --nocache need to see every read: the threaded engine
+     * keeps several in flight, the read loop one. */
+    if (opt_cache != CACHE_KEEP) {
+        if (opt_engine == ENGINE_AUTO) {
+#ifdef SEE_HAVE_PIPELINE
+            opt_engine = ENGINE_THREADED;
+#else
+            opt_engine = ENGINE_READ;
+#endif
+        } else if (opt_engine != ENGINE_READ &&
+                   opt_engine != ENGINE_THREADED) {
+            diag("%s: --direct and --nocache need the read or "
+                 "threaded engine\n", PROG_NAME);
+            return EXIT_FAILURE;
+        }
+    }
+#ifdef SEE_HAVE_FOLLOW
+    requested_engine = opt_engine;
+#endif
+    if ((opt_transform != 0 || grep_count > 0 || opt_slice != SLICE_NONE ||
+         tee_count > 0) &&
+        opt_engine != ENGINE_THREADED) {
+        opt_engine = ENGINE_READ;
+    }
+
+    if (split_operands(argv + 1, operand_count) != 0) {
+        return EXIT_FAILURE;
+    }
+    if (opt_decompress && (opt_range_set || operand_ranges != NULL)) {
+        diag("%s: --decompress cannot be combined with byte "
+             "ranges\n", PROG_NAME);
+        return EXIT_FAILURE;
+    }
+    if (opt_follow && (opt_slice == SLICE_HEAD || opt_range_set ||
+                       operand_ranges != NULL || opt_decompress)) {
+        diag("%s: --follow cannot be combined with --head, "
+             "--decompress or byte ranges\n", PROG_NAME);
+        return EXIT_FAILURE;
+    }
+    if (opt_files_from != NULL && (operand_count > 0 || opt_follow)) {
+        diag("%s: --files-from cannot be combined with FILE "
+             "operands or --follow\n", PROG_NAME);
+        return EXIT_FAILURE;
+    }
+    if (opt_follow && opt_checksum != CHECKSUM_NONE) {
+        diag("%s: --follow cannot be combined with --checksum\n",
+             PROG_NAME);
+        return EXIT_FAILURE;
+    }
+    if (opt_checksum != CHECKSUM_NONE) {
+        if (checksum_stream == NULL) {
+            checksum_stream = stderr;
+        }
+        checksum_setup();
+    }
+
+    if (priority_setup() != 0) {
+        return EXIT_FAILURE;
+    }
+    if (opt_rate_limit != 0) {
+        rate_setup();
+    }
+#ifdef SEE_FD_IO
+    if (operand_count == 1 && opt_files_from == NULL) {
+        int rc = small_file(argv[1]);
+        if (rc >= 0) {
+            return (rc == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+#endif
+    output_setup();
+    if (buffer_setup() != 0 || tee_setup() != 0) {
+        return EXIT_FAILURE;
+    }
+
+#ifdef SEE_USE_STDIO
+    /* Full buffering improves performance for large outputs. */
+    if (setvbuf(stdout, stdout_buf, _IOFBF, STDIO_BUF_SIZE) != 0) {
+        int err = errno;
+        diag("%s: warning: failed to set full buffering on stdout: %s\n",
+             PROG_NAME, strerror(err));
+    }
+#endif
+
+#ifdef SEE_HAVE_THREADS
+    if (opt_prefetch < 0) {
+        opt_prefetch = (online_cpus() > 1) ? PREFETCH_DEFAULT : 0;
+    }
+    if (opt_cache != CACHE_KEEP || opt_rate_limit != 0) {
+        opt_prefetch = 0; /* Its read-ahead would fill the cache and run
+                           * ahead of the rate. */
+    }
+#endif
+
+    if (opt_files_from != NULL) {
+        overall_rc |= process_list();
+    } else if (operand_count > 0) {
+        overall_rc |= process_operands(argv + 1, operand_count);
+    } else {
+        select_operand(-1);
+        overall_rc |= process_path(NULL);
+    }
+
+#ifdef SEE_HAVE_FOLLOW
+    /* Appended data is copied whole, by the engines that were asked for
+     * unless transforms, --grep or --tee need the read loop. */
+    if (opt_follow) {
+        opt_slice = SLICE_NONE;
+        if (opt_transform == 0 && grep_count == 0 && tee_count == 0) {
+            opt_engine = requested_engine;
+        }
+        overall_rc |= follow_run();
+    }
+#endif
+
+#ifdef SEE_HAVE_BATCH
+    /* The last batch's writes belong in the total. */
+    if (STATS_ON) {
+        overall_rc |= (batch_flush() == WRITE_ERROR);
+        stats_merge(&total_stats, &file_stats);
+    }
+#endif
+    if (STATS_ON) {
+        stats_print("total", &total_stats);
+        if (stats_stream != stderr && fclose(stats_stream) != 0) {
+            int err = errno;
+            diag("%s: close error on stats file: %s\n",
+                 PROG_NAME, strerror(err));
+            overall_rc = 1;
+        }
+    }
+
+    if (checksum_stream != NULL && checksum_stream != stderr &&
+        fclose(checksum_stream) != 0) {
+        int err = errno;
+        diag("%s: close error on checksum file: %s\n",
+             PROG_NAME, strerror(err));
+        overall_rc = 1;
+    }
+
+    /* Final flush: retry on EINTR; treat EPIPE on stdout as success. */
+    overall_rc |= (batch_flush() == WRITE_ERROR);
+    overall_rc |= tee_finish();
+    overall_rc |= flush_stream(stdout, "stdout", 1);
+    overall_rc |= flush_stream(stderr, NULL, 0); /* Cannot report to stderr. */
+
+    return (overall_rc == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* The library API of see.h. see_copy() runs the same copy_input() as a
+ * FILE operand, with the output probed from 'fd_out' instead of stdout;
+ * the other backends have no fds to take. */
+#ifdef SEE_FD_IO
+#ifdef SEE_HAVE_THREADS
+static see_mutex library_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* The globals one see_copy() runs with. copy_context_swap() trades them
+ * for those of the process, so a call starts from its own settings
+ * whatever see_run() left, and hands the process's back when done. */
+struct copy_context {
+    int                     opt_engine;
+    size_t                  opt_buffer_size;
+    unsigned                opt_transform;
+    int                     opt_slice;
+    int                     grep_count;
+    int                     tee_count;
+    int                     opt_checksum;
+    int                     opt_decompress;
+    see_u64                 opt_rate_limit;
+    int                     opt_cache;
+    int                     input_cache;
+    const struct see_range *input_ranges;
+    see_u64                 copy_limit;
+    int                     output_fd;
+    int                     output_is_stdout;
+    struct stat             stdout_stat;
+    int                     stdout_stat_ok;
+    size_t                  stdout_pipe_size;
+    int                     stdout_closed;
+    int                     stats_on;
+    struct see_stats        file_stats;
+    int                     diag_quiet;
+    int                     diag_errno;
+};
+
+#define COPY_SWAP(type, name) \
+    do { \
+        type swapped = name; \
+        name = c->name; \
+        c->name = swapped; \
+    } while (0)
+
+static void copy_context_swap(struct copy_context *c) {
+    COPY_SWAP(int, opt_engine);
+    COPY_SWAP(size_t, opt_buffer_size);
+    COPY_SWAP(unsigned, opt_transform);
+    COPY_SWAP(int, opt_slice);
+    COPY_SWAP(int, grep_count);
+    COPY_SWAP(int, tee_count);
+    COPY_SWAP(int, opt_checksum);
+    COPY_SWAP(int, opt_decompress);
+    COPY_SWAP(see_u64, opt_rate_limit);
+    COPY_SWAP(int, opt_cache);
+    COPY_SWAP(int, input_cache);
+    COPY_SWAP(const struct see_range *, input_ranges);
+    COPY_SWAP(see_u64, copy_limit);
+    COPY_SWAP(int, output_fd);
+    COPY_SWAP(int, output_is_stdout);
+    COPY_SWAP(struct stat, stdout_stat);
+    COPY_SWAP(int, stdout_stat_ok);
+    COPY_SWAP(size_t, stdout_pipe_size);
+    COPY_SWAP(int, stdout_closed);
+    COPY_SWAP(int, stats_on);
+    COPY_SWAP(struct see_stats, file_stats);
+    COPY_SWAP(int, diag_quiet);
+    COPY_SWAP(int, diag_errno);
+}
+
+int see_copy(int fd_in, int fd_out, const struct see_options *options,
+             struct see_copy_stats *stats) {
+    struct see_options opts;
+    struct see_range ranges[2];
+    struct copy_context call;
+    char name[32];
+    int status;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.length = SEE_LENGTH_ALL;
+    if (options != NULL) {
+        memcpy(&opts, options,
+               options->size < sizeof(opts) ? options->size : sizeof(opts));
+    }
+    if (opts.engine < SEE_ENGINE_AUTO || opts.engine > SEE_ENGINE_THREADED) {
+        errno = EINVAL;
+        return -1;
+    }
+    sprintf(name, "fd %d", fd_in);
+
+    /* A plain copy: no CLI transform, selection, tee or checksum. */
+    memset(&call, 0, sizeof(call));
+    call.opt_engine = opts.engine;
+    call.opt_slice = SLICE_NONE;
+    call.opt_checksum = CHECKSUM_NONE;
+    call.opt_cache = CACHE_KEEP;
+    call.input_cache = CACHE_KEEP;
+    call.copy_limit = NO_LIMIT;
+    call.output_fd = fd_out;
+    call.output_is_stdout = 0;
+    call.stats_on = (stats != NULL);
+    call.diag_quiet = 1; /* Failures are the caller's to report. */
+    if (opts.offset != 0 || opts.length != SEE_LENGTH_ALL) {
+        ranges[0].offset = opts.offset;
+        ranges[0].length = opts.length; /* SEE_LENGTH_ALL is NO_LIMIT */
+        ranges[1].offset = 0;
+        ranges[1].length = 0;
+        call.input_ranges = ranges;
+    }
+
+#ifdef SEE_HAVE_THREADS
+    mutex_lock(&library_lock);
+#endif
+    copy_context_swap(&call);
+    /* Buffers are sized for the automatic maximum once, then reused. */
+    status = (io_buf == NULL) ? buffer_setup() : 0;
+    if (status == 0) {
+        opt_buffer_size = opts.buffer_size < io_buf_size ? opts.buffer_size
+                                                         : io_buf_size;
+        output_setup();
+        status = copy_input(fd_in, name);
+#ifdef SEE_HAVE_BATCH
+        status |= (batch_flush() == WRITE_ERROR);
+#endif
+    }
+    copy_context_swap(&call);
+#ifdef SEE_HAVE_THREADS
+    mutex_unlock(&library_lock);
+#endif
+
+    if (stats != NULL) {
+        memset(stats, 0, sizeof(*stats));
+        stats->bytes = call.file_stats.bytes;
+        stats->reads = call.file_stats.reads;
+        stats->writes = call.file_stats.writes;
+        stats->copies = call.file_stats.copies;
+        stats->read_seconds = call.file_stats.read_time;
+        stats->write_seconds = call.file_stats.write_time;
+        stats->engines = call.file_stats.engines;
+    }
+    if (status == 0) {
+        return call.stdout_closed ? 1 : 0;
+    }
+    errno = (call.diag_errno != 0) ? call.diag_errno : EIO;
+    return -1;
+}
+#else
+int see_copy(int fd_in, int fd_out, const struct see_options *options,
+             struct see_copy_stats *stats) {
+    (void)fd_in;
+    (void)fd_out;
+    (void)options;
+    (void)stats;
+    errno = ENOSYS;
+    return -1;
+}
+#endif
+
+const char *see_engine_name(int engine) {
+    if (engine < 0 ||
+        engine >= (int)(sizeof(engine_names) / sizeof(engine_names[0]))) {
+        return NULL;
+    }
+    return engine_names[engine];
+}
+
+int see_run(int argc, char *argv[]) {
+    platform_setup();
+    return see_main(argc, argv);
+}
+
+/* The program itself; libsee is built with -DSEE_LIBRARY and leaves it
+ * out. */
+#ifndef SEE_LIBRARY
+#ifdef SEE_WIN32_IO
+/* Windows passes the command line as UTF-16. Converting it to UTF-8 here,
+ * and back in open_input(), keeps paths outside the ANSI code page. */
+int wmain(int argc, wchar_t *argv[]) {
+    char **args = (char **)malloc(((size_t)argc + 1) * sizeof(*args));
+    int i;
+
+    if (args == NULL) {
+        diag("%s: %s\n", PROG_NAME, strerror(ENOMEM));
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < argc; ++i) {
+        int len = WideCharToMultiByte(CP_UTF8, 0, argv[i], -1, NULL, 0,
+                                      NULL, NULL);
+
+        args[i] = (len > 0) ? (char *)malloc((size_t)len) : NULL;
+        if (args[i] == NULL ||
+            WideCharToMultiByte(CP_UTF8, 0, argv[i], -1, args[i], len, NULL,
+                                NULL) <= 0) {
+            diag("%s: cannot convert arguments to UTF-8\n",
+                 PROG_NAME);
+            return EXIT_FAILURE;
+        }
+    }
+    args[argc] = NULL;
+    return see_run(argc, args);
+}
+#else
+int main(int argc, char *argv[]) {
+    return see_run(argc, argv);
+}
+#endif
+#endif